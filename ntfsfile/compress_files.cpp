@@ -7,6 +7,7 @@
 #include "dlgapi.h"
 #include "log.h"
 #include "options.h"
+#include "ntfs_core/ntfs_core.h"
 #include "volume.h"
 #include "defragment.h"
 #include "compress_files.h"
@@ -7,8 +7,8 @@
 #include "options.h"
 #include "dlgapi.h"
 #include "content.h"
-
-#include "crc16.cpp"
+#include "ntfs_core/crc.h"
+#include "ntfs_core/sha.h"
 
 extern struct PluginStartupInfo g_far;
 extern Array<FarColor> g_colors;
@@ -374,43 +374,6 @@ void show_result_dialog(const UnicodeString& file_name, const ContentOptions& op
   dlg.show(result_dlg_proc);
 }
 
-void ed2k_update_block_hashes(const u8* buffer, unsigned buffer_size, Array<u8>& block_hashes, unsigned& last_block_slack, MD4_CTX& md4_ctx) {
-  const unsigned c_ed2k_block_size = 9500 * 1024;
-  if (last_block_slack > buffer_size) {
-    MD4_Update(&md4_ctx, buffer, buffer_size);
-    last_block_slack -= buffer_size;
-  }
-  else {
-    if (last_block_slack != 0) {
-      // finish previous partial block
-      MD4_Update(&md4_ctx, buffer, last_block_slack);
-      u8 md4[MD4_DIGEST_LENGTH];
-      MD4_Final(md4, &md4_ctx);
-      block_hashes.add(md4, sizeof(md4));
-    }
-    // process whole blocks
-    unsigned idx = last_block_slack;
-    while (idx + c_ed2k_block_size <= buffer_size) {
-      MD4_Init(&md4_ctx);
-      MD4_Update(&md4_ctx, buffer + idx, c_ed2k_block_size);
-      u8 md4[MD4_DIGEST_LENGTH];
-      MD4_Final(md4, &md4_ctx);
-      block_hashes.add(md4, sizeof(md4));
-      idx += c_ed2k_block_size;
-    }
-    if (idx < buffer_size) {
-      // process last partial block
-      MD4_Init(&md4_ctx);
-      MD4_Update(&md4_ctx, buffer + idx, buffer_size - idx);
-      last_block_slack = c_ed2k_block_size - (buffer_size - idx);
-    }
-    else {
-      // there is no partial block present at the end
-      last_block_slack = 0;
-    }
-  }
-}
-
 Array<u8> ed2k_finalize_block_hashes(Array<u8>& block_hashes, unsigned last_block_slack, MD4_CTX& md4_ctx) {
   u8 md4[MD4_DIGEST_LENGTH];
   // if there is unfinished block
@@ -447,25 +410,6 @@ enum BufState {
   bs_processing,
 };
 
-struct SharedData {
-  unsigned num_th;
-  unsigned num_buf;
-  Array<BufState> buffer_state;
-  u8* buffer;
-  unsigned buffer_size;
-  Array<unsigned> buffer_data_size;
-  u8* comp_buffer;
-  unsigned comp_buffer_size;
-  u8* comp_work_buffer;
-  unsigned comp_work_buffer_size;
-  HANDLE h_stop_event;
-  CRITICAL_SECTION sync;
-  HANDLE h_io_ready_sem;
-  HANDLE h_proc_ready_sem;
-  u64 data_size;
-  u64 comp_size;
-};
-
 template<typename Data> bool compress_buffer(Data* d) {
   unsigned buf_idx;
   EnterCriticalSection(&d->sync);
@@ -517,6 +461,512 @@ template<typename Data> unsigned __stdcall wth_proc(void* wth_param) {
   }
 }
 
+// digest computed by its own pipeline thread, buffers are passed in file order
+class Digest {
+public:
+  virtual ~Digest() {
+  }
+  virtual void update(const u8* buffer, unsigned size) = 0;
+  virtual void final(ContentInfo& result) = 0;
+};
+
+class Crc32Digest: public Digest {
+private:
+  u32 crc32;
+public:
+  Crc32Digest(): crc32(0) {
+  }
+  virtual void update(const u8* buffer, unsigned size) {
+    crc32 = crc32_update(crc32, buffer, size);
+  }
+  virtual void final(ContentInfo& result) {
+    const u8* c = (const u8*) &crc32;
+    result.crc32.copy(c[3]).add(c[2]).add(c[1]).add(c[0]);
+  }
+};
+
+class Md5Digest: public Digest {
+private:
+  MD5_CTX md5_ctx;
+public:
+  Md5Digest() {
+    MD5_Init(&md5_ctx);
+  }
+  virtual void update(const u8* buffer, unsigned size) {
+    MD5_Update(&md5_ctx, buffer, size);
+  }
+  virtual void final(ContentInfo& result) {
+    u8 md5[MD5_DIGEST_LENGTH];
+    MD5_Final(md5, &md5_ctx);
+    result.md5.copy(md5, sizeof(md5));
+  }
+};
+
+class Sha1Digest: public Digest {
+private:
+  SHA_CTX sha1_ctx;
+public:
+  Sha1Digest() {
+    SHA1_Init(&sha1_ctx);
+  }
+  virtual void update(const u8* buffer, unsigned size) {
+    SHA1_Update(&sha1_ctx, buffer, size);
+  }
+  virtual void final(ContentInfo& result) {
+    u8 sha1[SHA_DIGEST_LENGTH];
+    SHA1_Final(sha1, &sha1_ctx);
+    result.sha1.copy(sha1, sizeof(sha1));
+  }
+};
+
+class Sha256Digest: public Digest {
+private:
+  SHA256_CTX sha256_ctx;
+public:
+  Sha256Digest() {
+    SHA256_Init(&sha256_ctx);
+  }
+  virtual void update(const u8* buffer, unsigned size) {
+    SHA256_Update(&sha256_ctx, buffer, size);
+  }
+  virtual void final(ContentInfo& result) {
+    u8 sha256[SHA256_DIGEST_LENGTH];
+    SHA256_Final(sha256, &sha256_ctx);
+    result.sha256.copy(sha256, sizeof(sha256));
+  }
+};
+
+// SHA extensions backend, used instead of OpenSSL when CPU supports them
+template<class Hash> class ShaNiDigest: public Digest {
+private:
+  Hash hash;
+  Array<u8> ContentInfo::* field;
+public:
+  ShaNiDigest(Array<u8> ContentInfo::* field): hash(sk_shani), field(field) {
+  }
+  virtual void update(const u8* buffer, unsigned size) {
+    hash.update(buffer, size);
+  }
+  virtual void final(ContentInfo& result) {
+    u8 digest[Hash::c_digest_size];
+    hash.final(digest);
+    (result.*field).copy(digest, sizeof(digest));
+  }
+};
+
+// ed2k blocks are hashed independently: full blocks are collected into batch and hashed on all CPUs
+class Ed2kDigest: public Digest {
+private:
+  static const unsigned c_block_size = 9500 * 1024;
+  struct HashBlocksTask: public ParallelTask {
+    const u8* data;
+    u8* hashes;
+    virtual void run(unsigned idx) {
+      MD4_CTX md4_ctx;
+      MD4_Init(&md4_ctx);
+      MD4_Update(&md4_ctx, data + static_cast<size_t>(idx) * c_block_size, c_block_size);
+      MD4_Final(hashes + idx * MD4_DIGEST_LENGTH, &md4_ctx);
+    }
+  };
+  unsigned batch_block_cnt;
+  std::vector<u8> batch; // grows up to batch_block_cnt blocks
+  size_t batch_size;
+  Array<u8> block_hashes;
+
+  void hash_batch(unsigned block_cnt) {
+    std::vector<u8> hashes(block_cnt * MD4_DIGEST_LENGTH);
+    HashBlocksTask task;
+    task.data = batch.data();
+    task.hashes = hashes.data();
+    run_parallel(task, block_cnt);
+    block_hashes.add(hashes.data(), static_cast<unsigned>(hashes.size()));
+  }
+public:
+  Ed2kDigest(): batch_block_cnt(min(get_cpu_count(), 8u)), batch_size(0) {
+  }
+  virtual void update(const u8* buffer, unsigned size) {
+    const size_t batch_capacity = static_cast<size_t>(batch_block_cnt) * c_block_size;
+    while (size != 0) {
+      unsigned part = static_cast<unsigned>(min(static_cast<size_t>(size), batch_capacity - batch_size));
+      if (batch.size() < batch_size + part) batch.resize(batch_size + part);
+      memcpy(batch.data() + batch_size, buffer, part);
+      batch_size += part;
+      buffer += part;
+      size -= part;
+      if (batch_size == batch_capacity) {
+        hash_batch(batch_block_cnt);
+        batch_size = 0;
+      }
+    }
+  }
+  virtual void final(ContentInfo& result) {
+    unsigned block_cnt = static_cast<unsigned>(batch_size / c_block_size);
+    if (block_cnt != 0) hash_batch(block_cnt);
+    unsigned last_block_size = static_cast<unsigned>(batch_size % c_block_size);
+    MD4_CTX md4_ctx;
+    if (last_block_size != 0) {
+      MD4_Init(&md4_ctx);
+      MD4_Update(&md4_ctx, batch.data() + static_cast<size_t>(block_cnt) * c_block_size, last_block_size);
+    }
+    result.ed2k = ed2k_finalize_block_hashes(block_hashes, last_block_size != 0 ? c_block_size - last_block_size : 0, md4_ctx);
+  }
+};
+
+class Crc16Digest: public Digest {
+private:
+  u16 crc16;
+public:
+  Crc16Digest(): crc16(0xFFFF) {
+  }
+  virtual void update(const u8* buffer, unsigned size) {
+    crc16 = crc16_update(crc16, buffer, size);
+  }
+  virtual void final(ContentInfo& result) {
+    const u8* c = (const u8*) &crc16;
+    result.crc16.copy(c[1]).add(c[0]);
+  }
+};
+
+const unsigned c_ui_wait_time = 100; // ms
+const unsigned c_comp_unit_size = 16 * 4 * 1024; // NTFS compression unit = 16 clusters
+
+// content processing pipeline: I/O thread keeps queue_depth unbuffered reads in flight through completion port
+// and hands completed blocks in file order to all consumers:
+// one thread per enabled digest (takes blocks in file order) and compression threads (any order)
+// buffer holds reference for every consumer and is reused for I/O when the last one is released
+struct ContentPipeline {
+  struct Buffer {
+    u8* data;
+    unsigned data_size;
+    u64 seq; // block number in file order
+    bool free;
+    bool io_done; // read completed, waits for previous blocks (I/O thread only)
+    bool ready; // handed to consumers
+    bool comp_pending;
+    volatile LONG ref_cnt;
+    OVERLAPPED ov;
+  };
+  struct DigestWorker {
+    ContentPipeline* pipeline;
+    std::unique_ptr<Digest> digest;
+    Semaphore ready_sem; // released once per published buffer
+    u64 next_seq;
+    DigestWorker(ContentPipeline* pipeline, Digest* digest, unsigned num_buf): pipeline(pipeline), digest(digest), ready_sem(0, num_buf), next_seq(0) {
+    }
+  };
+  struct CompWorker {
+    ContentPipeline* pipeline;
+    std::vector<u8> comp_buffer;
+    std::vector<u8> work_buffer;
+    CompWorker(ContentPipeline* pipeline): pipeline(pipeline), comp_buffer(c_comp_unit_size + c_comp_unit_size / 16 + 64 + 3), work_buffer(LZO1X_1_MEM_COMPRESS) {
+    }
+  };
+  unsigned buffer_size;
+  unsigned queue_depth;
+  unsigned num_buf;
+  std::vector<Buffer> buffers;
+  u8* buffer_mem;
+  std::vector<std::unique_ptr<DigestWorker>> digest_workers;
+  std::vector<std::unique_ptr<CompWorker>> comp_workers;
+  unsigned consumer_cnt;
+  u64 next_seq; // next block to hand to consumers
+  CriticalSection sync;
+  Event stop_event;
+  Semaphore io_ready_sem;
+  Semaphore comp_ready_sem;
+  u64 data_size; // fully processed data
+  u64 comp_size;
+
+  ContentPipeline(const ContentOptions& options, unsigned buffer_size, unsigned queue_depth, unsigned comp_th_cnt):
+    buffer_size(buffer_size), queue_depth(queue_depth), num_buf(queue_depth + max(comp_th_cnt, 2u)), buffer_mem(NULL), next_seq(0), stop_event(true, false),
+    io_ready_sem(num_buf, num_buf), comp_ready_sem(0, num_buf), data_size(0), comp_size(0) {
+    if (options.crc32) add_digest(new Crc32Digest());
+    if (options.md5) add_digest(new Md5Digest());
+    bool shani = sha_kernel() == sk_shani;
+    if (options.sha1) add_digest(shani ? static_cast<Digest*>(new ShaNiDigest<Sha1>(&ContentInfo::sha1)) : new Sha1Digest());
+    if (options.sha256) add_digest(shani ? static_cast<Digest*>(new ShaNiDigest<Sha256>(&ContentInfo::sha256)) : new Sha256Digest());
+    if (options.ed2k) add_digest(new Ed2kDigest());
+    if (options.crc16) add_digest(new Crc16Digest());
+    for (unsigned i = 0; i < comp_th_cnt; i++) {
+      comp_workers.push_back(std::unique_ptr<CompWorker>(new CompWorker(this)));
+    }
+    consumer_cnt = static_cast<unsigned>(digest_workers.size()) + (comp_th_cnt != 0 ? 1 : 0);
+
+    // unbuffered I/O needs sector aligned buffers
+    buffer_mem = static_cast<u8*>(VirtualAlloc(NULL, static_cast<SIZE_T>(buffer_size) * num_buf, MEM_COMMIT, PAGE_READWRITE));
+    CHECK_SYS(buffer_mem != NULL);
+    Buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.free = true;
+    for (unsigned i = 0; i < num_buf; i++) {
+      buffer.data = buffer_mem + static_cast<SIZE_T>(i) * buffer_size;
+      buffers.push_back(buffer);
+    }
+  }
+  ~ContentPipeline() {
+    if (buffer_mem) VERIFY(VirtualFree(buffer_mem, 0, MEM_RELEASE) != 0);
+  }
+
+  void add_digest(Digest* digest) {
+    digest_workers.push_back(std::unique_ptr<DigestWorker>(new DigestWorker(this, digest, num_buf)));
+  }
+
+  unsigned get_free_buffer() {
+    CriticalSectionLock lock(sync);
+    unsigned buf_idx;
+    for (buf_idx = 0; !buffers[buf_idx].free; buf_idx++);
+    buffers[buf_idx].free = false;
+    buffers[buf_idx].io_done = false;
+    buffers[buf_idx].ready = false;
+    return buf_idx;
+  }
+
+  void release_buffer(unsigned buf_idx) {
+    if (InterlockedDecrement(&buffers[buf_idx].ref_cnt) != 0) return;
+    {
+      CriticalSectionLock lock(sync);
+      data_size += buffers[buf_idx].data_size;
+      buffers[buf_idx].free = true;
+    }
+    CHECK_SYS(ReleaseSemaphore(io_ready_sem.handle(), 1, NULL) != 0);
+  }
+
+  // hand completed blocks to all consumers in file order
+  void publish() {
+    while (true) {
+      unsigned buf_idx;
+      {
+        CriticalSectionLock lock(sync);
+        for (buf_idx = 0; (buf_idx < num_buf) && (buffers[buf_idx].free || !buffers[buf_idx].io_done || buffers[buf_idx].ready || (buffers[buf_idx].seq != next_seq)); buf_idx++);
+        if (buf_idx == num_buf) break;
+        Buffer& buffer = buffers[buf_idx];
+        buffer.ready = true;
+        buffer.comp_pending = !comp_workers.empty();
+        buffer.ref_cnt = consumer_cnt + 1; // I/O thread reference
+        next_seq++;
+      }
+      for (unsigned i = 0; i < digest_workers.size(); i++) {
+        CHECK_SYS(ReleaseSemaphore(digest_workers[i]->ready_sem.handle(), 1, NULL) != 0);
+      }
+      if (!comp_workers.empty()) CHECK_SYS(ReleaseSemaphore(comp_ready_sem.handle(), 1, NULL) != 0);
+      release_buffer(buf_idx);
+    }
+  }
+
+  bool update_digest(DigestWorker& worker) {
+    unsigned buf_idx;
+    {
+      CriticalSectionLock lock(sync);
+      for (buf_idx = 0; (buf_idx < num_buf) && (buffers[buf_idx].free || !buffers[buf_idx].ready || (buffers[buf_idx].seq != worker.next_seq)); buf_idx++);
+      if (buf_idx == num_buf) return false;
+    }
+    worker.digest->update(buffers[buf_idx].data, buffers[buf_idx].data_size);
+    worker.next_seq++;
+    release_buffer(buf_idx);
+    return true;
+  }
+
+  bool compress(CompWorker& worker) {
+    unsigned buf_idx;
+    {
+      CriticalSectionLock lock(sync);
+      for (buf_idx = 0; (buf_idx < num_buf) && (buffers[buf_idx].free || !buffers[buf_idx].comp_pending); buf_idx++);
+      if (buf_idx == num_buf) return false;
+      buffers[buf_idx].comp_pending = false;
+    }
+    const Buffer& buffer = buffers[buf_idx];
+    // NTFS compresses every unit separately
+    u64 size = 0;
+    for (unsigned pos = 0; pos < buffer.data_size; pos += c_comp_unit_size) {
+      unsigned unit_size = min(c_comp_unit_size, buffer.data_size - pos);
+      lzo_uint unit_comp_size;
+      CHECK_LZO(lzo1x_1_compress(buffer.data + pos, unit_size, worker.comp_buffer.data(), &unit_comp_size, worker.work_buffer.data()));
+      size += min(unit_comp_size, unit_size);
+    }
+    {
+      CriticalSectionLock lock(sync);
+      comp_size += size;
+    }
+    release_buffer(buf_idx);
+    return true;
+  }
+
+  // wait for next buffer; after stop is signaled remaining buffers are processed
+  template<class F> void consume(HANDLE h_ready_sem, F& f) {
+    while (true) {
+      HANDLE h[2] = { stop_event.handle(), h_ready_sem };
+      DWORD w = WaitForMultipleObjects(2, h, FALSE, INFINITE);
+      CHECK_SYS(w != WAIT_FAILED);
+      if (w == WAIT_OBJECT_0) {
+        while (f());
+        break;
+      }
+      else VERIFY(f());
+    }
+  }
+
+  static unsigned __stdcall digest_proc(void* param) {
+    DigestWorker* worker = static_cast<DigestWorker*>(param);
+    try {
+      struct Update {
+        DigestWorker* worker;
+        bool operator()() {
+          return worker->pipeline->update_digest(*worker);
+        }
+      };
+      Update update = { worker };
+      worker->pipeline->consume(worker->ready_sem.handle(), update);
+      return TRUE;
+    }
+    catch (...) {
+      return FALSE;
+    }
+  }
+
+  static unsigned __stdcall comp_proc(void* param) {
+    CompWorker* worker = static_cast<CompWorker*>(param);
+    try {
+      struct Compress {
+        CompWorker* worker;
+        bool operator()() {
+          return worker->pipeline->compress(*worker);
+        }
+      };
+      Compress compress = { worker };
+      worker->pipeline->consume(worker->pipeline->comp_ready_sem.handle(), compress);
+      return TRUE;
+    }
+    catch (...) {
+      return FALSE;
+    }
+  }
+
+  template<class Progress> void run(HANDLE h_file, u64 file_size, Progress& progress) {
+    Array<HANDLE> h_threads;
+    HANDLE h_port = NULL;
+    unsigned io_cnt = 0; // reads in flight
+    try {
+      for (unsigned i = 0; i < digest_workers.size(); i++) {
+        unsigned th_id;
+        HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, digest_proc, digest_workers[i].get(), 0, &th_id));
+        CHECK_SYS(h != NULL);
+        h_threads += h;
+      }
+      for (unsigned i = 0; i < comp_workers.size(); i++) {
+        unsigned th_id;
+        HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, comp_proc, comp_workers[i].get(), 0, &th_id));
+        CHECK_SYS(h != NULL);
+        h_threads += h;
+      }
+      // keep UI responsive when compression loads all CPUs
+      if (!comp_workers.empty()) CHECK_SYS(SetThreadPriority(h_threads.last(), THREAD_PRIORITY_BELOW_NORMAL) != 0);
+
+      h_port = CreateIoCompletionPort(h_file, NULL, 0, 0);
+      CHECK_SYS(h_port != NULL);
+
+      Array<HANDLE> h = io_ready_sem.handle() + h_threads;
+      u64 file_ptr = 0;
+      u64 io_seq = 0;
+      bool eof = file_size == 0;
+      while (true) {
+        // start reads until queue is full or no buffer is free
+        while (!eof && (io_cnt < queue_depth)) {
+          DWORD w = WaitForMultipleObjects(h.size(), h.data(), FALSE, io_cnt != 0 ? 0 : c_ui_wait_time);
+          if (w == WAIT_TIMEOUT) {
+            if (io_cnt != 0) break;
+            progress.update_ui();
+            continue;
+          }
+          CHECK_SYS(w != WAIT_FAILED);
+          CHECK_MSG(w == WAIT_OBJECT_0, L"Unexpected thread death");
+
+          unsigned buf_idx = get_free_buffer();
+          Buffer& buffer = buffers[buf_idx];
+          buffer.seq = io_seq;
+          memset(&buffer.ov, 0, sizeof(buffer.ov));
+          buffer.ov.Offset = (DWORD) (file_ptr & 0xFFFFFFFF);
+          buffer.ov.OffsetHigh = (DWORD) ((file_ptr >> 32) & 0xFFFFFFFF);
+          if (ReadFile(h_file, buffer.data, buffer_size, NULL, &buffer.ov) == 0) {
+            DWORD last_error = GetLastError();
+            if (last_error == ERROR_HANDLE_EOF) {
+              // file was truncated, no completion packet is queued
+              buffer.ref_cnt = 1;
+              buffer.data_size = 0;
+              release_buffer(buf_idx);
+              eof = true;
+              break;
+            }
+            CHECK_SYS(last_error == ERROR_IO_PENDING);
+          }
+          io_cnt++;
+          io_seq++;
+          file_ptr += buffer_size;
+          if (file_ptr >= file_size) eof = true;
+        }
+        if (io_cnt == 0) break;
+
+        DWORD size;
+        ULONG_PTR key;
+        OVERLAPPED* ov;
+        if (GetQueuedCompletionStatus(h_port, &size, &key, &ov, c_ui_wait_time) == 0) {
+          if (ov == NULL) {
+            CHECK_SYS(GetLastError() == WAIT_TIMEOUT);
+            progress.update_ui();
+            continue;
+          }
+          io_cnt--;
+          CHECK_SYS(GetLastError() == ERROR_HANDLE_EOF);
+          size = 0;
+        }
+        else io_cnt--;
+        Buffer* buffer = CONTAINING_RECORD(ov, Buffer, ov);
+        buffer->data_size = size;
+        buffer->io_done = true;
+        // short read marks end of file
+        if (size < buffer_size) eof = true;
+        publish();
+        progress.update_ui();
+      }
+
+      // let consumers finish remaining buffers
+      CHECK_SYS(SetEvent(stop_event.handle()) != 0);
+      if (h_threads.size() != 0) {
+        DWORD w;
+        while ((w = WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, c_ui_wait_time)) == WAIT_TIMEOUT) progress.update_ui();
+        CHECK_SYS(w != WAIT_FAILED);
+      }
+      for (unsigned i = 0; i < h_threads.size(); i++) {
+        DWORD exit_code;
+        CHECK_SYS(GetExitCodeThread(h_threads[i], &exit_code) != 0);
+        CHECK_MSG(exit_code == TRUE, L"Unexpected thread death");
+      }
+    }
+    finally (
+      // buffers must outlive reads in flight
+      if (io_cnt != 0) {
+        CancelIo(h_file);
+        while (io_cnt != 0) {
+          DWORD size;
+          ULONG_PTR key;
+          OVERLAPPED* ov;
+          if ((GetQueuedCompletionStatus(h_port, &size, &key, &ov, INFINITE) == 0) && (ov == NULL)) break;
+          io_cnt--;
+        }
+      }
+      if (h_port != NULL) VERIFY(CloseHandle(h_port) != 0);
+      VERIFY(SetEvent(stop_event.handle()) != 0);
+      if (h_threads.size() != 0) VERIFY(WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE) != WAIT_FAILED);
+      for (unsigned i = 0; i < h_threads.size(); i++) {
+        VERIFY(CloseHandle(h_threads[i]) != 0);
+      }
+    );
+  }
+
+  void final(ContentInfo& result) {
+    for (unsigned i = 0; i < digest_workers.size(); i++) digest_workers[i]->digest->final(result);
+  }
+};
+
 class ProcessFileProgress: public ProgressMonitor {
 protected:
   virtual void do_update_ui() {
@@ -525,12 +975,11 @@ protected:
 
     u64 data_size;
     u64 comp_size;
-    if (sd.num_th != 0) EnterCriticalSection(&sd.sync);
-    try {
-      data_size = sd.data_size;
-      comp_size = sd.comp_size;
+    {
+      CriticalSectionLock lock(pipeline.sync);
+      data_size = pipeline.data_size;
+      comp_size = pipeline.comp_size;
     }
-    finally (if (sd.num_th != 0) LeaveCriticalSection(&sd.sync));
     u64 file_size = result.file_size;
     u64 time = time_elapsed();
 
@@ -578,235 +1027,42 @@ protected:
     far_set_progress_value(percent_done, 100);
   }
 public:
-  SharedData& sd;
+  ContentPipeline& pipeline;
   const ContentInfo& result;
   const ContentOptions& options;
-  ProcessFileProgress(SharedData& sd, const ContentInfo& result, const ContentOptions& options): ProgressMonitor(true), sd(sd), result(result), options(options) {
+  ProcessFileProgress(ContentPipeline& pipeline, const ContentInfo& result, const ContentOptions& options): ProgressMonitor(true), pipeline(pipeline), result(result), options(options) {
   }
 };
 
 void process_file_content(const UnicodeString& file_name, const ContentOptions& options, ContentInfo& result) {
   ALLOC_RSRC(HANDLE h_scr = g_far.SaveScreen(0, 0, -1, -1));
 
-  SharedData sd;
+  unsigned block_size = min(max(g_content_io_block_size, 1u), 8u) * 1024 * 1024;
+  unsigned queue_depth = min(max(g_content_io_queue_depth, 1u), 32u);
+  unsigned digest_cnt = (options.crc32 ? 1 : 0) + (options.md5 ? 1 : 0) + (options.sha1 ? 1 : 0) + (options.sha256 ? 1 : 0) + (options.ed2k ? 1 : 0) + (options.crc16 ? 1 : 0);
+  // I/O thread waits for buffer or death of any pipeline thread
+  unsigned comp_th_cnt = options.compression ? min(get_cpu_count(), MAXIMUM_WAIT_OBJECTS - 1 - digest_cnt) : 0;
+  ContentPipeline pipeline(options, block_size, queue_depth, comp_th_cnt);
+  ProcessFileProgress progress(pipeline, result, options);
 
-  sd.buffer_size = 16 * 4 * 1024; // NTFS compression unit = 16 clusters
+  ALLOC_RSRC(HANDLE h_file = CreateFileW(long_path(file_name).data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_POSIX_SEMANTICS | FILE_FLAG_SEQUENTIAL_SCAN, NULL); CHECK_SYS(h_file != INVALID_HANDLE_VALUE));
 
-  SYSTEM_INFO sys_info;
-  GetSystemInfo(&sys_info);
-  sd.num_th = options.compression ? (sys_info.dwNumberOfProcessors > 1 ? sys_info.dwNumberOfProcessors : 0) : 0;
-  sd.num_buf = options.compression ? sys_info.dwNumberOfProcessors * 2 : 2;
-
-  ALLOC_RSRC(if (sd.num_th != 0) { sd.h_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL); CHECK_SYS(sd.h_stop_event != NULL); });
-  ALLOC_RSRC(if (sd.num_th != 0) InitializeCriticalSection(&sd.sync););
-  ALLOC_RSRC(if (sd.num_th != 0) { sd.h_io_ready_sem = CreateSemaphore(NULL, sd.num_buf, sd.num_buf, NULL); CHECK_SYS(sd.h_io_ready_sem != NULL); });
-  ALLOC_RSRC(if (sd.num_th != 0) { sd.h_proc_ready_sem = CreateSemaphore(NULL, 0, sd.num_buf, NULL); CHECK_SYS(sd.h_proc_ready_sem != NULL); });
-  ALLOC_RSRC(HANDLE h_io_event = CreateEvent(NULL, TRUE, FALSE, NULL); CHECK_SYS(h_io_event != NULL)); // async. I/O event
-  ALLOC_RSRC(sd.buffer = (u8*) VirtualAlloc(NULL, sd.buffer_size * sd.num_buf, MEM_COMMIT, PAGE_READWRITE); CHECK_SYS(sd.buffer != NULL));
-  sd.comp_buffer_size = sd.buffer_size + sd.buffer_size / 16 + 64 + 3;
-  ALLOC_RSRC(if (options.compression) { sd.comp_buffer = new u8[sd.comp_buffer_size * (sd.num_th != 0 ? sd.num_buf : 1)]; });
-  sd.comp_work_buffer_size = LZO1X_1_MEM_COMPRESS;
-  ALLOC_RSRC(if (options.compression) { sd.comp_work_buffer = new u8[sd.comp_work_buffer_size * (sd.num_th != 0 ? sd.num_buf : 1)]; });
-
-  for (unsigned i = 0; i < sd.num_buf; i++) {
-    sd.buffer_state += bs_io_ready;
-    sd.buffer_data_size += 0;
-  }
-
-  sd.data_size = 0; // file data size
-  sd.comp_size = 0; // compressed file size
-
-  // crc32 checksum
-  u32 crc32 = 0;
-  // MD5 hash
-  MD5_CTX md5_ctx;
-  MD5_Init(&md5_ctx);
-  // SHA1 hash
-  SHA_CTX sha1_ctx;
-  SHA1_Init(&sha1_ctx);
-  // SHA256 hash
-  SHA256_CTX sha256_ctx;
-  SHA256_Init(&sha256_ctx);
-  // ed2k hash
-  Array<u8> ed2k_block_hashes;
-  unsigned ed2k_last_block_slack = 0;
-  MD4_CTX md4_ctx;
-  // crc16 checksum
-  u16 crc16 = CRC16::init();
+  // determine file size
+  DWORD fsize_hi;
+  DWORD fsize_lo = GetFileSize(h_file, &fsize_hi);
+  CHECK_SYS((fsize_lo != INVALID_FILE_SIZE) || (GetLastError() == NO_ERROR));
+  result.file_size = ((u64) fsize_hi << 32) | fsize_lo;
 
-  ProcessFileProgress progress(sd, result, options);
-
-  // create compression threads
-  ALLOC_RSRC(Array<HANDLE> h_wth);
-  for (unsigned i = 0; i < sd.num_th; i++) {
-    unsigned th_id;
-    HANDLE h = (HANDLE) _beginthreadex(NULL, 0, wth_proc<SharedData>, &sd, 0, &th_id);
-    CHECK_SYS(h != NULL);
-    h_wth += h;
-  }
-  try {
-    if (sd.num_th != 0) CHECK_SYS(SetThreadPriority(h_wth.last(), THREAD_PRIORITY_BELOW_NORMAL) != 0);
-
-    ALLOC_RSRC(HANDLE h_file = CreateFileW(long_path(file_name).data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_POSIX_SEMANTICS | FILE_FLAG_SEQUENTIAL_SCAN, NULL); CHECK_SYS(h_file != INVALID_HANDLE_VALUE));
-
-    // determine file size
-    DWORD fsize_hi;
-    DWORD fsize_lo = GetFileSize(h_file, &fsize_hi);
-    CHECK_SYS((fsize_lo != INVALID_FILE_SIZE) || (GetLastError() == NO_ERROR));
-    result.file_size = ((u64) fsize_hi << 32) | fsize_lo;
-
-    unsigned prev_buf_idx = -1; // previous I/O buffer
-    u64 file_ptr = 0; // file pointer
-    OVERLAPPED ov; // overlapped I/O structure
-    DWORD last_error; // file read operation result
-
-    // file read loop
-    Array<HANDLE> h = sd.h_io_ready_sem + h_wth;
-    bool eof = false;
-    while (!eof) {
-      if (sd.num_th != 0) {
-        DWORD w = WaitForMultipleObjects(h.size(), h.data(), FALSE, INFINITE);
-        CHECK_SYS(w != WAIT_FAILED);
-        CHECK_MSG(w == WAIT_OBJECT_0, L"Unexpected thread death");
-      }
-
-      // find buffer ready for I/O
-      unsigned buf_idx = 0;
-      if (sd.num_th != 0) {
-        EnterCriticalSection(&sd.sync);
-        try {
-          buf_idx = sd.buffer_state.search(bs_io_ready);
-          assert(buf_idx != -1);
-          sd.buffer_state.item(buf_idx) = bs_io_in_progress;
-        }
-        finally (LeaveCriticalSection(&sd.sync));
-      }
-      else {
-        if (prev_buf_idx == 0) buf_idx = 1;
-      }
-
-      // specify file read offset
-      memset(&ov, 0, sizeof(ov));
-      ov.Offset = (DWORD) (file_ptr & 0xFFFFFFFF);
-      ov.OffsetHigh = (DWORD) ((file_ptr >> 32) & 0xFFFFFFFF);
-      ov.hEvent = h_io_event;
-
-      unsigned buffer_data_size;
-      ReadFile(h_file, sd.buffer + buf_idx * sd.buffer_size, sd.buffer_size, (LPDWORD) &buffer_data_size, &ov);
-      last_error = GetLastError();
-
-      CHECK_SYS((last_error == NO_ERROR) || (last_error == ERROR_IO_PENDING) || (last_error == ERROR_HANDLE_EOF));
-
-      // process previous I/O buffer while async. I/O is in progress
-      if (prev_buf_idx != -1) {
-        u8* buffer = sd.buffer + prev_buf_idx * sd.buffer_size;
-        unsigned size = sd.buffer_data_size[prev_buf_idx];
-        if (sd.num_th == 0) {
-          if (options.compression) {
-            lzo_uint comp_size;
-            CHECK_LZO(lzo1x_1_compress(buffer, size, sd.comp_buffer, &comp_size, sd.comp_work_buffer));
-            sd.comp_size += min(comp_size, size);
-          }
-          sd.data_size += size;
-        }
-        if (options.crc32) crc32 = lzo_crc32(crc32, buffer, size);
-        if (options.md5) MD5_Update(&md5_ctx, buffer, size);
-        if (options.sha1) SHA1_Update(&sha1_ctx, buffer, size);
-        if (options.sha256) SHA256_Update(&sha256_ctx, buffer, size);
-        if (options.ed2k) ed2k_update_block_hashes(buffer, size, ed2k_block_hashes, ed2k_last_block_slack, md4_ctx);
-        if (options.crc16) crc16 = CRC16::update(crc16, buffer, size);
-      }
-
-      progress.update_ui();
-
-      // check for end of file
-      eof = last_error == ERROR_HANDLE_EOF;
-      // determine number of bytes returned by last read operation
-      if (last_error == ERROR_IO_PENDING) {
-        // asynchronous operation
-        if (GetOverlappedResult(h_file, &ov, (LPDWORD) &buffer_data_size, TRUE) == 0) {
-          // check for end of file
-          if (GetLastError() == ERROR_HANDLE_EOF) eof = true;
-          // else async. operation failed
-          else CHECK_SYS(false);
-        }
-      }
-      sd.buffer_data_size.item(buf_idx) = buffer_data_size;
-      assert(eof || (!eof && ((prev_buf_idx == -1) || (sd.buffer_data_size[prev_buf_idx] == sd.buffer_size))));
-
-      if (!eof) {
-        // mark buffer ready for processing and signal worker threads
-        if (sd.num_th != 0) {
-          EnterCriticalSection(&sd.sync);
-          try {
-            sd.buffer_state.item(buf_idx) = bs_proc_ready;
-          }
-          finally (LeaveCriticalSection(&sd.sync));
-          CHECK_SYS(ReleaseSemaphore(sd.h_proc_ready_sem, 1, NULL) != 0);
-        }
-      }
-
-      // advance file pointer
-      file_ptr += sd.buffer_size;
-
-      // this buffer will be processed next
-      prev_buf_idx = buf_idx;
-    }
-    FREE_RSRC(VERIFY(CloseHandle(h_file) != 0));
-  }
-  finally (
-    if (sd.num_th != 0) {
-      VERIFY(SetEvent(sd.h_stop_event) != 0);
-      VERIFY(WaitForMultipleObjects(h_wth.size(), h_wth.data(), TRUE, INFINITE) != WAIT_FAILED);
-    }
-  );
-  FREE_RSRC(
-    // must use h_wth.size() instead of sd.num_th
-    for (unsigned i = 0; i < h_wth.size(); i++) {
-      VERIFY(CloseHandle(h_wth[i]) != 0);
-    }
-  );
+  pipeline.run(h_file, result.file_size, progress);
+  FREE_RSRC(VERIFY(CloseHandle(h_file) != 0));
 
   // populate result structure
-  assert(sd.data_size == result.file_size);
+  assert(pipeline.data_size == result.file_size);
   progress.update_ui();
   result.time = progress.time_elapsed();
-  if (options.compression) result.comp_size = sd.comp_size;
-  if (options.crc32) {
-    const u8* c = (const u8*) &crc32;
-    result.crc32.copy(c[3]).add(c[2]).add(c[1]).add(c[0]);
-  }
-  if (options.md5) {
-    u8 md5[MD5_DIGEST_LENGTH];
-    MD5_Final(md5, &md5_ctx);
-    result.md5.copy(md5, sizeof(md5));
-  }
-  if (options.sha1) {
-    u8 sha1[SHA_DIGEST_LENGTH];
-    SHA1_Final(sha1, &sha1_ctx);
-    result.sha1.copy(sha1, sizeof(sha1));
-  }
-  if (options.sha256) {
-    u8 sha256[SHA256_DIGEST_LENGTH];
-    SHA256_Final(sha256, &sha256_ctx);
-    result.sha256.copy(sha256, sizeof(sha256));
-  }
-  if (options.ed2k) {
-    result.ed2k = ed2k_finalize_block_hashes(ed2k_block_hashes, ed2k_last_block_slack, md4_ctx);
-  }
-  if (options.crc16) {
-    const u8* c = (const u8*) &crc16;
-    result.crc16.copy(c[1]).add(c[0]);
-  }
+  if (options.compression) result.comp_size = pipeline.comp_size;
+  pipeline.final(result);
 
-  FREE_RSRC(if (options.compression) delete[] sd.comp_work_buffer);
-  FREE_RSRC(if (options.compression) delete[] sd.comp_buffer);
-  FREE_RSRC(VERIFY(VirtualFree(sd.buffer, 0, MEM_RELEASE) != 0));
-  FREE_RSRC(VERIFY(CloseHandle(h_io_event) != 0));
-  FREE_RSRC(if (sd.num_th != 0) VERIFY(CloseHandle(sd.h_proc_ready_sem) != 0));
-  FREE_RSRC(if (sd.num_th != 0) VERIFY(CloseHandle(sd.h_io_ready_sem) != 0));
-  FREE_RSRC(if (sd.num_th != 0) DeleteCriticalSection(&sd.sync));
-  FREE_RSRC(if (sd.num_th != 0) VERIFY(CloseHandle(sd.h_stop_event) != 0));
   FREE_RSRC(g_far.RestoreScreen(NULL); g_far.RestoreScreen(h_scr));
 }
 
@@ -3,8 +3,9 @@
 
 #include "msg.h"
 
-#include "volume.h"
+#include "ntfs_core/ntfs_core.h"
 #include "utils.h"
+#include "volume.h"
 #include "dlgapi.h"
 #include "log.h"
 #include "defragment.h"
@@ -6,7 +6,7 @@
 #include "options.h"
 #include "utils.h"
 #include "dlgapi.h"
-#include "ntfs.h"
+#include "ntfs_core/ntfs_core.h"
 #include "volume.h"
 #include "ntfs_file.h"
 #include "file_panel.h"
@@ -120,9 +120,16 @@ void FilePanel::on_close() {
     try {
       store_mft_index();
     }
-    catch (...) {
+    catch (Break&) {
+    }
+    catch (Error& e) {
+      error_dlg(e);
+    }
+    catch (std::exception& e) {
+      error_dlg(e);
     }
   }
+  stop_usn_watcher();
   delete_usn_journal();
   PanelInfo pi = { sizeof(PanelInfo) };
   if (far_control_ptr(this, FCTL_GETPANELINFO, &pi)) {
@@ -267,7 +274,173 @@ PluginItemList FilePanel::create_panel_items(const std::list<PanelItemData>& pid
   return pi_list;
 }
 
-void FilePanel::scan_dir(const UnicodeString& root_path, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress) {
+const unsigned c_dir_batch_size = 256 * 1024; // MFT records of directory children are read in chunks of up to this size
+
+// raw MFT access for directory listing, shared by flat scan workers
+// volume is flushed and $MFT runs are decoded only when first directory has files missing from cache
+struct FilePanel::DirMftReader {
+  NtfsVolume& volume;
+  CriticalSection sync;
+  std::unique_ptr<MftReader> reader;
+  bool failed;
+  DirMftReader(NtfsVolume& volume): volume(volume), failed(false) {
+  }
+  // NULL if MFT cannot be read directly
+  MftReader* get() {
+    CriticalSectionLock lock(sync);
+    if (!reader && !failed) {
+      try {
+        volume.flush();
+        reader.reset(new MftReader(volume, volume));
+      }
+      catch (...) {
+        failed = true;
+      }
+    }
+    return reader.get();
+  }
+};
+
+// file references of directory entries taken from its $I30 index, so that files do not have to be opened one by one
+// returns false if index cannot be used (directory on another volume, index attributes in extension records, etc.)
+// index blocks are read without volume flush: entry is used only if record it points to links back to directory
+// under the same name (see has_dir_link()), otherwise file is opened by name
+bool FilePanel::read_dir_index(const UnicodeString& path, u64& dir_ref_num, std::map<wstring, u64>& file_refs) {
+  struct NameCollector: public IndexVisitor {
+    std::map<wstring, u64>* file_refs;
+    virtual void visit(const INDEX_ENTRY* entry) {
+      if (entry->key_length < sizeof(FILE_NAME_ATTR)) return;
+      const FILE_NAME_ATTR* fn_attr = reinterpret_cast<const FILE_NAME_ATTR*>(entry + 1);
+      if (fn_attr->file_name_type == FILE_NAME_DOS) return;
+      if (sizeof(FILE_NAME_ATTR) + fn_attr->file_name_length * sizeof(wchar_t) > entry->key_length) return;
+      (*file_refs)[wstring(reinterpret_cast<const wchar_t*>(fn_attr + 1), fn_attr->file_name_length)] = entry->indexed_file;
+    }
+  };
+  try {
+    BY_HANDLE_FILE_INFORMATION h_file_info;
+    HANDLE h_dir = CreateFileW(long_path(path).data(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    CHECK_SYS(h_dir != INVALID_HANDLE_VALUE);
+    ALLOC_RSRC(;);
+    CHECK_SYS(GetFileInformationByHandle(h_dir, &h_file_info));
+    FREE_RSRC(CloseHandle(h_dir));
+    if (h_file_info.dwVolumeSerialNumber != volume.serial) return false;
+
+    dir_ref_num = ((u64) h_file_info.nFileIndexHigh << 32) + h_file_info.nFileIndexLow;
+    FileInfo dir_info;
+    dir_info.volume = &volume;
+    if (dir_info.load_base_file_rec(dir_ref_num) != FILE_REF(dir_ref_num)) return false;
+    const MFT_RECORD* mft_rec = dir_info.base_mft_rec();
+    if ((mft_rec->magic != magic_FILE) || (mft_rec->sequence_number != (dir_ref_num >> 48))) return false;
+
+    NameCollector collector;
+    collector.file_refs = &file_refs;
+    return walk_index(volume, volume, reinterpret_cast<const u8*>(mft_rec), volume.file_rec_size, reinterpret_cast<const u16*>(L"$I30"), 4, collector);
+  }
+  catch (...) {
+    file_refs.clear();
+    return false;
+  }
+}
+
+// stale index block can map name to file that was renamed away (ren a tmp & ren b a): record is valid, but its names differ
+bool has_dir_link(const FileInfo& file_info, u64 dir_ref_num, const UnicodeString& file_name) {
+  for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
+    const FileNameAttr& fn_attr = file_info.file_name_list[i];
+    if ((fn_attr.file_name_type != FILE_NAME_DOS) && (FILE_REF(fn_attr.parent_directory) == FILE_REF(dir_ref_num)) && (fn_attr.name == file_name)) return true;
+  }
+  return false;
+}
+
+// fill file_infos for directory entries; MFT records of files found in directory index are read in batches
+void FilePanel::load_dir_file_infos(const UnicodeString& path, const std::vector<DirEntry>& entries, DirMftReader* mft_reader, std::vector<FileInfo>& file_infos, std::vector<bool>& errors, FileListProgress& progress) {
+  file_infos.assign(entries.size(), FileInfo());
+  errors.assign(entries.size(), false);
+  for (unsigned i = 0; i < entries.size(); i++) file_infos[i].volume = &volume;
+
+  // (record number, entry index) of files that are not in cache
+  std::vector<std::pair<u64, unsigned>> batch;
+  std::vector<bool> done(entries.size(), false);
+  u64 dir_ref_num;
+  std::map<wstring, u64> file_refs;
+  if (mft_reader && read_dir_index(path, dir_ref_num, file_refs)) {
+    for (unsigned i = 0; i < entries.size(); i++) {
+      std::map<wstring, u64>::const_iterator ref = file_refs.find(wstring(entries[i].file_name.data(), entries[i].file_name.size()));
+      if (ref == file_refs.end()) continue;
+      if (!g_file_info_cache.find(volume, ref->second, file_infos[i])) {
+        done[i] = true;
+        batch.push_back(std::make_pair(ref->second, i));
+      }
+      else done[i] = has_dir_link(file_infos[i], dir_ref_num, entries[i].file_name);
+    }
+  }
+
+  MftReader* reader = batch.empty() ? NULL : mft_reader->get();
+  if (!reader) {
+    for (unsigned i = 0; i < batch.size(); i++) done[batch[i].second] = false;
+  }
+  else {
+    sort(batch.begin(), batch.end());
+    unsigned batch_rec_cnt = c_dir_batch_size / volume.file_rec_size;
+    u8* batch_buf = static_cast<u8*>(VirtualAlloc(NULL, c_dir_batch_size, MEM_COMMIT, PAGE_READWRITE));
+    CHECK_SYS(batch_buf != NULL);
+    CLEAN(u8*, batch_buf, CHECK_SYS(VirtualFree(batch_buf, 0, MEM_RELEASE)));
+    for (unsigned first = 0; first < batch.size();) {
+      u64 first_rec = FILE_REF(batch[first].first);
+      unsigned last = first + 1;
+      while ((last < batch.size()) && (FILE_REF(batch[last].first) - first_rec < batch_rec_cnt)) last++;
+      unsigned rec_cnt = static_cast<unsigned>(FILE_REF(batch[last - 1].first) - first_rec + 1);
+      try {
+        rec_cnt = reader->read_records(first_rec, rec_cnt, batch_buf);
+      }
+      catch (...) {
+        rec_cnt = 0;
+      }
+      for (unsigned i = first; i < last; i++) {
+        // directory index and MFT are read at different times: stale, reused or unreadable record is loaded by file name instead
+        u64 rec_idx = FILE_REF(batch[i].first) - first_rec;
+        const MFT_RECORD* mft_rec = rec_idx < rec_cnt ? reinterpret_cast<const MFT_RECORD*>(batch_buf + static_cast<size_t>(rec_idx) * volume.file_rec_size) : NULL;
+        if (!mft_rec || (mft_rec->magic != magic_FILE) || !(mft_rec->flags & MFT_RECORD_IN_USE) || (mft_rec->base_mft_record != 0) || (mft_rec->sequence_number != (batch[i].first >> 48))) {
+          done[batch[i].second] = false;
+          continue;
+        }
+        FileInfo& file_info = file_infos[batch[i].second];
+        file_info.set_mft_chunk(first_rec, rec_cnt, batch_buf);
+        try {
+          file_info.process_file(batch[i].first);
+          done[batch[i].second] = has_dir_link(file_info, dir_ref_num, entries[batch[i].second].file_name);
+        }
+        catch (...) {
+          done[batch[i].second] = false;
+        }
+        file_info.set_mft_chunk(0, 0, NULL);
+      }
+      first = last;
+      progress.update();
+    }
+  }
+
+  // open remaining files one by one
+  for (unsigned i = 0; i < entries.size(); i++) {
+    if (done[i]) continue;
+    try {
+      BY_HANDLE_FILE_INFORMATION h_file_info;
+      HANDLE h_file = CreateFileW(long_path(add_trailing_slash(path) + entries[i].file_name).data(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_POSIX_SEMANTICS, NULL);
+      CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
+      ALLOC_RSRC(;);
+      CHECK_SYS(GetFileInformationByHandle(h_file, &h_file_info));
+      FREE_RSRC(CloseHandle(h_file));
+
+      u64 file_ref_num = ((u64) h_file_info.nFileIndexHigh << 32) + h_file_info.nFileIndexLow;
+      file_infos[i].process_file(file_ref_num);
+    }
+    catch (...) {
+      errors[i] = true;
+    }
+    progress.update();
+  }
+}
+
+void FilePanel::scan_dir(const UnicodeString& root_path, const UnicodeString& rel_path, DirMftReader* mft_reader, std::list<PanelItemData>& pid_list, std::vector<SubDir>& subdirs, FileListProgress& progress) {
   UnicodeString path = add_trailing_slash(root_path) + rel_path;
   bool more = true;
   WIN32_FIND_DATAW find_data;
@@ -293,143 +466,309 @@ void FilePanel::scan_dir(const UnicodeString& root_path, const UnicodeString& re
     if (flat_mode) more = false;
     else throw;
   }
+  std::vector<DirEntry> entries;
   ALLOC_RSRC(;);
   while (more) {
     if (!IS_DOT_DIR(find_data)) {
-      UnicodeString file_path = add_trailing_slash(path) + find_data.cFileName;
-      UnicodeString rel_file_path = add_trailing_slash(rel_path) + find_data.cFileName;
-
-      UnicodeString file_name = flat_mode ? rel_file_path : find_data.cFileName;
-      u64 data_size = 0;
-      u64 nr_disk_size = 0;
-      u64 valid_size = 0;
-      unsigned stream_cnt = 0;
-      unsigned fragment_cnt = 0;
-      unsigned hard_link_cnt = 0;
-      unsigned mft_rec_cnt = 0;
-      bool error = false;
-      FileInfo file_info;
-      volume.synced = false;
-      try {
-        BY_HANDLE_FILE_INFORMATION h_file_info;
-        HANDLE h_file = CreateFileW(long_path(file_path).data(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_POSIX_SEMANTICS, NULL);
-        CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
-        ALLOC_RSRC(;);
-        CHECK_SYS(GetFileInformationByHandle(h_file, &h_file_info));
-        FREE_RSRC(CloseHandle(h_file));
-
-        u64 file_ref_num = ((u64) h_file_info.nFileIndexHigh << 32) + h_file_info.nFileIndexLow;
-        file_info.volume = &volume;
-        file_info.process_file(file_ref_num);
-
-        hard_link_cnt = h_file_info.nNumberOfLinks;
-        mft_rec_cnt = file_info.mft_rec_cnt;
-        for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-          const AttrInfo& attr_info = file_info.attr_list[i];
-          if (!attr_info.resident) {
-            nr_disk_size += attr_info.disk_size;
-          }
-          if (attr_info.type == AT_DATA) {
-            data_size += attr_info.data_size;
-            valid_size += attr_info.valid_size;
-            stream_cnt++;
-          }
-          if (attr_info.fragments > 1) fragment_cnt += (unsigned) (attr_info.fragments - 1);
+      DirEntry entry;
+      entry.file_name = find_data.cFileName;
+      entry.alt_file_name = find_data.cAlternateFileName;
+      entry.file_attr = find_data.dwFileAttributes;
+      entry.creation_time = find_data.ftCreationTime;
+      entry.last_access_time = find_data.ftLastAccessTime;
+      entry.last_write_time = find_data.ftLastWriteTime;
+      entries.push_back(entry);
+    }
+    if (FindNextFileW(h_find, &find_data) == 0) {
+      CHECK_SYS(GetLastError() == ERROR_NO_MORE_FILES);
+      more = false;
+    }
+  }
+  FREE_RSRC(if (h_find != INVALID_HANDLE_VALUE) VERIFY(FindClose(h_find)));
+
+  std::vector<FileInfo> file_infos;
+  std::vector<bool> errors;
+  load_dir_file_infos(path, entries, mft_reader, file_infos, errors, progress);
+
+  for (unsigned entry_idx = 0; entry_idx < entries.size(); entry_idx++) {
+    const DirEntry& entry = entries[entry_idx];
+    const FileInfo& file_info = file_infos[entry_idx];
+    UnicodeString rel_file_path = add_trailing_slash(rel_path) + entry.file_name;
+
+    UnicodeString file_name = flat_mode ? rel_file_path : entry.file_name;
+    u64 data_size = 0;
+    u64 nr_disk_size = 0;
+    u64 valid_size = 0;
+    unsigned stream_cnt = 0;
+    unsigned fragment_cnt = 0;
+    unsigned hard_link_cnt = 0;
+    unsigned mft_rec_cnt = 0;
+    bool error = errors[entry_idx];
+    if (!error) {
+      // DOS names are not counted as hard links
+      for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
+        if (file_info.file_name_list[i].file_name_type != FILE_NAME_DOS) hard_link_cnt++;
+      }
+      mft_rec_cnt = file_info.mft_rec_cnt;
+      for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
+        const AttrInfo& attr_info = file_info.attr_list[i];
+        if (!attr_info.resident) {
+          nr_disk_size += attr_info.disk_size;
+        }
+        if (attr_info.type == AT_DATA) {
+          data_size += attr_info.data_size;
+          valid_size += attr_info.valid_size;
+          stream_cnt++;
         }
+        if (attr_info.fragments > 1) fragment_cnt += (unsigned) (attr_info.fragments - 1);
       }
-      catch (...) {
-        error = true;
+    }
+
+    // is file fully resident?
+    bool fully_resident = true;
+    for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
+      if (!file_info.attr_list[i].resident) {
+        fully_resident = false;
+        break;
       }
+    }
 
-      // is file fully resident?
-      bool fully_resident = true;
+    PanelItemData pid;
+    pid.file_name = file_name;
+    pid.alt_file_name = entry.alt_file_name;
+    pid.file_attr = entry.file_attr;
+    pid.creation_time = entry.creation_time;
+    pid.last_access_time = entry.last_access_time;
+    pid.last_write_time = entry.last_write_time;
+    pid.data_size = data_size;
+    pid.disk_size = nr_disk_size;
+    pid.valid_size = valid_size;
+    pid.fragment_cnt = fragment_cnt;
+    pid.stream_cnt = stream_cnt;
+    pid.hard_link_cnt = hard_link_cnt;
+    pid.mft_rec_cnt = mft_rec_cnt;
+    pid.error = error;
+    pid.ntfs_attr = false;
+    pid.resident = fully_resident;
+    pid_list.push_back(pid);
+
+    if (g_file_panel_mode.show_streams && !error) {
+      unsigned cnt = 0;
+      bool named_data = false;
       for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-        if (!file_info.attr_list[i].resident) {
-          fully_resident = false;
-          break;
-        }
+        const AttrInfo& attr = file_info.attr_list[i];
+        if (!attr.resident || (attr.type == AT_DATA)) cnt++;
+        if ((attr.type == AT_DATA) && (attr.name.size() != 0)) named_data = true;
       }
-
-      PanelItemData pid;
-      pid.file_name = file_name;
-      pid.alt_file_name = find_data.cAlternateFileName;
-      pid.file_attr = find_data.dwFileAttributes;
-      pid.creation_time = find_data.ftCreationTime;
-      pid.last_access_time = find_data.ftLastAccessTime;
-      pid.last_write_time = find_data.ftLastWriteTime;
-      pid.data_size = data_size;
-      pid.disk_size = nr_disk_size;
-      pid.valid_size = valid_size;
-      pid.fragment_cnt = fragment_cnt;
-      pid.stream_cnt = stream_cnt;
-      pid.hard_link_cnt = hard_link_cnt;
-      pid.mft_rec_cnt = mft_rec_cnt;
-      pid.error = error;
-      pid.ntfs_attr = false;
-      pid.resident = fully_resident;
-      pid_list.push_back(pid);
-
-      if (g_file_panel_mode.show_streams && !error) {
-        unsigned cnt = 0;
-        bool named_data = false;
+      // multiple non-resident/data attributes or at least one named data attribute
+      if ((cnt > 1) || named_data) {
         for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
           const AttrInfo& attr = file_info.attr_list[i];
-          if (!attr.resident || (attr.type == AT_DATA)) cnt++;
-          if ((attr.type == AT_DATA) && (attr.name.size() != 0)) named_data = true;
+          if (attr.resident && (attr.type != AT_DATA)) continue;
+          if (!g_file_panel_mode.show_main_stream && (attr.type == AT_DATA) && (attr.name.size() == 0)) continue;
+
+          UnicodeString file_name = UnicodeString(flat_mode ? rel_file_path : entry.file_name) + L":" + attr.name + L":$" + attr.type_name();
+
+          unsigned fragment_cnt = (unsigned) attr.fragments;
+          if (fragment_cnt != 0) fragment_cnt--;
+
+          DWORD file_attr = entry.file_attr & ~FILE_ATTRIBUTE_DIRECTORY & ~FILE_ATTRIBUTE_REPARSE_POINT;
+          if (attr.compressed) file_attr |= FILE_ATTRIBUTE_COMPRESSED;
+          else file_attr &= ~FILE_ATTRIBUTE_COMPRESSED;
+          if (attr.encrypted) file_attr |= FILE_ATTRIBUTE_ENCRYPTED;
+          else file_attr &= ~FILE_ATTRIBUTE_ENCRYPTED;
+          if (attr.sparse) file_attr |= FILE_ATTRIBUTE_SPARSE_FILE;
+          else file_attr &= ~FILE_ATTRIBUTE_SPARSE_FILE;
+
+          PanelItemData pid;
+          pid.file_name = file_name;
+          pid.alt_file_name = L"";
+          pid.file_attr = file_attr;
+          pid.creation_time = entry.creation_time;
+          pid.last_access_time = entry.last_access_time;
+          pid.last_write_time = entry.last_write_time;
+          pid.data_size = attr.data_size;
+          pid.disk_size = attr.disk_size;
+          pid.valid_size = attr.valid_size;
+          pid.fragment_cnt = fragment_cnt;
+          pid.stream_cnt = 0;
+          pid.hard_link_cnt = 0;
+          pid.mft_rec_cnt = 0;
+          pid.error = false;
+          pid.ntfs_attr = true;
+          pid.resident = attr.resident;
+          pid_list.push_back(pid);
         }
-        // multiple non-resident/data attributes or at least one named data attribute
-        if ((cnt > 1) || named_data) {
-          for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-            const AttrInfo& attr = file_info.attr_list[i];
-            if (attr.resident && (attr.type != AT_DATA)) continue;
-            if (!g_file_panel_mode.show_main_stream && (attr.type == AT_DATA) && (attr.name.size() == 0)) continue;
-
-            UnicodeString file_name = UnicodeString(flat_mode ? rel_file_path : find_data.cFileName) + L":" + attr.name + L":$" + attr.type_name();
-
-            unsigned fragment_cnt = (unsigned) attr.fragments;
-            if (fragment_cnt != 0) fragment_cnt--;
-
-            DWORD file_attr = find_data.dwFileAttributes & ~FILE_ATTRIBUTE_DIRECTORY & ~FILE_ATTRIBUTE_REPARSE_POINT;
-            if (attr.compressed) file_attr |= FILE_ATTRIBUTE_COMPRESSED;
-            else file_attr &= ~FILE_ATTRIBUTE_COMPRESSED;
-            if (attr.encrypted) file_attr |= FILE_ATTRIBUTE_ENCRYPTED;
-            else file_attr &= ~FILE_ATTRIBUTE_ENCRYPTED;
-            if (attr.sparse) file_attr |= FILE_ATTRIBUTE_SPARSE_FILE;
-            else file_attr &= ~FILE_ATTRIBUTE_SPARSE_FILE;
-
-            PanelItemData pid;
-            pid.file_name = file_name;
-            pid.alt_file_name = L"";
-            pid.file_attr = file_attr;
-            pid.creation_time = find_data.ftCreationTime;
-            pid.last_access_time = find_data.ftLastAccessTime;
-            pid.last_write_time = find_data.ftLastWriteTime;
-            pid.data_size = attr.data_size;
-            pid.disk_size = attr.disk_size;
-            pid.valid_size = attr.valid_size;
-            pid.fragment_cnt = fragment_cnt;
-            pid.stream_cnt = 0;
-            pid.hard_link_cnt = 0;
-            pid.mft_rec_cnt = 0;
-            pid.error = false;
-            pid.ntfs_attr = true;
-            pid.resident = attr.resident;
-            pid_list.push_back(pid);
-          }
+      }
+    }
+
+    progress.update(1);
+
+    if (flat_mode && (entry.file_attr & FILE_ATTRIBUTE_DIRECTORY) && !(entry.file_attr & FILE_ATTRIBUTE_REPARSE_POINT)) {
+      SubDir subdir;
+      subdir.rel_path = rel_file_path;
+      subdir.pos = --pid_list.end();
+      subdirs.push_back(subdir);
+    }
+  }
+}
+
+// flat mode: directories are tasks scanned by a pool of workers (calling thread is one of them)
+// each worker keeps its own task deque and steals from the other end of others' deques when it runs dry
+// items of each directory are collected separately and spliced in depth-first order when scan is finished
+struct FilePanel::FlatScanner {
+  struct DirResult {
+    std::list<PanelItemData> pid_list;
+    std::vector<std::pair<std::list<PanelItemData>::iterator, DirResult*>> subdirs;
+  };
+  struct Task {
+    UnicodeString rel_path;
+    DirResult* result;
+  };
+  // col strings are reference counted without interlocked operations, so strings passed
+  // between threads are deep copies and are touched only while owning deque is locked
+  struct Worker {
+    FlatScanner* scanner;
+    unsigned idx;
+    UnicodeString root_path;
+    CriticalSection sync;
+    std::deque<Task> tasks;
+    std::list<DirResult> results; // directories discovered by this worker
+  };
+  FilePanel& panel;
+  DirMftReader* mft_reader;
+  FileListProgress& progress;
+  std::vector<std::unique_ptr<Worker>> workers;
+  DirResult root;
+  volatile LONG pending; // queued or running tasks
+  volatile LONG failed;
+  UnicodeString error; // set by first failed thread only
+
+  FlatScanner(FilePanel& panel, const UnicodeString& root_path, DirMftReader* mft_reader, FileListProgress& progress, unsigned num_th):
+    panel(panel), mft_reader(mft_reader), progress(progress), pending(1), failed(0) {
+    for (unsigned i = 0; i < num_th; i++) {
+      workers.push_back(std::unique_ptr<Worker>(new Worker()));
+      workers.back()->scanner = this;
+      workers.back()->idx = i;
+      workers.back()->root_path = UnicodeString(root_path.data(), root_path.size());
+    }
+    Task task;
+    task.result = &root;
+    workers[0]->tasks.push_back(task);
+  }
+
+  bool get_task(unsigned worker_idx, Task& task) {
+    {
+      Worker& worker = *workers[worker_idx];
+      CriticalSectionLock lock(worker.sync);
+      if (!worker.tasks.empty()) {
+        task = worker.tasks.back();
+        worker.tasks.pop_back();
+        return true;
+      }
+    }
+    for (unsigned i = 1; i < workers.size(); i++) {
+      Worker& victim = *workers[(worker_idx + i) % workers.size()];
+      CriticalSectionLock lock(victim.sync);
+      if (!victim.tasks.empty()) {
+        task = victim.tasks.front();
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run_worker(unsigned worker_idx) {
+    Worker& worker = *workers[worker_idx];
+    std::vector<SubDir> subdirs;
+    while (!failed && pending) {
+      Task task;
+      if (!get_task(worker_idx, task)) {
+        progress.update();
+        Sleep(1);
+        continue;
+      }
+      subdirs.clear();
+      panel.scan_dir(worker.root_path, task.rel_path, mft_reader, task.result->pid_list, subdirs, progress);
+      for (unsigned i = 0; i < subdirs.size(); i++) {
+        worker.results.push_back(DirResult());
+        task.result->subdirs.push_back(std::make_pair(subdirs[i].pos, &worker.results.back()));
+      }
+      InterlockedExchangeAdd(&pending, static_cast<LONG>(subdirs.size()));
+      {
+        CriticalSectionLock lock(worker.sync);
+        // reversed, so that owner continues with first subdirectory
+        for (unsigned i = static_cast<unsigned>(subdirs.size()); i-- > 0;) {
+          worker.tasks.push_back(Task());
+          worker.tasks.back().rel_path = UnicodeString(subdirs[i].rel_path.data(), subdirs[i].rel_path.size());
+          worker.tasks.back().result = task.result->subdirs[i].second;
         }
       }
+      InterlockedDecrement(&pending);
+    }
+  }
 
-      progress.count++;
-      progress.update_ui();
+  static unsigned __stdcall worker_proc(void* param) {
+    Worker* worker = static_cast<Worker*>(param);
+    FlatScanner* scanner = worker->scanner;
+    try {
+      scanner->run_worker(worker->idx);
+    }
+    catch (Error& e) {
+      if (InterlockedExchange(&scanner->failed, 1) == 0) scanner->error = e.message();
+    }
+    catch (std::exception& e) {
+      if (InterlockedExchange(&scanner->failed, 1) == 0) scanner->error = oem_to_unicode(e.what());
+    }
+    catch (...) {
+      if (InterlockedExchange(&scanner->failed, 1) == 0) scanner->error = L"Unexpected error";
+    }
+    return 0;
+  }
 
-      if (flat_mode && IS_DIR(find_data) && !IS_REPARSE(find_data)) scan_dir(root_path, rel_file_path, pid_list, progress);
+  static void merge(DirResult& result, std::list<PanelItemData>& pid_list) {
+    for (unsigned i = 0; i < result.subdirs.size(); i++) {
+      std::list<PanelItemData> sub_list;
+      merge(*result.subdirs[i].second, sub_list);
+      std::list<PanelItemData>::iterator pos = result.subdirs[i].first;
+      result.pid_list.splice(++pos, sub_list);
     }
-    if (FindNextFileW(h_find, &find_data) == 0) {
-      CHECK_SYS(GetLastError() == ERROR_NO_MORE_FILES);
-      more = false;
+    pid_list.splice(pid_list.end(), result.pid_list);
+  }
+
+  void run(std::list<PanelItemData>& pid_list) {
+    Array<HANDLE> h_threads;
+    try {
+      for (unsigned i = 1; i < workers.size(); i++) {
+        unsigned th_id;
+        HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, worker_proc, workers[i].get(), 0, &th_id));
+        CHECK_SYS(h != NULL);
+        h_threads += h;
+      }
+      // calling thread works too and is the only one that updates screen and checks for user break
+      run_worker(0);
+    }
+    catch (...) {
+      InterlockedExchange(&failed, 1);
+      VERIFY(WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE) != WAIT_FAILED);
+      for (unsigned i = 0; i < h_threads.size(); i++) CloseHandle(h_threads[i]);
+      throw;
     }
+    VERIFY(WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE) != WAIT_FAILED);
+    for (unsigned i = 0; i < h_threads.size(); i++) CloseHandle(h_threads[i]);
+    if (failed) FAIL(MsgError(error));
+    merge(root, pid_list);
   }
-  FREE_RSRC(if (h_find != INVALID_HANDLE_VALUE) VERIFY(FindClose(h_find)));
+};
+
+void FilePanel::flat_scan_dir(const UnicodeString& root_path, DirMftReader* mft_reader, std::list<PanelItemData>& pid_list, FileListProgress& progress) {
+  unsigned start_time = GetTickCount();
+  unsigned num_th = min(get_cpu_count(), MAXIMUM_WAIT_OBJECTS);
+  FlatScanner scanner(*this, root_path, mft_reader, progress, num_th);
+  scanner.run(pid_list);
+  unsigned time = GetTickCount() - start_time;
+  DBG_LOG(UnicodeString::format(L"Flat scan: %u threads, %u items, %u ms", num_th, static_cast<unsigned>(pid_list.size()), time));
 }
 
 void FilePanel::sort_file_list(std::list<PanelItemData>& pid_list) {
@@ -535,8 +874,19 @@ void FilePanel::new_file_list(PluginPanelItem*& panel_items, size_t& item_num, b
       }
       mft_scan_dir(mft_find_path(current_dir), L"", pid_list, progress);
     }
-    else
-      scan_dir(current_dir, L"", pid_list, progress);
+    else {
+      g_file_info_cache.sync(volume);
+      // pending writes are flushed once per scan
+      volume.synced = false;
+      // raw MFT access is optional: without it files are opened one by one
+      DirMftReader dir_mft_reader(volume);
+      DirMftReader* mft_reader = g_file_panel_mode.bulk_mft_read ? &dir_mft_reader : NULL;
+      if (flat_mode) flat_scan_dir(current_dir, mft_reader, pid_list, progress);
+      else {
+        std::vector<SubDir> subdirs;
+        scan_dir(current_dir, L"", mft_reader, pid_list, subdirs, progress);
+      }
+    }
     if (!search_mode) sort_file_list(pid_list);
     file_lists += create_panel_items(pid_list, search_mode);
   }
@@ -669,9 +1019,11 @@ private:
   int use_existing_usn_journal_ctrl_id;
   int delete_usn_journal_ctrl_id;
   int delete_own_usn_journal_ctrl_id;
+  int usn_watcher_ctrl_id;
   int use_cache_ctrl_id;
   int default_mft_mode_ctrl_id;
   int backward_mft_scan_ctrl_id;
+  int bulk_mft_read_ctrl_id;
   int cache_dir_lbl_id;
   int cache_dir_ctrl_id;
   int flat_mode_auto_off_ctrl_id;
@@ -695,9 +1047,11 @@ private:
       dlg->mode.use_existing_usn_journal = dlg->get_check(dlg->use_existing_usn_journal_ctrl_id);
       dlg->mode.delete_usn_journal = dlg->get_check(dlg->delete_usn_journal_ctrl_id);
       dlg->mode.delete_own_usn_journal = dlg->get_check(dlg->delete_own_usn_journal_ctrl_id);
+      dlg->mode.usn_watcher = dlg->get_check(dlg->usn_watcher_ctrl_id);
       dlg->mode.use_cache = dlg->get_check(dlg->use_cache_ctrl_id);
       dlg->mode.default_mft_mode = dlg->get_check(dlg->default_mft_mode_ctrl_id);
       dlg->mode.backward_mft_scan = dlg->get_check(dlg->backward_mft_scan_ctrl_id);
+      dlg->mode.bulk_mft_read = dlg->get_check(dlg->bulk_mft_read_ctrl_id);
       dlg->mode.cache_dir = dlg->get_text(dlg->cache_dir_ctrl_id);
       dlg->mode.flat_mode_auto_off = dlg->get_check(dlg->flat_mode_auto_off_ctrl_id);
     }
@@ -708,6 +1062,7 @@ private:
       dlg->enable(dlg->use_existing_usn_journal_ctrl_id, param2 != 0);
       dlg->enable(dlg->delete_usn_journal_ctrl_id, param2 != 0);
       dlg->enable(dlg->delete_own_usn_journal_ctrl_id, param2 != 0 && dlg->get_check(dlg->delete_usn_journal_ctrl_id));
+      dlg->enable(dlg->usn_watcher_ctrl_id, param2 != 0);
       dlg->enable(dlg->use_cache_ctrl_id, param2 != 0);
       dlg->enable(dlg->cache_dir_lbl_id, param2 != 0 && dlg->get_check(dlg->use_cache_ctrl_id));
       dlg->enable(dlg->cache_dir_ctrl_id, param2 != 0 && dlg->get_check(dlg->use_cache_ctrl_id));
@@ -716,6 +1071,9 @@ private:
       dlg->enable(dlg->cache_dir_lbl_id, param2 != 0);
       dlg->enable(dlg->cache_dir_ctrl_id, param2 != 0);
     }
+    else if ((msg == DN_BTNCLICK) && (param1 == dlg->bulk_mft_read_ctrl_id)) {
+      dlg->enable(dlg->backward_mft_scan_ctrl_id, param2 == 0);
+    }
     else if ((msg == DN_BTNCLICK) && (param1 == dlg->delete_usn_journal_ctrl_id)) {
       dlg->enable(dlg->delete_own_usn_journal_ctrl_id, dlg->get_check(dlg->use_usn_journal_ctrl_id) && param2 != 0);
     }
@@ -781,7 +1139,9 @@ public:
     new_line();
     default_mft_mode_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_DEFAULT_MFT_MODE), mode.default_mft_mode);
     spacer(2);
-    backward_mft_scan_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_BACKWARD_MFT_SCAN), mode.backward_mft_scan);
+    backward_mft_scan_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_BACKWARD_MFT_SCAN), mode.backward_mft_scan, mode.bulk_mft_read ? DIF_DISABLE : 0);
+    new_line();
+    bulk_mft_read_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_BULK_MFT_READ), mode.bulk_mft_read);
     new_line();
     separator();
     new_line();
@@ -801,6 +1161,8 @@ public:
     spacer(2);
     delete_own_usn_journal_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_DELETE_OWN_USN_JOURNAL), mode.delete_own_usn_journal, mode.use_usn_journal && mode.delete_usn_journal ? 0 : DIF_DISABLE);
     new_line();
+    usn_watcher_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_USN_WATCHER), mode.usn_watcher, mode.use_usn_journal ? 0 : DIF_DISABLE);
+    new_line();
     use_cache_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_USE_CACHE), mode.use_cache, mode.use_usn_journal ? 0 : DIF_DISABLE);
     spacer(2);
     cache_dir_lbl_id = label(far_get_msg(MSG_FILE_PANEL_CACHE_DIR), AUTO_SIZE, mode.use_cache && mode.use_usn_journal ? 0 : DIF_DISABLE);
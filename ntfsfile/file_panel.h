@@ -14,11 +14,18 @@ struct PanelState {
 };
 
 class FileListProgress: public ProgressMonitor {
+private:
+  DWORD ui_thread_id;
 protected:
   void do_update_ui();
 public:
-  unsigned count;
-  FileListProgress(): ProgressMonitor(true), count(0) {
+  volatile LONG count;
+  FileListProgress(): ProgressMonitor(true), ui_thread_id(GetCurrentThreadId()), count(0) {
+  }
+  // can be called by flat scan workers: screen is updated only from the thread that created monitor
+  void update(unsigned cnt = 0) {
+    if (cnt) InterlockedExchangeAdd(&count, cnt);
+    if (GetCurrentThreadId() == ui_thread_id) update_ui();
   }
 };
 
@@ -61,12 +68,29 @@ private:
   void parse_column_spec(const UnicodeString& src_col_types, const UnicodeString& src_col_widths, UnicodeString& col_types, UnicodeString& col_widths, bool title);
   PluginItemList create_panel_items(const std::list<PanelItemData>& pid_list, bool search_mode);
   PluginItemList create_volume_items();
-  void scan_dir(const UnicodeString& root_path, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress);
+  struct DirEntry {
+    UnicodeString file_name;
+    UnicodeString alt_file_name;
+    DWORD file_attr;
+    FILETIME creation_time;
+    FILETIME last_access_time;
+    FILETIME last_write_time;
+  };
+  struct DirMftReader;
+  bool read_dir_index(const UnicodeString& path, u64& dir_ref_num, std::map<wstring, u64>& file_refs);
+  void load_dir_file_infos(const UnicodeString& path, const std::vector<DirEntry>& entries, DirMftReader* mft_reader, std::vector<FileInfo>& file_infos, std::vector<bool>& errors, FileListProgress& progress);
+  // flat mode subdirectory, its items go right after item pos
+  struct SubDir {
+    UnicodeString rel_path;
+    std::list<PanelItemData>::iterator pos;
+  };
+  void scan_dir(const UnicodeString& root_path, const UnicodeString& rel_path, DirMftReader* mft_reader, std::list<PanelItemData>& pid_list, std::vector<SubDir>& subdirs, FileListProgress& progress);
+  struct FlatScanner;
+  void flat_scan_dir(const UnicodeString& root_path, DirMftReader* mft_reader, std::list<PanelItemData>& pid_list, FileListProgress& progress);
   void sort_file_list(std::list<PanelItemData>& pid_list);
   struct FileRecord {
     u64 file_ref_num;
     u64 parent_ref_num;
-    UnicodeString file_name;
     DWORD file_attr;
     FILETIME creation_time;
     FILETIME last_access_time;
@@ -83,32 +107,188 @@ private:
     bool resident() const { return (flags & 2) != 0; }
     void set_flags(bool ntfs_attr, bool resident) { flags = (ntfs_attr ? 1 : 0) | (resident ? 2 : 0); }
   };
-  struct FileRecordCompare;
+  // index column, data is either owned or points into mapped cache file (read-only then)
+  template<class T> class Column {
+  private:
+    std::vector<T> values;
+    const T* view;
+    size_t view_size;
+  public:
+    typedef T value_type;
+    Column(): view(nullptr), view_size(0) {
+    }
+    size_t size() const {
+      return view ? view_size : values.size();
+    }
+    bool empty() const {
+      return size() == 0;
+    }
+    const T* data() const {
+      return view ? view : values.data();
+    }
+    const T* begin() const {
+      return data();
+    }
+    const T* end() const {
+      return data() + size();
+    }
+    const T& operator[](size_t idx) const {
+      return data()[idx];
+    }
+    size_t capacity() const {
+      return values.capacity();
+    }
+    void reserve(size_t cnt) {
+      assert(!view);
+      values.reserve(cnt);
+    }
+    void push_back(const T& value) {
+      assert(!view);
+      values.push_back(value);
+    }
+    void append(const T* first, const T* last) {
+      assert(!view);
+      values.insert(values.end(), first, last);
+    }
+    void swap(Column& column) {
+      values.swap(column.values);
+      std::swap(view, column.view);
+      std::swap(view_size, column.view_size);
+    }
+    // take ownership of vector contents
+    void swap(std::vector<T>& v) {
+      values.swap(v);
+      view = nullptr;
+      view_size = 0;
+    }
+    void attach(const T* data, size_t size) {
+      std::vector<T>().swap(values);
+      view = data;
+      view_size = size;
+    }
+  };
+  // MFT index stored by columns, all file names are kept in a single buffer
+  struct MftIndex {
+    Column<u64> file_ref_num;
+    Column<u64> parent_ref_num;
+    Column<DWORD> file_attr;
+    Column<FILETIME> creation_time;
+    Column<FILETIME> last_access_time;
+    Column<FILETIME> last_write_time;
+    Column<u64> data_size;
+    Column<u64> disk_size;
+    Column<u64> valid_size;
+    Column<u32> fragment_cnt;
+    Column<u32> mft_rec_cnt;
+    Column<u16> stream_cnt;
+    Column<u16> hard_link_cnt;
+    Column<u8> flags;
+    Column<u32> name_pos; // name of record i is names[name_pos[i] .. name_pos[i + 1])
+    Column<wchar_t> names;
+    Column<u32> child_pos; // children of record r are [child_pos[r], child_pos[r + 1]), valid for sorted index
+    std::shared_ptr<FileMapping> mapping; // cache file the columns are attached to
+    MftIndex() {
+      name_pos.push_back(0);
+    }
+    unsigned size() const {
+      return static_cast<unsigned>(file_ref_num.size());
+    }
+    const wchar_t* name(unsigned idx) const {
+      return names.empty() ? L"" : names.data() + name_pos[idx];
+    }
+    unsigned name_size(unsigned idx) const {
+      return name_pos[idx + 1] - name_pos[idx];
+    }
+    UnicodeString file_name(unsigned idx) const {
+      return UnicodeString(name(idx), name_size(idx));
+    }
+    bool ntfs_attr(unsigned idx) const { return (flags[idx] & 1) != 0; }
+    bool resident(unsigned idx) const { return (flags[idx] & 2) != 0; }
+    int compare_name(unsigned idx, const wchar_t* name, unsigned size) const;
+    int compare(unsigned idx, const MftIndex& index, unsigned index_idx) const;
+    void clear();
+    void swap(MftIndex& index);
+    void reserve(unsigned rec_cnt, size_t name_cnt);
+    void add(const FileRecord& rec, const wchar_t* name, unsigned size);
+    void add(const FileRecord& rec, const UnicodeString& name) {
+      add(rec, name.data(), name.size());
+    }
+    void add(const MftIndex& index, unsigned idx);
+    void append(const MftIndex& index);
+    void merge(const MftIndex& index, const std::vector<bool>& removed_refs, const MftIndex& delta);
+    void get(unsigned idx, FileRecord& rec) const;
+    void build_child_index();
+    u64 ref_cnt() const {
+      return child_pos.empty() ? 0 : child_pos.size() - 1;
+    }
+    void get_children(u64 parent_ref_num, unsigned& first, unsigned& last) const {
+      if (parent_ref_num < ref_cnt()) {
+        first = child_pos[static_cast<size_t>(parent_ref_num)];
+        last = child_pos[static_cast<size_t>(parent_ref_num) + 1];
+      }
+      else first = last = 0;
+    }
+    unsigned find(u64 parent_ref_num, const UnicodeString& name) const;
+    u64 memory_size() const;
+    void validate() const;
+    // call f(column) for each column in cache file order
+    template<class I, class F> static void for_each_column(I& index, F& f) {
+      f(index.file_ref_num);
+      f(index.parent_ref_num);
+      f(index.file_attr);
+      f(index.creation_time);
+      f(index.last_access_time);
+      f(index.last_write_time);
+      f(index.data_size);
+      f(index.disk_size);
+      f(index.valid_size);
+      f(index.fragment_cnt);
+      f(index.mft_rec_cnt);
+      f(index.stream_cnt);
+      f(index.hard_link_cnt);
+      f(index.flags);
+      f(index.name_pos);
+      f(index.names);
+      f(index.child_pos);
+    }
+  };
   DWORDLONG usn_journal_id;
   USN next_usn;
   bool is_journal_created;
   bool is_journal_used() const {
     return usn_journal_id != 0;
   }
-  ObjectArray<FileRecord> mft_index;
-  void invalidate_mft_index() {
-    mft_index.clear();
-    usn_journal_id = 0;
-  }
+  // current index snapshot, never modified after it is published
+  std::shared_ptr<const MftIndex> mft_index;
+  void invalidate_mft_index();
   u64 root_dir_ref_num;
-  void add_file_records(std::list<FileRecord>& file_list, const FileInfo& file_info);
+  static void add_file_records(MftIndex& index, const FileInfo& file_info);
+  struct MftScanner;
+  struct MftIndexSorter;
+  static void sort_mft_index(MftIndex& index);
   void prepare_usn_journal();
   void delete_usn_journal();
   void create_mft_index();
+  struct UsnUpdateProgress;
+  static bool load_changed_files(NtfsVolume& volume, const std::vector<u64>& file_refs, MftIndex& delta, UsnUpdateProgress* progress, HANDLE h_stop_event);
+  static bool merge_changed_files(const MftIndex& index, const std::vector<u64>& file_refs, MftIndex& delta, MftIndex& result, HANDLE h_stop_event);
   void update_mft_index_from_usn();
+  struct UsnWatcher;
+  std::unique_ptr<UsnWatcher> usn_watcher;
+  void start_usn_watcher();
+  void stop_usn_watcher();
   void mft_scan_dir(u64 parent_file_index, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress);
   u64 mft_find_root() const;
   u64 mft_find_path(const UnicodeString& path);
+  class CacheProgress;
   void store_mft_index();
+  void load_mft_index_v0(const FileMapping& cache, MftIndex& index, CacheProgress& progress);
+  void load_mft_index_v2(const std::shared_ptr<FileMapping>& cache, MftIndex& index, CacheProgress& progress);
   void load_mft_index();
   UnicodeString get_mft_index_cache_name();
   void open_volume(const UnicodeString& dir);
-  FilePanel(): usn_journal_id(0), is_journal_created(false) {}
+  FilePanel();
+  ~FilePanel();
 public:
   UnicodeString current_dir;
   bool flat_mode;
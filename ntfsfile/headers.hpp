@@ -19,6 +19,7 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <deque>
 #include <set>
 #include <map>
 #include <algorithm>
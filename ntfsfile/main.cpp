@@ -6,7 +6,7 @@
 #include <initguid.h>
 #include "guids.h"
 #include "utils.h"
-#include "ntfs.h"
+#include "ntfs_core/ntfs_core.h"
 #include "volume.h"
 #include "options.h"
 #include "content.h"
@@ -34,34 +34,95 @@ struct CtrlIds {
 
 const int c_update_time = 1;
 
+// FileTotals fields: 64-bit sizes, then 32-bit counters
+#define FILE_TOTALS_FIELDS(F64, F32) \
+  F64(unnamed_data_size) \
+  F64(named_data_size) \
+  F64(nr_data_size) \
+  F64(unnamed_disk_size) \
+  F64(named_disk_size) \
+  F64(nr_disk_size) \
+  F64(unnamed_hl_size) \
+  F64(named_hl_size) \
+  F64(nr_hl_size) \
+  F64(excess_fragments) \
+  F32(file_cnt) \
+  F32(hl_cnt) \
+  F32(dir_cnt) \
+  F32(file_rp_cnt) \
+  F32(dir_rp_cnt) \
+  F32(err_cnt)
+
+// sizes added by each further link of hard-linked file (directories have no hard links)
+struct LinkTotals {
+  u64 unnamed_size;
+  u64 named_size;
+  u64 nr_size;
+};
+
 struct FileTotals {
-  u64 unnamed_data_size;
-  u64 named_data_size;
-  u64 nr_data_size;
-  u64 unnamed_disk_size;
-  u64 named_disk_size;
-  u64 nr_disk_size;
-  u64 unnamed_hl_size;
-  u64 named_hl_size;
-  u64 nr_hl_size;
-  u64 excess_fragments;
-  unsigned file_cnt;
-  unsigned hl_cnt;
-  unsigned dir_cnt;
-  unsigned file_rp_cnt;
-  unsigned dir_rp_cnt;
-  unsigned err_cnt;
+#define DECLARE64(field) u64 field;
+#define DECLARE32(field) unsigned field;
+  FILE_TOTALS_FIELDS(DECLARE64, DECLARE32)
+#undef DECLARE64
+#undef DECLARE32
   FileTotals() {
     memset(this, 0, sizeof(*this));
   }
+  void add(const FileInfo& file_info, bool hard_link);
+  void add(const LinkTotals& link) {
+    hl_cnt++;
+    unnamed_hl_size += link.unnamed_size;
+    named_hl_size += link.named_size;
+    nr_hl_size += link.nr_size;
+  }
+  void add(const FileTotals& delta) {
+#define ADD(field) field += delta.field;
+    FILE_TOTALS_FIELDS(ADD, ADD)
+#undef ADD
+  }
+  // totals are published by analysis workers with interlocked adds and polled by dialog without locks
+  void add_interlocked(const FileTotals& delta) {
+#define ADD64(field) if (delta.field) InterlockedExchangeAdd64(reinterpret_cast<volatile LONGLONG*>(&field), delta.field);
+#define ADD32(field) if (delta.field) InterlockedExchangeAdd(reinterpret_cast<volatile LONG*>(&field), delta.field);
+    FILE_TOTALS_FIELDS(ADD64, ADD32)
+#undef ADD64
+#undef ADD32
+  }
+  FileTotals snapshot() const {
+    FileTotals t;
+    // plain 64-bit loads are not atomic on x86
+#define GET64(field) t.field = InterlockedCompareExchange64(reinterpret_cast<volatile LONGLONG*>(const_cast<u64*>(&field)), 0, 0);
+#define GET32(field) t.field = *static_cast<volatile const unsigned*>(&field);
+    FILE_TOTALS_FIELDS(GET64, GET32)
+#undef GET64
+#undef GET32
+    return t;
+  }
 };
 
 struct FileAnalyzer {
   ObjectArray<UnicodeString> file_list;
   FileInfo file_info;
-  ObjectArray<FileInfo> hard_links;
   NtfsVolume volume;
-  FileTotals totals;
+  FileTotals totals; // published totals
+  // hard-linked files seen so far, by volume serial and file reference
+  CriticalSection hard_link_cs;
+  std::map<DWORD, FileRefMap<LinkTotals>> hard_links;
+  // directories waiting to be scanned, strings are not shared with worker threads
+  CriticalSection dir_cs;
+  std::vector<UnicodeString> dirs;
+  volatile LONG pending_dirs; // queued or being scanned
+  // volumes whose file info cache was synced during this operation, by serial number
+  CriticalSection cache_sync_cs;
+  std::set<DWORD> synced_volumes;
+  Semaphore dir_sem; // released once per queued directory
+  Event done_event; // set when pending_dirs drops to zero
+  struct Worker {
+    FileAnalyzer* analyzer;
+    NtfsVolume volume;
+    FileTotals totals; // not yet published
+  };
   HANDLE h_dlg;
   Array<FarDialogItem> dlg_items;
   ObjectArray<UnicodeString> dlg_text;
@@ -69,16 +130,20 @@ struct FileAnalyzer {
   CtrlIds ctrl;
   HANDLE h_thread;
   HANDLE h_stop_event;
-  time_t update_timer;
   void display_file_info(bool partial = false);
-  void update_totals(const FileInfo& file_info, bool hard_link);
-  void process_file(FileInfo& file_info, bool full_info);
-  void process_recursive(const UnicodeString& dir_name);
+  void sync_file_info_cache(NtfsVolume& volume);
+  void process_file(FileInfo& file_info, bool full_info, NtfsVolume& volume, FileTotals& totals);
+  void add_dir(const UnicodeString& dir_name);
+  bool get_dir(UnicodeString& dir_name);
+  void end_dir();
+  void process_dir(const UnicodeString& dir_name, Worker& worker);
+  void run_worker(Worker& worker);
+  static unsigned __stdcall worker_proc(void* param);
   void process();
   static unsigned __stdcall th_proc(void* param);
   intptr_t dialog_handler(intptr_t msg, intptr_t param1, void* param2);
   static intptr_t WINAPI dlg_proc(HANDLE h_dlg, intptr_t msg, intptr_t param1, void* param2);
-  FileAnalyzer(): h_dlg(NULL), h_thread(NULL), h_stop_event(NULL), update_timer(0) {
+  FileAnalyzer(): pending_dirs(0), dir_sem(0, MAXLONG), done_event(true, false), h_dlg(NULL), h_thread(NULL), h_stop_event(NULL) {
   }
   ~FileAnalyzer() {
     if (h_stop_event) CloseHandle(h_stop_event);
@@ -124,6 +189,7 @@ UnicodeString far_get_text(HANDLE h_dlg, unsigned ctrl_id) {
 
 void FileAnalyzer::display_file_info(bool partial) {
   const UnicodeString empty_str;
+  const FileTotals cur_totals = totals.snapshot();
 
   /* flag - show size summary for directories / multiple files */
   bool show_totals = (file_info.directory && !file_info.reparse) || (file_list.size() > 1);
@@ -214,13 +280,13 @@ void FileAnalyzer::display_file_info(bool partial) {
     MEASURE_COLUMN(col_disk_size_max_len, total_disk_size);
   }
   if (show_totals) {
-    MEASURE_COLUMN2(col_data_size_max_len, totals.unnamed_data_size, totals.unnamed_hl_size);
-    MEASURE_COLUMN(col_disk_size_max_len, totals.unnamed_disk_size);
-    MEASURE_COLUMN2(col_data_size_max_len, totals.named_data_size, totals.named_hl_size);
-    MEASURE_COLUMN(col_disk_size_max_len, totals.named_disk_size);
-    MEASURE_COLUMN2(col_data_size_max_len, totals.nr_data_size, totals.nr_hl_size);
-    MEASURE_COLUMN(col_disk_size_max_len, totals.nr_disk_size);
-    MEASURE_COLUMN(col_fragments_max_len, totals.excess_fragments);
+    MEASURE_COLUMN2(col_data_size_max_len, cur_totals.unnamed_data_size, cur_totals.unnamed_hl_size);
+    MEASURE_COLUMN(col_disk_size_max_len, cur_totals.unnamed_disk_size);
+    MEASURE_COLUMN2(col_data_size_max_len, cur_totals.named_data_size, cur_totals.named_hl_size);
+    MEASURE_COLUMN(col_disk_size_max_len, cur_totals.named_disk_size);
+    MEASURE_COLUMN2(col_data_size_max_len, cur_totals.nr_data_size, cur_totals.nr_hl_size);
+    MEASURE_COLUMN(col_disk_size_max_len, cur_totals.nr_disk_size);
+    MEASURE_COLUMN(col_fragments_max_len, cur_totals.excess_fragments);
   }
 
   /* max. width of attribute table */
@@ -568,35 +634,35 @@ void FileAnalyzer::display_file_info(bool partial) {
       str.add_fmt(L" \1*\1");
       dlg_colors.add(g_colors[COL_DIALOGHIGHLIGHTTEXT]).add(g_colors[COL_DIALOGTEXT]);
     }
-    if ((totals.file_cnt != 0) || (totals.file_rp_cnt != 0)) {
-      str.add(L" ").add_fmt(far_get_msg(MSG_METADATA_TOTALS_FILES).data(), totals.file_cnt);
+    if ((cur_totals.file_cnt != 0) || (cur_totals.file_rp_cnt != 0)) {
+      str.add(L" ").add_fmt(far_get_msg(MSG_METADATA_TOTALS_FILES).data(), cur_totals.file_cnt);
     }
-    if (totals.hl_cnt != 0) {
-      str.add_fmt(far_get_msg(MSG_METADATA_TOTALS_HL).data(), totals.hl_cnt);
+    if (cur_totals.hl_cnt != 0) {
+      str.add_fmt(far_get_msg(MSG_METADATA_TOTALS_HL).data(), cur_totals.hl_cnt);
     }
-    if (totals.file_rp_cnt != 0) {
-      str.add_fmt(far_get_msg(MSG_METADATA_TOTALS_RP_FILES).data(), totals.file_rp_cnt);
+    if (cur_totals.file_rp_cnt != 0) {
+      str.add_fmt(far_get_msg(MSG_METADATA_TOTALS_RP_FILES).data(), cur_totals.file_rp_cnt);
     }
-    if ((totals.dir_cnt != 0) || (totals.dir_rp_cnt != 0)) {
-      str.add(L" ").add_fmt(far_get_msg(MSG_METADATA_TOTALS_DIRS).data(), totals.dir_cnt);
+    if ((cur_totals.dir_cnt != 0) || (cur_totals.dir_rp_cnt != 0)) {
+      str.add(L" ").add_fmt(far_get_msg(MSG_METADATA_TOTALS_DIRS).data(), cur_totals.dir_cnt);
     }
-    if (totals.dir_rp_cnt != 0) {
-      str.add_fmt(far_get_msg(MSG_METADATA_TOTALS_RP_DIRS).data(), totals.dir_rp_cnt);
+    if (cur_totals.dir_rp_cnt != 0) {
+      str.add_fmt(far_get_msg(MSG_METADATA_TOTALS_RP_DIRS).data(), cur_totals.dir_rp_cnt);
     }
-    if (totals.err_cnt != 0) {
+    if (cur_totals.err_cnt != 0) {
       FarColor color = g_colors[COL_DIALOGTEXT];
       color.ForegroundColor = FOREGROUND_RED;
       color.Flags |= FCF_FG_4BIT;
-      str.add(L" ").add_fmt(far_get_msg(MSG_METADATA_TOTALS_ERRORS).data(), &UnicodeString::format(L"\1%u\1", totals.err_cnt));
+      str.add(L" ").add_fmt(far_get_msg(MSG_METADATA_TOTALS_ERRORS).data(), &UnicodeString::format(L"\1%u\1", cur_totals.err_cnt));
       dlg_colors.add(color).add(g_colors[COL_DIALOGTEXT]);
     }
     ADD_STR_LINE(str);
 
     /* total size of directory contents / multiple files */
     ADD_HORIZ_LINE(c_left2_horiz1, c_top1_vert1, c_right2_horiz1, c_horiz1);
-    ADD_SIZE_TOTALS(far_get_msg(MSG_METADATA_ROW_UNNAMED_TOTAL), totals.unnamed_data_size, totals.unnamed_hl_size, totals.unnamed_disk_size, 0);
-    ADD_SIZE_TOTALS(far_get_msg(MSG_METADATA_ROW_NAMED_TOTAL), totals.named_data_size, totals.named_hl_size, totals.named_disk_size, 0);
-    ADD_SIZE_TOTALS(far_get_msg(MSG_METADATA_ROW_NR_TOTAL), totals.nr_data_size, totals.nr_hl_size, totals.nr_disk_size, totals.excess_fragments);
+    ADD_SIZE_TOTALS(far_get_msg(MSG_METADATA_ROW_UNNAMED_TOTAL), cur_totals.unnamed_data_size, cur_totals.unnamed_hl_size, cur_totals.unnamed_disk_size, 0);
+    ADD_SIZE_TOTALS(far_get_msg(MSG_METADATA_ROW_NAMED_TOTAL), cur_totals.named_data_size, cur_totals.named_hl_size, cur_totals.named_disk_size, 0);
+    ADD_SIZE_TOTALS(far_get_msg(MSG_METADATA_ROW_NR_TOTAL), cur_totals.nr_data_size, cur_totals.nr_hl_size, cur_totals.nr_disk_size, cur_totals.excess_fragments);
   }
 
   /* link control */
@@ -698,48 +764,54 @@ void FileAnalyzer::display_file_info(bool partial) {
   }
 }
 
-void FileAnalyzer::update_totals(const FileInfo& file_info, bool hard_link) {
-  if (file_info.reparse && file_info.directory) totals.dir_rp_cnt++;
-  else if (file_info.directory) totals.dir_cnt++;
-  else if (hard_link) totals.hl_cnt++;
-  else if (file_info.reparse) totals.file_rp_cnt++;
-  else totals.file_cnt++;
+void FileTotals::add(const FileInfo& file_info, bool hard_link) {
+  if (file_info.reparse && file_info.directory) dir_rp_cnt++;
+  else if (file_info.directory) dir_cnt++;
+  else if (hard_link) hl_cnt++;
+  else if (file_info.reparse) file_rp_cnt++;
+  else file_cnt++;
   for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
     const AttrInfo& attr_info = file_info.attr_list[i];
     if (!attr_info.resident) {
       if (hard_link) {
-        totals.nr_hl_size += attr_info.data_size;
+        nr_hl_size += attr_info.data_size;
       }
       else {
-        totals.nr_data_size += attr_info.data_size;
-        totals.nr_disk_size += attr_info.disk_size;
+        nr_data_size += attr_info.data_size;
+        nr_disk_size += attr_info.disk_size;
       }
     }
     if (attr_info.type == AT_DATA) {
       if (attr_info.name.size() == 0) {
         if (hard_link) {
-          totals.unnamed_hl_size += attr_info.data_size;
+          unnamed_hl_size += attr_info.data_size;
         }
         else {
-          totals.unnamed_data_size += attr_info.data_size;
-          totals.unnamed_disk_size += attr_info.disk_size;
+          unnamed_data_size += attr_info.data_size;
+          unnamed_disk_size += attr_info.disk_size;
         }
       }
       else {
         if (hard_link) {
-          totals.named_hl_size += attr_info.data_size;
+          named_hl_size += attr_info.data_size;
         }
         else {
-          totals.named_data_size += attr_info.data_size;
-          totals.named_disk_size += attr_info.disk_size;
+          named_data_size += attr_info.data_size;
+          named_disk_size += attr_info.disk_size;
         }
       }
     }
-    if (!hard_link && (attr_info.fragments > 1)) totals.excess_fragments += attr_info.fragments - 1;
+    if (!hard_link && (attr_info.fragments > 1)) excess_fragments += attr_info.fragments - 1;
   }
 }
 
-void FileAnalyzer::process_file(FileInfo& file_info, bool full_info) {
+// volume may have been opened by caller before analysis started, so cache is synced on first use instead of on open
+void FileAnalyzer::sync_file_info_cache(NtfsVolume& volume) {
+  CriticalSectionLock lock(cache_sync_cs);
+  if (synced_volumes.insert(volume.serial).second) g_file_info_cache.sync(volume);
+}
+
+void FileAnalyzer::process_file(FileInfo& file_info, bool full_info, NtfsVolume& volume, FileTotals& totals) {
   BY_HANDLE_FILE_INFORMATION h_file_info;
   HANDLE h_file = CreateFileW(long_path(file_info.file_name).data(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_POSIX_SEMANTICS, NULL);
   if (h_file == INVALID_HANDLE_VALUE) FAIL(SystemError());
@@ -755,29 +827,63 @@ void FileAnalyzer::process_file(FileInfo& file_info, bool full_info) {
   if (volume.serial != h_file_info.dwVolumeSerialNumber) { // volume changed
     volume.open(extract_path_root(get_real_path(extract_file_path(file_info.file_name))));
   }
+  sync_file_info_cache(volume);
   file_info.volume = &volume;
 
   if (file_info.hard_link_cnt > 1) {
-    unsigned idx = hard_links.bsearch(file_info);
-    if (idx != -1) {
-      update_totals(hard_links[idx], true);
+    {
+      CriticalSectionLock lock(hard_link_cs);
+      const LinkTotals* link = hard_links[h_file_info.dwVolumeSerialNumber].find(file_ref_num);
+      if (link) {
+        totals.add(*link);
+        return;
+      }
     }
-    else {
-      file_info.process_file(file_ref_num);
-      if (full_info) file_info.find_full_paths();
-      update_totals(file_info, false);
-      hard_links += file_info;
-      hard_links.sort();
+    // single file dialog always reads MFT: open file can grow without new journal records
+    file_info.process_file(file_ref_num, !full_info);
+    if (full_info) file_info.find_full_paths();
+    FileTotals link_totals;
+    link_totals.add(file_info, true);
+    LinkTotals link = { link_totals.unnamed_hl_size, link_totals.named_hl_size, link_totals.nr_hl_size };
+    bool first_link;
+    {
+      CriticalSectionLock lock(hard_link_cs);
+      // another worker may have reached different link of the same file meanwhile
+      first_link = hard_links[h_file_info.dwVolumeSerialNumber].insert(file_ref_num, link);
     }
+    totals.add(file_info, !first_link);
   }
   else {
-    file_info.process_file(file_ref_num);
+    file_info.process_file(file_ref_num, !full_info);
     if (full_info) file_info.find_full_paths();
-    update_totals(file_info, false);
+    totals.add(file_info, false);
   }
 }
 
-void FileAnalyzer::process_recursive(const UnicodeString& dir_name) {
+void FileAnalyzer::add_dir(const UnicodeString& dir_name) {
+  InterlockedIncrement(&pending_dirs);
+  {
+    CriticalSectionLock lock(dir_cs);
+    dirs.push_back(UnicodeString(dir_name.data(), dir_name.size()));
+  }
+  CHECK_SYS(ReleaseSemaphore(dir_sem.handle(), 1, NULL));
+}
+
+bool FileAnalyzer::get_dir(UnicodeString& dir_name) {
+  CriticalSectionLock lock(dir_cs);
+  if (dirs.empty()) return false;
+  dir_name = dirs.back();
+  dirs.pop_back();
+  return true;
+}
+
+// subdirectories are counted before parent is finished, so zero means whole tree is done
+void FileAnalyzer::end_dir() {
+  if (InterlockedDecrement(&pending_dirs) == 0) SetEvent(done_event.handle());
+}
+
+// scan one directory, subdirectories are queued for any worker
+void FileAnalyzer::process_dir(const UnicodeString& dir_name, Worker& worker) {
   try {
     bool root_dir = dir_name.last() == L'\\';
     WIN32_FIND_DATAW find_data;
@@ -795,29 +901,57 @@ void FileAnalyzer::process_recursive(const UnicodeString& dir_name) {
         FileInfo file_info;
         file_info.file_name = dir_name + (root_dir ? L"" : L"\\") + find_data.cFileName;
         try {
-          process_file(file_info, false);
+          process_file(file_info, false, worker.volume, worker.totals);
           if (file_info.directory && !file_info.reparse) {
-            process_recursive(file_info.file_name);
+            add_dir(file_info.file_name);
           }
         }
         catch (Error&) {
-          totals.err_cnt++;
+          worker.totals.err_cnt++;
         }
-
-        time_t ctime = time(NULL);
-        if (ctime > update_timer + c_update_time) {
-          display_file_info(true);
-          update_timer = ctime;
+        catch (std::exception&) {
+          worker.totals.err_cnt++;
         }
       }
     }
     finally (FindClose(h_find));
   }
   catch (Error&) {
-    totals.err_cnt++;
+    worker.totals.err_cnt++;
+  }
+}
+
+void FileAnalyzer::run_worker(Worker& worker) {
+  HANDLE h[3] = { h_stop_event, done_event.handle(), dir_sem.handle() };
+  while (true) {
+    DWORD w = WaitForMultipleObjects(ARRAYSIZE(h), h, FALSE, INFINITE);
+    CHECK_SYS(w != WAIT_FAILED);
+    if (w != WAIT_OBJECT_0 + 2) break;
+    UnicodeString dir_name;
+    VERIFY(get_dir(dir_name));
+    try {
+      process_dir(dir_name, worker);
+      // publish after each directory, so that dialog shows progress
+      totals.add_interlocked(worker.totals);
+      worker.totals = FileTotals();
+    }
+    finally (end_dir());
   }
 }
 
+unsigned __stdcall FileAnalyzer::worker_proc(void* param) {
+  Worker* worker = static_cast<Worker*>(param);
+  try {
+    worker->analyzer->run_worker(*worker);
+  }
+  catch (...) {
+    // directory errors are counted, anything else stops this worker only
+    InterlockedIncrement(reinterpret_cast<volatile LONG*>(&worker->analyzer->totals.err_cnt));
+    return FALSE;
+  }
+  return TRUE;
+}
+
 // set current file on active panel to file_name
 bool panel_go_to_file(const UnicodeString& file_name) {
   UnicodeString dir = file_name;
@@ -881,27 +1015,55 @@ void WINAPI GetPluginInfoW(PluginInfo* info) {
   info->CommandPrefix = c_command_prefix;
 }
 
+// directories are scanned by a pool of workers with own volume handles and totals;
+// this thread queues selected items and refreshes dialog until workers are done
 void FileAnalyzer::process() {
   if (file_info.directory && !file_info.reparse) {
-    process_recursive(file_info.file_name);
+    add_dir(file_info.file_name);
   }
   for (unsigned i = 1; i < file_list.size(); i++) {
     FileInfo fi;
     fi.file_name = file_list[i];
+    FileTotals fi_totals;
     try {
-      process_file(fi, false);
+      process_file(fi, false, volume, fi_totals);
       if (fi.directory && !fi.reparse) {
-        process_recursive(fi.file_name);
+        add_dir(fi.file_name);
       }
     }
     catch (Error&) {
-      totals.err_cnt++;
+      fi_totals.err_cnt++;
     }
-    time_t ctime = time(NULL);
-    if (ctime > update_timer + c_update_time) {
-      display_file_info(true);
-      update_timer = ctime;
+    catch (std::exception&) {
+      fi_totals.err_cnt++;
     }
+    totals.add_interlocked(fi_totals);
+  }
+
+  if (pending_dirs) {
+    unsigned num_th = min(get_cpu_count(), MAXIMUM_WAIT_OBJECTS);
+    std::vector<std::unique_ptr<Worker>> workers;
+    Array<HANDLE> h_threads;
+    try {
+      for (unsigned i = 0; i < num_th; i++) {
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
+        workers.back()->analyzer = this;
+        unsigned th_id;
+        HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, worker_proc, workers.back().get(), 0, &th_id));
+        CHECK_SYS(h != NULL);
+        h_threads += h;
+      }
+      while (WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, c_update_time * 1000) == WAIT_TIMEOUT) {
+        display_file_info(true);
+      }
+    }
+    catch (...) {
+      SetEvent(h_stop_event);
+      VERIFY(WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE) != WAIT_FAILED);
+      for (unsigned i = 0; i < h_threads.size(); i++) CloseHandle(h_threads[i]);
+      throw;
+    }
+    for (unsigned i = 0; i < h_threads.size(); i++) CloseHandle(h_threads[i]);
   }
   display_file_info();
 }
@@ -914,6 +1076,10 @@ unsigned __stdcall FileAnalyzer::th_proc(void* param) {
     error_dlg(e);
     return FALSE;
   }
+  catch (std::exception& e) {
+    error_dlg(e);
+    return FALSE;
+  }
   return TRUE;
 }
 
@@ -1083,7 +1249,7 @@ void plugin_show_metadata(const ObjectArray<UnicodeString>& file_list) {
   fa.file_list = file_list;
   fa.volume.open(extract_path_root(get_real_path(extract_file_path(file_list[0]))));
   fa.file_info.file_name = file_list[0];
-  fa.process_file(fa.file_info, true);
+  fa.process_file(fa.file_info, true, fa.volume, fa.totals);
   fa.display_file_info();
 }
 
@@ -4,7 +4,7 @@
 #include "msg.h"
 
 #include "utils.h"
-#include "ntfs.h"
+#include "ntfs_core/ntfs_core.h"
 #include "volume.h"
 #include "ntfs_file.h"
 #include "options.h"
@@ -13,17 +13,206 @@
 
 #define NTFS_FILE_REC_HEADER_SIZE offsetof(NTFS_FILE_RECORD_OUTPUT_BUFFER, FileRecordBuffer)
 
-struct FilePanel::FileRecordCompare {
-  int operator()(const FileRecord& item1, const FileRecord& item2) {
-    if (item1.parent_ref_num > item2.parent_ref_num) return 1;
-    else if (item1.parent_ref_num == item2.parent_ref_num) {
-      return item1.file_name.compare(item2.file_name);
-    }
-    else return -1;
+const unsigned c_mft_chunk_size = 4 * 1024 * 1024;
+const unsigned c_ui_wait_time = 100;
+
+// same order as UnicodeString::compare()
+int FilePanel::MftIndex::compare_name(unsigned idx, const wchar_t* name, unsigned size) const {
+  unsigned idx_size = name_size(idx);
+  int res = memcmp(this->name(idx), name, min(idx_size, size) * sizeof(wchar_t));
+  if (res != 0) return res;
+  if (idx_size > size) return 1;
+  else if (idx_size == size) return 0;
+  else return -1;
+}
+
+// order by (parent_ref_num, file_name)
+int FilePanel::MftIndex::compare(unsigned idx, const MftIndex& index, unsigned index_idx) const {
+  if (parent_ref_num[idx] > index.parent_ref_num[index_idx]) return 1;
+  else if (parent_ref_num[idx] == index.parent_ref_num[index_idx]) return compare_name(idx, index.name(index_idx), index.name_size(index_idx));
+  else return -1;
+}
+
+void FilePanel::MftIndex::clear() {
+  MftIndex().swap(*this);
+}
+
+void FilePanel::MftIndex::swap(MftIndex& index) {
+  file_ref_num.swap(index.file_ref_num);
+  parent_ref_num.swap(index.parent_ref_num);
+  file_attr.swap(index.file_attr);
+  creation_time.swap(index.creation_time);
+  last_access_time.swap(index.last_access_time);
+  last_write_time.swap(index.last_write_time);
+  data_size.swap(index.data_size);
+  disk_size.swap(index.disk_size);
+  valid_size.swap(index.valid_size);
+  fragment_cnt.swap(index.fragment_cnt);
+  mft_rec_cnt.swap(index.mft_rec_cnt);
+  stream_cnt.swap(index.stream_cnt);
+  hard_link_cnt.swap(index.hard_link_cnt);
+  flags.swap(index.flags);
+  name_pos.swap(index.name_pos);
+  names.swap(index.names);
+  child_pos.swap(index.child_pos);
+  mapping.swap(index.mapping);
+}
+
+void FilePanel::MftIndex::reserve(unsigned rec_cnt, size_t name_cnt) {
+  file_ref_num.reserve(rec_cnt);
+  parent_ref_num.reserve(rec_cnt);
+  file_attr.reserve(rec_cnt);
+  creation_time.reserve(rec_cnt);
+  last_access_time.reserve(rec_cnt);
+  last_write_time.reserve(rec_cnt);
+  data_size.reserve(rec_cnt);
+  disk_size.reserve(rec_cnt);
+  valid_size.reserve(rec_cnt);
+  fragment_cnt.reserve(rec_cnt);
+  mft_rec_cnt.reserve(rec_cnt);
+  stream_cnt.reserve(rec_cnt);
+  hard_link_cnt.reserve(rec_cnt);
+  flags.reserve(rec_cnt);
+  name_pos.reserve(rec_cnt + 1);
+  names.reserve(name_cnt);
+}
+
+void FilePanel::MftIndex::add(const FileRecord& rec, const wchar_t* name, unsigned size) {
+  CHECK_MSG(names.size() + size <= 0xFFFFFFFF, L"MFT index is too large");
+  file_ref_num.push_back(rec.file_ref_num);
+  parent_ref_num.push_back(rec.parent_ref_num);
+  file_attr.push_back(rec.file_attr);
+  creation_time.push_back(rec.creation_time);
+  last_access_time.push_back(rec.last_access_time);
+  last_write_time.push_back(rec.last_write_time);
+  data_size.push_back(rec.data_size);
+  disk_size.push_back(rec.disk_size);
+  valid_size.push_back(rec.valid_size);
+  fragment_cnt.push_back(rec.fragment_cnt);
+  mft_rec_cnt.push_back(rec.mft_rec_cnt);
+  stream_cnt.push_back(rec.stream_cnt);
+  hard_link_cnt.push_back(rec.hard_link_cnt);
+  flags.push_back(rec.flags);
+  names.append(name, name + size);
+  name_pos.push_back(static_cast<u32>(names.size()));
+}
+
+void FilePanel::MftIndex::add(const MftIndex& index, unsigned idx) {
+  FileRecord rec;
+  index.get(idx, rec);
+  add(rec, index.name(idx), index.name_size(idx));
+}
+
+void FilePanel::MftIndex::append(const MftIndex& index) {
+  CHECK_MSG(names.size() + index.names.size() <= 0xFFFFFFFF, L"MFT index is too large");
+  file_ref_num.append(index.file_ref_num.begin(), index.file_ref_num.end());
+  parent_ref_num.append(index.parent_ref_num.begin(), index.parent_ref_num.end());
+  file_attr.append(index.file_attr.begin(), index.file_attr.end());
+  creation_time.append(index.creation_time.begin(), index.creation_time.end());
+  last_access_time.append(index.last_access_time.begin(), index.last_access_time.end());
+  last_write_time.append(index.last_write_time.begin(), index.last_write_time.end());
+  data_size.append(index.data_size.begin(), index.data_size.end());
+  disk_size.append(index.disk_size.begin(), index.disk_size.end());
+  valid_size.append(index.valid_size.begin(), index.valid_size.end());
+  fragment_cnt.append(index.fragment_cnt.begin(), index.fragment_cnt.end());
+  mft_rec_cnt.append(index.mft_rec_cnt.begin(), index.mft_rec_cnt.end());
+  stream_cnt.append(index.stream_cnt.begin(), index.stream_cnt.end());
+  hard_link_cnt.append(index.hard_link_cnt.begin(), index.hard_link_cnt.end());
+  flags.append(index.flags.begin(), index.flags.end());
+  u32 base = static_cast<u32>(names.size());
+  for (unsigned i = 1; i < index.name_pos.size(); i++) name_pos.push_back(base + index.name_pos[i]);
+  names.append(index.names.begin(), index.names.end());
+}
+
+// linear merge of sorted index (without records of removed files) and sorted delta
+void FilePanel::MftIndex::merge(const MftIndex& index, const std::vector<bool>& removed_refs, const MftIndex& delta) {
+  clear();
+  reserve(index.size() + delta.size(), index.names.size() + delta.names.size());
+  unsigned i = 0;
+  unsigned j = 0;
+  while (true) {
+    while ((i < index.size()) && (index.file_ref_num[i] < removed_refs.size()) && removed_refs[static_cast<size_t>(index.file_ref_num[i])]) i++;
+    if (i == index.size()) break;
+    if ((j < delta.size()) && (delta.compare(j, index, i) < 0)) add(delta, j++);
+    else add(index, i++);
   }
-};
+  while (j < delta.size()) add(delta, j++);
+}
 
-void FilePanel::add_file_records(std::list<FileRecord>& file_list, const FileInfo& file_info) {
+void FilePanel::MftIndex::get(unsigned idx, FileRecord& rec) const {
+  rec.file_ref_num = file_ref_num[idx];
+  rec.parent_ref_num = parent_ref_num[idx];
+  rec.file_attr = file_attr[idx];
+  rec.creation_time = creation_time[idx];
+  rec.last_access_time = last_access_time[idx];
+  rec.last_write_time = last_write_time[idx];
+  rec.data_size = data_size[idx];
+  rec.disk_size = disk_size[idx];
+  rec.valid_size = valid_size[idx];
+  rec.fragment_cnt = fragment_cnt[idx];
+  rec.mft_rec_cnt = mft_rec_cnt[idx];
+  rec.stream_cnt = stream_cnt[idx];
+  rec.hard_link_cnt = hard_link_cnt[idx];
+  rec.flags = flags[idx];
+}
+
+// build parent -> children offset table (index must be sorted)
+void FilePanel::MftIndex::build_child_index() {
+  u64 max_ref = 0;
+  for (unsigned i = 0; i < size(); i++) {
+    if (file_ref_num[i] > max_ref) max_ref = file_ref_num[i];
+    if (parent_ref_num[i] > max_ref) max_ref = parent_ref_num[i];
+  }
+  CHECK_MSG(max_ref < 0xFFFFFFFF, L"MFT index is too large");
+  std::vector<u32> pos(static_cast<size_t>(max_ref) + 2);
+  unsigned idx = 0;
+  for (unsigned ref = 0; ref < pos.size(); ref++) {
+    while ((idx < size()) && (parent_ref_num[idx] < ref)) idx++;
+    pos[ref] = idx;
+  }
+  child_pos.swap(pos);
+}
+
+// returns -1 if not found
+unsigned FilePanel::MftIndex::find(u64 parent_ref_num, const UnicodeString& name) const {
+  unsigned first, last;
+  get_children(parent_ref_num, first, last);
+  while (first < last) {
+    unsigned mid = first + (last - first) / 2;
+    int res = compare_name(mid, name.data(), name.size());
+    if (res == 0) return mid;
+    else if (res < 0) first = mid + 1;
+    else last = mid;
+  }
+  return -1;
+}
+
+u64 FilePanel::MftIndex::memory_size() const {
+  return file_ref_num.capacity() * sizeof(u64) + parent_ref_num.capacity() * sizeof(u64) + file_attr.capacity() * sizeof(DWORD) +
+    (creation_time.capacity() + last_access_time.capacity() + last_write_time.capacity()) * sizeof(FILETIME) +
+    (data_size.capacity() + disk_size.capacity() + valid_size.capacity()) * sizeof(u64) +
+    (fragment_cnt.capacity() + mft_rec_cnt.capacity()) * sizeof(u32) + (stream_cnt.capacity() + hard_link_cnt.capacity()) * sizeof(u16) +
+    flags.capacity() * sizeof(u8) + name_pos.capacity() * sizeof(u32) + names.capacity() * sizeof(wchar_t) + child_pos.capacity() * sizeof(u32);
+}
+
+// check that names and child table are consistent so that corrupted cache cannot cause access outside of columns
+void FilePanel::MftIndex::validate() const {
+  const wchar_t* c_corrupted_msg = L"Corrupted cache file";
+  CHECK_MSG(parent_ref_num.size() == size() && file_attr.size() == size() && creation_time.size() == size() && last_access_time.size() == size() && last_write_time.size() == size() &&
+    data_size.size() == size() && disk_size.size() == size() && valid_size.size() == size() && fragment_cnt.size() == size() && mft_rec_cnt.size() == size() &&
+    stream_cnt.size() == size() && hard_link_cnt.size() == size() && flags.size() == size(), c_corrupted_msg);
+  CHECK_MSG(name_pos.size() == size() + 1 && name_pos[0] == 0 && name_pos[size()] == names.size(), c_corrupted_msg);
+  for (unsigned i = 0; i < size(); i++) CHECK_MSG(name_pos[i] <= name_pos[i + 1], c_corrupted_msg);
+  CHECK_MSG(child_pos.size() >= 2 && child_pos[0] == 0 && child_pos[child_pos.size() - 1] == size(), c_corrupted_msg);
+  for (unsigned ref = 0; ref + 1 < child_pos.size(); ref++) CHECK_MSG(child_pos[ref] <= child_pos[ref + 1], c_corrupted_msg);
+  for (unsigned i = 0; i < size(); i++) {
+    CHECK_MSG(file_ref_num[i] < ref_cnt() && parent_ref_num[i] < ref_cnt(), c_corrupted_msg);
+    size_t parent = static_cast<size_t>(parent_ref_num[i]);
+    CHECK_MSG(child_pos[parent] <= i && i < child_pos[parent + 1], c_corrupted_msg);
+  }
+}
+
+void FilePanel::add_file_records(MftIndex& index, const FileInfo& file_info) {
   u64 data_size = 0;
   u64 nr_disk_size = 0;
   u64 valid_size = 0;
@@ -56,7 +245,6 @@ void FilePanel::add_file_records(std::list<FileRecord>& file_list, const FileInf
       FileRecord rec;
       rec.file_ref_num = file_info.file_ref_num();
       rec.parent_ref_num = name_attr.parent_directory;
-      rec.file_name = name_attr.name;
       rec.file_attr = file_attr;
       U64_TO_FILETIME(rec.creation_time, file_info.std_info.creation_time);
       U64_TO_FILETIME(rec.last_access_time, file_info.std_info.last_access_time);
@@ -69,7 +257,7 @@ void FilePanel::add_file_records(std::list<FileRecord>& file_list, const FileInf
       rec.hard_link_cnt = hard_link_cnt;
       rec.mft_rec_cnt = file_info.mft_rec_cnt;
       rec.set_flags(false, fully_resident);
-      file_list.push_back(rec);
+      index.add(rec, name_attr.name);
     }
   }
 
@@ -106,7 +294,6 @@ void FilePanel::add_file_records(std::list<FileRecord>& file_list, const FileInf
             FileRecord rec;
             rec.file_ref_num = file_info.file_ref_num();
             rec.parent_ref_num = name_attr.parent_directory;
-            rec.file_name = name_attr.name + L":" + attr.name + L":$" + attr.type_name();
             rec.file_attr = file_attr;
             U64_TO_FILETIME(rec.creation_time, file_info.std_info.creation_time);
             U64_TO_FILETIME(rec.last_access_time, file_info.std_info.last_access_time);
@@ -119,7 +306,7 @@ void FilePanel::add_file_records(std::list<FileRecord>& file_list, const FileInf
             rec.hard_link_cnt = 0;
             rec.mft_rec_cnt = 0;
             rec.set_flags(true, attr.resident);
-            file_list.push_back(rec);
+            index.add(rec, name_attr.name + L":" + attr.name + L":$" + attr.type_name());
           }
         }
       }
@@ -181,7 +368,359 @@ void FilePanel::delete_usn_journal() {
   }
 }
 
+// MFT scan pipeline: calling thread reads raw MFT chunks, worker threads decode records
+// each worker collects file records into its own index, indices are merged when scan is finished
+struct FilePanel::MftScanner {
+  enum ChunkState {
+    cs_free,
+    cs_reading,
+    cs_ready,
+    cs_processing,
+  };
+  struct Chunk {
+    u8* buf;
+    u64 first_rec;
+    unsigned rec_cnt;
+    ChunkState state;
+  };
+  struct Worker {
+    MftScanner* scanner;
+    FileInfo file_info;
+    MftIndex index;
+    UnicodeString error;
+  };
+  NtfsVolume& volume;
+  MftReader& mft_reader;
+  MftIndex& index;
+  unsigned chunk_rec_cnt;
+  Array<Chunk> chunks;
+  std::vector<Worker> workers;
+  CriticalSection sync;
+  Event stop_event;
+  Semaphore ready_sem;
+  Semaphore free_sem;
+  u64 rec_done;
+  unsigned file_cnt;
+
+  MftScanner(NtfsVolume& volume, MftReader& mft_reader, MftIndex& index, unsigned num_th, unsigned num_chunks):
+    volume(volume), mft_reader(mft_reader), index(index), stop_event(true, false), ready_sem(0, num_chunks), free_sem(num_chunks, num_chunks), rec_done(0), file_cnt(0) {
+    chunk_rec_cnt = c_mft_chunk_size / volume.file_rec_size;
+    workers.reserve(num_th);
+    for (unsigned i = 0; i < num_th; i++) {
+      workers.push_back(Worker());
+      workers.back().scanner = this;
+      workers.back().file_info.volume = &volume;
+      workers.back().file_info.mft_reader = &mft_reader;
+    }
+    Chunk chunk;
+    chunk.buf = NULL;
+    chunk.state = cs_free;
+    for (unsigned i = 0; i < num_chunks; i++) chunks += chunk;
+  }
+
+  bool decode_chunk(Worker& worker) {
+    unsigned chunk_idx;
+    {
+      CriticalSectionLock lock(sync);
+      for (chunk_idx = 0; (chunk_idx < chunks.size()) && (chunks[chunk_idx].state != cs_ready); chunk_idx++);
+      if (chunk_idx == chunks.size()) return false;
+      chunks.item(chunk_idx).state = cs_processing;
+    }
+    const Chunk& chunk = chunks[chunk_idx];
+    worker.file_info.set_mft_chunk(chunk.first_rec, chunk.rec_cnt, chunk.buf);
+    unsigned cnt = 0;
+    for (unsigned i = 0; i < chunk.rec_cnt; i++) {
+      const u8* file_rec = chunk.buf + i * volume.file_rec_size;
+      const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(file_rec);
+      if ((mft_rec->magic == magic_FILE) && (mft_rec->flags & MFT_RECORD_IN_USE) && (mft_rec->base_mft_record == 0)) {
+        worker.file_info.set_base_file_rec(chunk.first_rec + i, file_rec);
+        worker.file_info.process_base_file_rec();
+        add_file_records(worker.index, worker.file_info);
+        cnt++;
+      }
+    }
+    worker.file_info.set_mft_chunk(0, 0, NULL);
+    {
+      CriticalSectionLock lock(sync);
+      rec_done += chunk.rec_cnt;
+      file_cnt += cnt;
+      chunks.item(chunk_idx).state = cs_free;
+    }
+    CHECK_SYS(ReleaseSemaphore(free_sem.handle(), 1, NULL));
+    return true;
+  }
+
+  static unsigned __stdcall worker_proc(void* param) {
+    Worker* worker = static_cast<Worker*>(param);
+    try {
+      MftScanner* scanner = worker->scanner;
+      while (true) {
+        HANDLE h[2] = { scanner->stop_event.handle(), scanner->ready_sem.handle() };
+        DWORD w = WaitForMultipleObjects(2, h, FALSE, INFINITE);
+        CHECK_SYS(w != WAIT_FAILED);
+        if (w == WAIT_OBJECT_0) {
+          while (scanner->decode_chunk(*worker));
+          break;
+        }
+        // chunk may be already taken by worker draining queue after stop
+        else scanner->decode_chunk(*worker);
+      }
+      return TRUE;
+    }
+    catch (Error& e) {
+      worker->error = e.message();
+      return FALSE;
+    }
+    catch (std::exception& e) {
+      worker->error = oem_to_unicode(e.what());
+      return FALSE;
+    }
+    catch (...) {
+      return FALSE;
+    }
+  }
+
+  template<typename Progress> void update_progress(Progress& progress) {
+    {
+      CriticalSectionLock lock(sync);
+      progress.curr_file_index = rec_done;
+      progress.count = file_cnt;
+    }
+    progress.update_ui();
+  }
+
+  template<typename Progress> void run(Progress& progress) {
+    unsigned start_time = GetTickCount();
+    u8* chunk_mem = static_cast<u8*>(VirtualAlloc(NULL, chunks.size() * c_mft_chunk_size, MEM_COMMIT, PAGE_READWRITE));
+    CHECK_SYS(chunk_mem != NULL);
+    CLEAN(u8*, chunk_mem, CHECK_SYS(VirtualFree(chunk_mem, 0, MEM_RELEASE)));
+    for (unsigned i = 0; i < chunks.size(); i++) chunks.item(i).buf = chunk_mem + i * c_mft_chunk_size;
+
+    Array<HANDLE> h_threads;
+    try {
+      for (unsigned i = 0; i < workers.size(); i++) {
+        unsigned th_id;
+        HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, worker_proc, &workers[i], 0, &th_id));
+        CHECK_SYS(h != NULL);
+        h_threads += h;
+      }
+
+      // reader loop
+      Array<HANDLE> h = free_sem.handle() + h_threads;
+      u64 file_index = 0;
+      while (file_index < mft_reader.record_count()) {
+        DWORD w;
+        while ((w = WaitForMultipleObjects(h.size(), h.data(), FALSE, c_ui_wait_time)) == WAIT_TIMEOUT) update_progress(progress);
+        CHECK_SYS(w != WAIT_FAILED);
+        if (w != WAIT_OBJECT_0) break; // worker failed
+
+        unsigned chunk_idx;
+        {
+          CriticalSectionLock lock(sync);
+          for (chunk_idx = 0; chunks[chunk_idx].state != cs_free; chunk_idx++);
+          chunks.item(chunk_idx).state = cs_reading;
+        }
+        Chunk& chunk = chunks.item(chunk_idx);
+        chunk.first_rec = file_index;
+        chunk.rec_cnt = mft_reader.read_records(file_index, chunk_rec_cnt, chunk.buf);
+        file_index += chunk.rec_cnt;
+        {
+          CriticalSectionLock lock(sync);
+          chunk.state = cs_ready;
+        }
+        CHECK_SYS(ReleaseSemaphore(ready_sem.handle(), 1, NULL));
+        update_progress(progress);
+      }
+
+      // let workers finish remaining chunks
+      CHECK_SYS(SetEvent(stop_event.handle()));
+      while (WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, c_ui_wait_time) == WAIT_TIMEOUT) update_progress(progress);
+    }
+    finally (
+      SetEvent(stop_event.handle());
+      VERIFY(WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE) != WAIT_FAILED);
+      for (unsigned i = 0; i < h_threads.size(); i++) VERIFY(CloseHandle(h_threads[i]) != 0);
+    );
+
+    for (unsigned i = 0; i < workers.size(); i++) {
+      if (workers[i].error.size() != 0) FAIL(MsgError(workers[i].error));
+    }
+    CHECK_MSG(rec_done == mft_reader.record_count(), L"Unexpected thread death");
+
+    unsigned total_cnt = 0;
+    size_t total_name_cnt = 0;
+    for (unsigned i = 0; i < workers.size(); i++) {
+      total_cnt += workers[i].index.size();
+      total_name_cnt += workers[i].index.names.size();
+    }
+    index.reserve(index.size() + total_cnt, index.names.size() + total_name_cnt);
+    for (unsigned i = 0; i < workers.size(); i++) {
+      index.append(workers[i].index);
+      workers[i].index.clear();
+    }
+
+    unsigned time = GetTickCount() - start_time;
+    DBG_LOG(UnicodeString::format(L"MFT scan: %u threads, %Lu records, %u ms, %Lu records/s", static_cast<unsigned>(workers.size()), rec_done, time, time ? rec_done * 1000 / time : 0));
+  }
+};
+
+// sort index by (parent_ref_num, file_name); file names are compared as UnicodeString::compare() does
+struct FilePanel::MftIndexSorter {
+  enum {
+    c_min_segment_size = 64 * 1024
+  };
+  struct Item {
+    u64 parent;
+    u64 key; // first 8 bytes of name in memcmp() order
+    unsigned idx;
+  };
+  struct Less {
+    const MftIndex* index;
+    bool operator()(const Item& item1, const Item& item2) const {
+      if (item1.parent != item2.parent) return item1.parent < item2.parent;
+      if (item1.key != item2.key) return item1.key < item2.key;
+      return index->compare_name(item1.idx, index->name(item2.idx), index->name_size(item2.idx)) < 0;
+    }
+  };
+  MftIndex& index;
+  std::vector<Item> items;
+  std::vector<unsigned> bounds; // segment boundaries
+  Less less;
+
+  static u64 name_key(const wchar_t* name, unsigned name_size) {
+    const u8* data = reinterpret_cast<const u8*>(name);
+    unsigned size = min(name_size * static_cast<unsigned>(sizeof(wchar_t)), static_cast<unsigned>(sizeof(u64)));
+    u64 key = 0;
+    for (unsigned i = 0; i < sizeof(u64); i++) key = (key << 8) | (i < size ? data[i] : 0);
+    return key;
+  }
+
+  MftIndexSorter(MftIndex& index): index(index) {
+    less.index = &index;
+    items.resize(index.size());
+    for (unsigned i = 0; i < index.size(); i++) {
+      items[i].parent = index.parent_ref_num[i];
+      items[i].key = name_key(index.name(i), index.name_size(i));
+      items[i].idx = i;
+    }
+  }
+
+  // stable LSD radix sort on parent reference (16 bits per pass)
+  void radix_sort() {
+    std::vector<Item> tmp(items.size());
+    std::vector<unsigned> cnt(0x10000);
+    for (unsigned shift = 0; shift < 64; shift += 16) {
+      std::fill(cnt.begin(), cnt.end(), 0);
+      for (unsigned i = 0; i < items.size(); i++) cnt[(items[i].parent >> shift) & 0xFFFF]++;
+      if (cnt[(items[0].parent >> shift) & 0xFFFF] == items.size()) continue; // all digits are equal
+      unsigned pos = 0;
+      for (unsigned d = 0; d < cnt.size(); d++) {
+        unsigned c = cnt[d];
+        cnt[d] = pos;
+        pos += c;
+      }
+      for (unsigned i = 0; i < items.size(); i++) tmp[cnt[(items[i].parent >> shift) & 0xFFFF]++] = items[i];
+      items.swap(tmp);
+    }
+  }
+
+  struct SortTask: public ParallelTask {
+    MftIndexSorter* sorter;
+    virtual void run(unsigned idx) {
+      std::sort(sorter->items.begin() + sorter->bounds[idx], sorter->items.begin() + sorter->bounds[idx + 1], sorter->less);
+    }
+  };
+
+  // merge segment pairs [2 * idx * width, (2 * idx + 1) * width) and [(2 * idx + 1) * width, (2 * idx + 2) * width)
+  struct MergeTask: public ParallelTask {
+    MftIndexSorter* sorter;
+    unsigned width;
+    virtual void run(unsigned idx) {
+      unsigned seg_cnt = static_cast<unsigned>(sorter->bounds.size()) - 1;
+      unsigned mid_seg = (2 * idx + 1) * width;
+      if (mid_seg >= seg_cnt) return;
+      std::vector<Item>::iterator first = sorter->items.begin() + sorter->bounds[2 * idx * width];
+      std::vector<Item>::iterator mid = sorter->items.begin() + sorter->bounds[mid_seg];
+      std::vector<Item>::iterator last = sorter->items.begin() + sorter->bounds[min(mid_seg + width, seg_cnt)];
+      // segments are already ordered by parent, so only overlapping part needs merging
+      first = std::upper_bound(first, mid, *mid, sorter->less);
+      last = std::lower_bound(mid, last, *(mid - 1), sorter->less);
+      if (first != mid && mid != last) std::inplace_merge(first, mid, last, sorter->less);
+    }
+  };
+
+  template<class T> void permute(Column<T>& column) {
+    std::vector<T> sorted_column(column.size());
+    for (unsigned i = 0; i < items.size(); i++) sorted_column[i] = column[items[i].idx];
+    column.swap(sorted_column);
+  }
+
+  void permute_names() {
+    std::vector<u32> sorted_name_pos;
+    sorted_name_pos.reserve(index.name_pos.size());
+    std::vector<wchar_t> sorted_names;
+    sorted_names.reserve(index.names.size());
+    sorted_name_pos.push_back(0);
+    for (unsigned i = 0; i < items.size(); i++) {
+      const wchar_t* name = index.name(items[i].idx);
+      sorted_names.insert(sorted_names.end(), name, name + index.name_size(items[i].idx));
+      sorted_name_pos.push_back(static_cast<u32>(sorted_names.size()));
+    }
+    index.name_pos.swap(sorted_name_pos);
+    index.names.swap(sorted_names);
+  }
+
+  // reorder each column by sorted permutation
+  struct PermuteTask: public ParallelTask {
+    MftIndexSorter* sorter;
+    virtual void run(unsigned idx) {
+      MftIndex& index = sorter->index;
+      switch (idx) {
+      case 0: sorter->permute(index.file_ref_num); break;
+      case 1: sorter->permute(index.parent_ref_num); break;
+      case 2: sorter->permute(index.file_attr); break;
+      case 3: sorter->permute(index.creation_time); break;
+      case 4: sorter->permute(index.last_access_time); break;
+      case 5: sorter->permute(index.last_write_time); break;
+      case 6: sorter->permute(index.data_size); break;
+      case 7: sorter->permute(index.disk_size); break;
+      case 8: sorter->permute(index.valid_size); break;
+      case 9: sorter->permute(index.fragment_cnt); break;
+      case 10: sorter->permute(index.mft_rec_cnt); break;
+      case 11: sorter->permute(index.stream_cnt); break;
+      case 12: sorter->permute(index.hard_link_cnt); break;
+      case 13: sorter->permute(index.flags); break;
+      case 14: sorter->permute_names(); break;
+      }
+    }
+  };
+
+  void sort() {
+    if (items.size() < 2) return;
+    radix_sort();
+    unsigned seg_cnt = min(get_cpu_count(), static_cast<unsigned>(items.size()) / c_min_segment_size + 1);
+    for (unsigned i = 0; i <= seg_cnt; i++) bounds.push_back(static_cast<unsigned>(static_cast<u64>(items.size()) * i / seg_cnt));
+    SortTask sort_task;
+    sort_task.sorter = this;
+    run_parallel(sort_task, seg_cnt);
+    MergeTask merge_task;
+    merge_task.sorter = this;
+    for (merge_task.width = 1; merge_task.width < seg_cnt; merge_task.width *= 2) {
+      run_parallel(merge_task, (seg_cnt + 2 * merge_task.width - 1) / (2 * merge_task.width));
+    }
+    PermuteTask permute_task;
+    permute_task.sorter = this;
+    run_parallel(permute_task, 15);
+  }
+};
+
+void FilePanel::sort_mft_index(MftIndex& index) {
+  MftIndexSorter sorter(index);
+  sorter.sort();
+}
+
 void FilePanel::create_mft_index() {
+  stop_usn_watcher();
   prepare_usn_journal();
 
   class VolumeListProgress: public ProgressMonitor {
@@ -211,11 +750,21 @@ void FilePanel::create_mft_index() {
   FileInfo file_info;
   file_info.volume = &volume;
   volume.synced = false;
-  u64 max_file_index = file_info.load_base_file_rec(volume.mft_size / volume.file_rec_size - 1);
-  std::list<FileRecord> file_list;
-  progress.max_file_index = max_file_index;
-
-  if (g_file_panel_mode.backward_mft_scan) {
+  MftIndex index;
+  unsigned start_time = GetTickCount();
+
+  if (g_file_panel_mode.bulk_mft_read) {
+    volume.flush();
+    MftReader mft_reader(volume, volume);
+    progress.max_file_index = mft_reader.record_count();
+    unsigned num_th = g_mft_scan_threads != 0 ? g_mft_scan_threads : get_cpu_count();
+    num_th = min(num_th, MAXIMUM_WAIT_OBJECTS - 1); // reader waits on free_sem + all worker threads
+    MftScanner scanner(volume, mft_reader, index, num_th, num_th * 2);
+    scanner.run(progress);
+  }
+  else if (g_file_panel_mode.backward_mft_scan) {
+    u64 max_file_index = file_info.load_base_file_rec(volume.mft_size / volume.file_rec_size - 1);
+    progress.max_file_index = max_file_index;
     u64 file_index = max_file_index + 1;
     do {
       file_index--;
@@ -227,142 +776,281 @@ void FilePanel::create_mft_index() {
 
       if (file_info.base_mft_rec()->base_mft_record == 0) {
         file_info.process_base_file_rec();
-        add_file_records(file_list, file_info);
+        add_file_records(index, file_info);
         progress.count++;
       }
     }
     while (file_index != 0);
   }
   else {
+    u64 max_file_index = file_info.load_base_file_rec(volume.mft_size / volume.file_rec_size - 1);
+    progress.max_file_index = max_file_index;
     for (u64 file_index = 0; file_index <= max_file_index; file_index++) {
       progress.curr_file_index = file_index;
       progress.update_ui();
 
       if ((file_index == file_info.load_base_file_rec(file_index)) && (file_info.base_mft_rec()->base_mft_record == 0)) {
         file_info.process_base_file_rec();
-        add_file_records(file_list, file_info);
+        add_file_records(index, file_info);
         progress.count++;
       }
     }
   }
 
   try {
-    mft_index.clear().extend(static_cast<unsigned>(file_list.size()));
-    for (std::list<FileRecord>::const_iterator file_rec = file_list.begin(); file_rec != file_list.end(); file_rec++) mft_index += *file_rec;
-    mft_index.sort<FileRecordCompare>();
+    unsigned scan_time = GetTickCount() - start_time;
+    sort_mft_index(index);
+    index.build_child_index();
+    DBG_LOG(UnicodeString::format(L"MFT index: %u records, %Lu names, %Lu KB, scan %u ms, sort %u ms", index.size(), static_cast<u64>(index.names.size()), index.memory_size() / 1024, scan_time, GetTickCount() - start_time - scan_time));
+    std::shared_ptr<MftIndex> new_index(new MftIndex());
+    new_index->swap(index);
+    mft_index = new_index;
     root_dir_ref_num = mft_find_root();
   }
   catch (...) {
     invalidate_mft_index();
     throw;
   }
+  start_usn_watcher();
 }
 
-void FilePanel::update_mft_index_from_usn() {
-  class Progress: public ProgressMonitor {
-  protected:
-    virtual void do_update_ui() {
-      const unsigned c_client_xs = 60;
-      ObjectArray<UnicodeString> lines;
-      unsigned len1 = static_cast<unsigned>(current * c_client_xs / total);
-      if (len1 > c_client_xs) len1 = c_client_xs;
-      unsigned len2 = c_client_xs - len1;
-      lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
-      draw_text_box(far_get_msg(MSG_FILE_PANEL_UPDATE_CACHE_PROGRESS_TITLE), lines, c_client_xs);
-      SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_FILE_PANEL_UPDATE_CACHE_PROGRESS_CONSOLE_TITLE).data(), static_cast<unsigned>(current * 100 / total)).data());
-      far_set_progress_state(TBPF_NORMAL);
-      far_set_progress_value(current, total);
-    }
-  public:
-    u64 current, total;
-    Progress(): ProgressMonitor(true), current(0) {
-    }
-  };
-  Progress progress;
-
-  READ_USN_JOURNAL_DATA read_usn_data;
-  read_usn_data.StartUsn = next_usn;
-  read_usn_data.ReasonMask = 0xFFFFFFFF;
-  read_usn_data.ReturnOnlyOnClose = FALSE;
-  read_usn_data.Timeout = 0;
-  read_usn_data.BytesToWaitFor = 0;
-  read_usn_data.UsnJournalID = usn_journal_id;
-
-  std::set<u64> upd_file_refs;
-  Array<unsigned char> usn_buffer;
-  const unsigned c_usn_buffer_size = 0x1000;
-  while(true) {
-    DWORD bytes_ret;
-    CHECK_SYS(DeviceIoControl(volume.handle, FSCTL_READ_USN_JOURNAL, &read_usn_data, sizeof(read_usn_data), usn_buffer.buf(c_usn_buffer_size), c_usn_buffer_size, &bytes_ret, NULL));
-    usn_buffer.set_size(bytes_ret);
-    if (usn_buffer.size() < sizeof(USN)) break;
-    read_usn_data.StartUsn = *reinterpret_cast<const USN*>(usn_buffer.data());
-    if (usn_buffer.size() == sizeof(USN)) break;
-    unsigned pos = sizeof(USN);
-    while (pos < usn_buffer.size()) {
-      const USN_RECORD* usn_rec = reinterpret_cast<const USN_RECORD*>(usn_buffer.data() + pos);
-      upd_file_refs.insert(FILE_REF(usn_rec->FileReferenceNumber));
-      pos += usn_rec->RecordLength;
-    }
-  }
-  if (upd_file_refs.size() == 0) return;
-
-  progress.total = upd_file_refs.size();
-  std::list<FileRecord> file_list;
+const unsigned c_usn_watch_batch_time = 500; // ms
+// rebuild costs O(index size): wait at least this many times last rebuild time before next one
+const unsigned c_usn_watch_rebuild_ratio = 4;
+// larger batches are left to panel update which shows progress and can be cancelled
+const size_t c_usn_watch_max_batch = 10000;
+
+// USN reasons that can change MFT index entries
+DWORD get_index_usn_reasons() {
+  DWORD reason_mask = ~c_usn_ignored_reasons;
+  // data overwrite of regular file changes last write time only (index keeps stale value)
+  if (g_usn_ignore_data_overwrite) reason_mask &= ~USN_REASON_DATA_OVERWRITE;
+  return reason_mask;
+}
+
+struct FilePanel::UsnUpdateProgress: public ProgressMonitor {
+protected:
+  virtual void do_update_ui() {
+    const unsigned c_client_xs = 60;
+    ObjectArray<UnicodeString> lines;
+    unsigned len1 = static_cast<unsigned>(current * c_client_xs / total);
+    if (len1 > c_client_xs) len1 = c_client_xs;
+    unsigned len2 = c_client_xs - len1;
+    lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
+    draw_text_box(far_get_msg(MSG_FILE_PANEL_UPDATE_CACHE_PROGRESS_TITLE), lines, c_client_xs);
+    SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_FILE_PANEL_UPDATE_CACHE_PROGRESS_CONSOLE_TITLE).data(), static_cast<unsigned>(current * 100 / total)).data());
+    far_set_progress_state(TBPF_NORMAL);
+    far_set_progress_value(current, total);
+  }
+public:
+  u64 current, total;
+  UsnUpdateProgress(): ProgressMonitor(true), current(0) {
+  }
+};
+
+bool stop_requested(HANDLE h_stop_event) {
+  return h_stop_event && (WaitForSingleObject(h_stop_event, 0) != WAIT_TIMEOUT);
+}
+
+// reload records of changed files; progress and stop event are optional
+// returns false if stop event was signalled (delta is incomplete)
+bool FilePanel::load_changed_files(NtfsVolume& volume, const std::vector<u64>& file_refs, MftIndex& delta, UsnUpdateProgress* progress, HANDLE h_stop_event) {
+  if (progress) progress->total = file_refs.size();
   FileInfo file_info;
   file_info.volume = &volume;
   volume.synced = false;
-  for (std::set<u64>::const_iterator file_index = upd_file_refs.begin(); file_index != upd_file_refs.end(); file_index++) {
+  for (std::vector<u64>::const_iterator file_index = file_refs.begin(); file_index != file_refs.end(); file_index++) {
+    if (stop_requested(h_stop_event)) return false;
     DBG_LOG(UnicodeString::format(L"mft_update_index(): %Lx", *file_index));
-    progress.current++;
-    progress.update_ui();
+    if (progress) {
+      progress->current++;
+      progress->update_ui();
+    }
     if ((*file_index == file_info.load_base_file_rec(*file_index)) && (file_info.base_mft_rec()->base_mft_record == 0)) {
       file_info.process_base_file_rec();
-      add_file_records(file_list, file_info);
+      add_file_records(delta, file_info);
     }
   }
+  return true;
+}
 
-  try {
-    next_usn = read_usn_data.StartUsn;
-
-    unsigned i = 0;
-    while (i < mft_index.size()) {
-      if (upd_file_refs.count(mft_index[i].file_ref_num)) {
-        // "fast" remove
-        std::swap(mft_index.item(i), mft_index.last_item());
-        mft_index.remove(mft_index.size() - 1);
+// only delta is sorted, then merged into sorted index in one pass; stop event is optional
+// returns false if stop event was signalled (result is incomplete)
+bool FilePanel::merge_changed_files(const MftIndex& index, const std::vector<u64>& file_refs, MftIndex& delta, MftIndex& result, HANDLE h_stop_event) {
+  sort_mft_index(delta);
+  std::vector<bool> removed_refs(static_cast<size_t>(file_refs.back()) + 1);
+  for (std::vector<u64>::const_iterator file_ref = file_refs.begin(); file_ref != file_refs.end(); file_ref++) removed_refs[static_cast<size_t>(*file_ref)] = true;
+  if (stop_requested(h_stop_event)) return false;
+  result.merge(index, removed_refs, delta);
+  if (stop_requested(h_stop_event)) return false;
+  result.build_child_index();
+  return true;
+}
+
+// background thread: waits for USN journal records, applies them to the last index snapshot
+// and publishes updated snapshot for the panel; index snapshots are never modified once shared
+struct FilePanel::UsnWatcher: private NonCopyable {
+  NtfsVolume volume; // own handle: blocking journal read must not hold up panel I/O
+  DWORDLONG usn_journal_id;
+  USN next_usn;
+  std::shared_ptr<const MftIndex> index;
+  CriticalSection sync;
+  std::shared_ptr<const MftIndex> new_index; // published but not yet taken by panel
+  USN new_next_usn;
+  bool failed; // or batch too large: panel must update index itself
+  unsigned rebuild_time; // ms, last delta load and merge
+  Event stop_event;
+  HANDLE h_thread;
+
+  UsnWatcher(const UnicodeString& volume_name, DWORDLONG usn_journal_id, USN next_usn, const std::shared_ptr<const MftIndex>& index):
+    usn_journal_id(usn_journal_id), next_usn(next_usn), index(index), new_next_usn(next_usn), failed(false), rebuild_time(0), stop_event(true, false), h_thread(NULL) {
+    volume.open(volume_name);
+    unsigned th_id;
+    h_thread = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, thread_proc, this, 0, &th_id));
+    CHECK_SYS(h_thread != NULL);
+  }
+
+  ~UsnWatcher() {
+    SetEvent(stop_event.handle());
+    WaitForSingleObject(h_thread, INFINITE);
+    CloseHandle(h_thread);
+  }
+
+  // returns false if thread has failed and panel must update index itself
+  bool get_index(std::shared_ptr<const MftIndex>& panel_index, USN& panel_next_usn) {
+    CriticalSectionLock lock(sync);
+    if (failed) return false;
+    if (new_index) {
+      panel_index = new_index;
+      panel_next_usn = new_next_usn;
+      new_index.reset();
+    }
+    return true;
+  }
+
+  bool stopped(unsigned timeout) {
+    return WaitForSingleObject(stop_event.handle(), timeout) != WAIT_TIMEOUT;
+  }
+
+  void run() {
+    while (!stopped(0)) {
+      unsigned start_time = GetTickCount();
+      USN usn = next_usn;
+      std::vector<u64> file_refs;
+      volume.read_usn_journal(usn_journal_id, usn, true, get_index_usn_reasons(), file_refs);
+      if (file_refs.empty()) {
+        next_usn = usn;
+        // journal may return before timeout: do not spin
+        unsigned time = GetTickCount() - start_time;
+        if (time < c_usn_watch_timeout) stopped(c_usn_watch_timeout - time);
+        continue;
       }
-      else i++;
+
+      // let more changes accumulate into the same batch; on busy volume rebuild is throttled
+      unsigned batch_time = rebuild_time * c_usn_watch_rebuild_ratio;
+      if (batch_time < c_usn_watch_batch_time) batch_time = c_usn_watch_batch_time;
+      if (stopped(batch_time)) break;
+      volume.read_usn_journal(usn_journal_id, usn, false, get_index_usn_reasons(), file_refs);
+      if (file_refs.size() > c_usn_watch_max_batch) {
+        DBG_LOG(UnicodeString::format(L"USN watcher: %u files changed, left to panel", static_cast<unsigned>(file_refs.size())));
+        CriticalSectionLock lock(sync);
+        failed = true;
+        break;
+      }
+
+      unsigned rebuild_start_time = GetTickCount();
+      MftIndex delta;
+      if (!load_changed_files(volume, file_refs, delta, NULL, stop_event.handle())) break;
+      std::shared_ptr<MftIndex> updated_index(new MftIndex());
+      if (!merge_changed_files(*index, file_refs, delta, *updated_index, stop_event.handle())) break;
+      rebuild_time = GetTickCount() - rebuild_start_time;
+      index = updated_index;
+      next_usn = usn;
+      {
+        CriticalSectionLock lock(sync);
+        new_index = index;
+        new_next_usn = next_usn;
+      }
+      DBG_LOG(UnicodeString::format(L"USN watcher: %u files changed, %u ms", static_cast<unsigned>(file_refs.size()), GetTickCount() - start_time));
     }
+  }
 
-    mft_index.extend(mft_index.size() + static_cast<unsigned>(file_list.size()));
-    for (std::list<FileRecord>::const_iterator file_rec = file_list.begin(); file_rec != file_list.end(); file_rec++) mft_index += *file_rec;
-    mft_index.sort<FileRecordCompare>();
-    root_dir_ref_num = mft_find_root();
+  static unsigned __stdcall thread_proc(void* param) {
+    UsnWatcher* watcher = static_cast<UsnWatcher*>(param);
+    try {
+      watcher->run();
+    }
+    catch (...) {
+      CriticalSectionLock lock(watcher->sync);
+      watcher->failed = true;
+    }
+    return 0;
   }
-  catch (...) {
-    invalidate_mft_index();
-    throw;
+};
+
+FilePanel::FilePanel(): usn_journal_id(0), is_journal_created(false), mft_index(new MftIndex()) {
+}
+
+FilePanel::~FilePanel() {
+}
+
+void FilePanel::start_usn_watcher() {
+  if (!g_file_panel_mode.use_usn_journal || !g_file_panel_mode.usn_watcher || !is_journal_used() || usn_watcher)
+    return;
+  usn_watcher.reset(new UsnWatcher(volume.name, usn_journal_id, next_usn, mft_index));
+}
+
+void FilePanel::stop_usn_watcher() {
+  usn_watcher.reset();
+}
+
+void FilePanel::invalidate_mft_index() {
+  stop_usn_watcher();
+  mft_index.reset(new MftIndex());
+  usn_journal_id = 0;
+}
+
+void FilePanel::update_mft_index_from_usn() {
+  if (usn_watcher) {
+    // index is kept up to date by background thread
+    if (usn_watcher->get_index(mft_index, next_usn)) return;
+    stop_usn_watcher();
   }
+
+  USN usn = next_usn;
+  std::vector<u64> upd_file_refs;
+  volume.read_usn_journal(usn_journal_id, usn, false, get_index_usn_reasons(), upd_file_refs);
+
+  if (upd_file_refs.size() != 0) {
+    UsnUpdateProgress progress;
+    MftIndex upd_index;
+    load_changed_files(volume, upd_file_refs, upd_index, &progress, NULL);
+
+    try {
+      std::shared_ptr<MftIndex> index(new MftIndex());
+      merge_changed_files(*mft_index, upd_file_refs, upd_index, *index, NULL);
+      mft_index = index;
+      root_dir_ref_num = mft_find_root();
+    }
+    catch (...) {
+      invalidate_mft_index();
+      throw;
+    }
+  }
+  next_usn = usn;
+  start_usn_watcher();
 }
 
 void FilePanel::mft_scan_dir(u64 parent_file_index, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress) {
   progress.update_ui();
-  struct ParentFileIndexCompare {
-    int operator()(u64 item1, const FileRecord& item2) {
-      if (item1 > item2.parent_ref_num) return 1;
-      else if (item1 == item2.parent_ref_num) return 0;
-      else return -1;
-    }
-  };
-  unsigned idx = mft_index.bsearch<ParentFileIndexCompare>(parent_file_index);
-  if (idx == -1) return; // empty dir
-  while ((idx != 0) && (mft_index[idx - 1].parent_ref_num == parent_file_index)) idx--; // find first item
-  while ((idx < mft_index.size()) && (mft_index[idx].parent_ref_num == parent_file_index)) {
-    const FileRecord& file_rec = mft_index[idx];
+  unsigned idx, last;
+  mft_index->get_children(parent_file_index, idx, last);
+  FileRecord file_rec;
+  while (idx < last) {
+    mft_index->get(idx, file_rec);
     PanelItemData pid;
-    if (rel_path.size() != 0) pid.file_name = rel_path + L'\\' + file_rec.file_name;
-    else pid.file_name = file_rec.file_name;
+    if (rel_path.size() != 0) pid.file_name = rel_path + L'\\' + mft_index->file_name(idx);
+    else pid.file_name = mft_index->file_name(idx);
     pid.alt_file_name.clear();
     pid.file_attr = file_rec.file_attr;
     pid.creation_time = file_rec.creation_time;
@@ -389,8 +1077,8 @@ void FilePanel::mft_scan_dir(u64 parent_file_index, const UnicodeString& rel_pat
 }
 
 u64 FilePanel::mft_find_root() const {
-  for (unsigned i = 0; i < mft_index.size(); i++) {
-    if (mft_index[i].file_ref_num == mft_index[i].parent_ref_num) return mft_index[i].file_ref_num;
+  for (unsigned i = 0; i < mft_index->size(); i++) {
+    if (mft_index->file_ref_num[i] == mft_index->parent_ref_num[i]) return mft_index->file_ref_num[i];
   }
   FAIL(SystemError(ERROR_FILE_NOT_FOUND));
 }
@@ -399,12 +1087,9 @@ u64 FilePanel::mft_find_path(const UnicodeString& path) {
   ObjectArray<UnicodeString> path_parts = split_str(remove_path_root(del_trailing_slash(path)), L'\\');
   u64 file_ref_num = root_dir_ref_num;
   for (unsigned i = 0; i < path_parts.size(); i++) {
-    FileRecord fr;
-    fr.parent_ref_num = file_ref_num;
-    fr.file_name = path_parts[i];
-    unsigned idx = mft_index.bsearch<FileRecordCompare>(fr);
+    unsigned idx = mft_index->find(file_ref_num, path_parts[i]);
     if (idx == -1) FAIL(SystemError(ERROR_FILE_NOT_FOUND));
-    file_ref_num = mft_index[idx].file_ref_num;
+    file_ref_num = mft_index->file_ref_num[idx];
   }
   return file_ref_num;
 }
@@ -422,7 +1107,7 @@ void FilePanel::open_volume(const UnicodeString& dir) {
       invalidate_mft_index();
     }
   }
-  if (mft_index.size() == 0)
+  if (mft_index->size() == 0)
     create_mft_index();
 }
 
@@ -441,10 +1126,17 @@ void FilePanel::toggle_mft_mode() {
       try {
         store_mft_index();
       }
-      catch (...) {
+      catch (Break&) {
+      }
+      catch (Error& e) {
+        error_dlg(e);
+      }
+      catch (std::exception& e) {
+        error_dlg(e);
       }
     }
-    mft_index.clear().compact();
+    stop_usn_watcher();
+    mft_index.reset(new MftIndex());
     volume.open(extract_path_root(get_real_path(current_dir)));
   }
 }
@@ -457,216 +1149,455 @@ void FilePanel::reload_mft_all() {
   for (unsigned i = 0; i < g_file_panels.size(); i++) g_file_panels[i]->reload_mft();
 }
 
-const u8 c_cache_version = 0;
+// version 0: records serialized one by one and compressed as a whole (read only)
+// version 2: index columns stored as is at 8-byte aligned offsets, uncompressed columns are used directly from mapped file,
+// compressed columns are split into independently compressed blocks
+const u8 c_legacy_cache_version = 0;
+const u8 c_cache_version = 2;
+const unsigned c_cache_column_cnt = 17;
+const unsigned c_cache_block_size = 1024 * 1024;
+
+struct MftCacheColumn {
+  u64 offset; // from start of file
+  u64 size; // stored size
+  u64 data_size; // uncompressed size
+  u32 first_block; // index in block table
+  u32 compressed;
+};
 
-void FilePanel::store_mft_index() {
-  if (mft_index.size() == 0) return;
+// block is stored uncompressed if its size equals uncompressed size
+struct MftCacheBlock {
+  u32 size;
+  u32 checksum; // of stored data
+};
 
-  class Progress: public ProgressMonitor {
-  protected:
-    virtual void do_update_ui() {
-      const unsigned c_client_xs = 60;
-      ObjectArray<UnicodeString> lines;
-      unsigned len1 = static_cast<unsigned>(percent * c_client_xs / 100);
-      if (len1 > c_client_xs) len1 = c_client_xs;
-      unsigned len2 = c_client_xs - len1;
-      lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
-      draw_text_box(far_get_msg(MSG_FILE_PANEL_WRITE_CACHE_PROGRESS_TITLE), lines, c_client_xs);
-      SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_FILE_PANEL_WRITE_CACHE_PROGRESS_CONSOLE_TITLE).data(), percent).data());
-      far_set_progress_state(TBPF_NORMAL);
-      far_set_progress_value(percent, 100);
+// header is followed by block table
+struct MftCacheHeader {
+  u32 header_checksum; // of header and block table
+  u8 version; // same position as in version 0
+  u8 reserved[3];
+  u32 rec_cnt;
+  u32 column_cnt;
+  DWORDLONG usn_journal_id;
+  USN next_usn;
+  u32 block_size;
+  u32 block_cnt;
+  MftCacheColumn columns[c_cache_column_cnt];
+};
+
+lzo_uint32 get_header_checksum(const MftCacheHeader& header, const MftCacheBlock* blocks) {
+  const size_t c_offset = offsetof(MftCacheHeader, version);
+  lzo_uint32 checksum = lzo_crc32(0, reinterpret_cast<const lzo_bytep>(&header) + c_offset, sizeof(header) - c_offset);
+  if (header.block_cnt) checksum = lzo_crc32(checksum, reinterpret_cast<const lzo_bytep>(blocks), header.block_cnt * sizeof(MftCacheBlock));
+  return checksum;
+}
+
+unsigned get_block_cnt(u64 data_size) {
+  return static_cast<unsigned>((data_size + c_cache_block_size - 1) / c_cache_block_size);
+}
+
+#ifdef _M_X64
+#  define decompress lzo1x_decompress
+#else
+#  define decompress lzo1x_decompress_asm_fast
+#endif
+// decompressor may write up to 3 bytes past the end of output
+const unsigned c_decompress_slack = 3;
+
+// serialized size of record fields except file name (version 0)
+#define FILE_RECORD_SIZE(rec) (sizeof(rec.file_ref_num) + sizeof(rec.parent_ref_num) + sizeof(rec.file_attr) + sizeof(rec.creation_time) + sizeof(rec.last_access_time) + sizeof(rec.last_write_time) + sizeof(rec.data_size) + sizeof(rec.disk_size) + sizeof(rec.valid_size) + sizeof(rec.fragment_cnt) + sizeof(rec.mft_rec_cnt) + sizeof(rec.stream_cnt) + sizeof(rec.hard_link_cnt) + sizeof(rec.flags))
+
+// raw data of index columns
+struct MftColumnData {
+  std::vector<const unsigned char*> data;
+  std::vector<u64> size;
+  template<class C> void operator()(const C& column) {
+    data.push_back(reinterpret_cast<const unsigned char*>(column.data()));
+    size.push_back(column.size() * sizeof(typename C::value_type));
+  }
+};
+
+// compress and checksum blocks first_block .. first_block + task_cnt - 1 of column
+struct CompressBlocksTask: public ParallelTask {
+  const unsigned char* data;
+  u64 data_size;
+  unsigned first_block;
+  MftCacheBlock* blocks;
+  std::vector<std::vector<unsigned char> > comp_data;
+  virtual void run(unsigned idx) {
+    unsigned block_idx = first_block + idx;
+    const unsigned char* block_data = data + static_cast<u64>(block_idx) * c_cache_block_size;
+    unsigned block_size = static_cast<unsigned>(min(data_size - static_cast<u64>(block_idx) * c_cache_block_size, static_cast<u64>(c_cache_block_size)));
+    std::vector<unsigned char> work_buffer(LZO1X_1_MEM_COMPRESS);
+    std::vector<unsigned char>& comp_buffer = comp_data[idx];
+    comp_buffer.resize(block_size + block_size / 16 + 64 + 3);
+    lzo_uint comp_size = comp_buffer.size();
+    if (lzo1x_1_compress(block_data, block_size, comp_buffer.data(), &comp_size, work_buffer.data()) != LZO_E_OK) FAIL(MsgError(L"Compressor failure"));
+    // incompressible block is stored as is
+    if (comp_size < block_size) comp_buffer.resize(comp_size);
+    else comp_buffer.assign(block_data, block_data + block_size);
+    blocks[block_idx].size = static_cast<u32>(comp_buffer.size());
+    blocks[block_idx].checksum = lzo_crc32(0, comp_buffer.data(), comp_buffer.size());
+  }
+};
+
+// verify and decompress blocks of all compressed columns
+struct DecompressBlocksTask: public ParallelTask {
+  struct Block {
+    const unsigned char* src;
+    unsigned char* dst;
+    unsigned dst_size;
+    MftCacheBlock info;
+  };
+  std::vector<Block> blocks;
+  virtual void run(unsigned idx) {
+    const Block& block = blocks[idx];
+    UnicodeString corrupted_msg = UnicodeString::format(L"Corrupted cache file (block %u)", idx);
+    if (lzo_crc32(0, block.src, block.info.size) != block.info.checksum) FAIL(MsgError(corrupted_msg));
+    if (block.info.size == block.dst_size) {
+      memcpy(block.dst, block.src, block.dst_size);
     }
-  public:
-    unsigned percent;
-    Progress(): ProgressMonitor(true), percent(0) {
+    else {
+      lzo_uint sz = block.dst_size;
+      if (lzo1x_decompress_safe(block.src, block.info.size, block.dst, &sz, NULL) != LZO_E_OK || sz != block.dst_size) FAIL(MsgError(corrupted_msg));
     }
-  };
-  Progress progress;
+  }
+};
 
-  u32 buffer_size = sizeof(usn_journal_id) + sizeof(next_usn) + sizeof(unsigned);
-  unsigned file_record_size = sizeof(mft_index[0].file_ref_num) + sizeof(mft_index[0].parent_ref_num) + sizeof(mft_index[0].file_attr) + sizeof(mft_index[0].creation_time) + sizeof(mft_index[0].last_access_time) + sizeof(mft_index[0].last_write_time) + sizeof(mft_index[0].data_size) + sizeof(mft_index[0].disk_size) + sizeof(mft_index[0].valid_size) + sizeof(mft_index[0].fragment_cnt) + sizeof(mft_index[0].mft_rec_cnt) + sizeof(mft_index[0].stream_cnt) + sizeof(mft_index[0].hard_link_cnt) + sizeof(mft_index[0].flags);
-  buffer_size += file_record_size * mft_index.size();
-  for (unsigned i = 0; i < mft_index.size(); i++) {
-    buffer_size += sizeof(unsigned) + mft_index[i].file_name.size() * sizeof(mft_index[i].file_name[0]);
+// attach uncompressed index columns to mapped cache file, queue blocks of compressed columns for decompression
+struct MftColumnLoader {
+  const FileMapping& cache;
+  const MftCacheHeader& header;
+  const MftCacheBlock* blocks;
+  DecompressBlocksTask& decompress_task;
+  unsigned column_idx;
+  MftColumnLoader(const FileMapping& cache, const MftCacheHeader& header, const MftCacheBlock* blocks, DecompressBlocksTask& decompress_task): cache(cache), header(header), blocks(blocks), decompress_task(decompress_task), column_idx(0) {
   }
-  Array<unsigned char> buffer;
-  buffer.extend(buffer_size);
-  #define ENCODE(var) buffer.add(reinterpret_cast<const unsigned char*>(&var), sizeof(var));
-  ENCODE(usn_journal_id);
-  ENCODE(next_usn);
-  unsigned count = mft_index.size();
-  ENCODE(count);
-  for (unsigned i = 0; i < mft_index.size(); i++) {
-    progress.percent = i * 30 / count;
-    progress.update_ui();
+  template<class C> void operator()(C& column) {
+    typedef typename C::value_type T;
+    const wchar_t* c_corrupted_msg = L"Corrupted cache file";
+    const MftCacheColumn& desc = header.columns[column_idx++];
+    CHECK_MSG(desc.offset % 8 == 0 && desc.offset <= cache.size() && desc.size <= cache.size() - desc.offset && desc.data_size % sizeof(T) == 0, c_corrupted_msg);
+    const unsigned char* data = cache.data() + desc.offset;
+    size_t cnt = static_cast<size_t>(desc.data_size / sizeof(T));
+    if (desc.compressed) {
+      unsigned block_cnt = get_block_cnt(desc.data_size);
+      CHECK_MSG(desc.first_block <= header.block_cnt && block_cnt <= header.block_cnt - desc.first_block, c_corrupted_msg);
+      std::vector<T> values(cnt);
+      // column takes over vector buffer, so block pointers stay valid
+      unsigned char* dst = reinterpret_cast<unsigned char*>(values.data());
+      u64 pos = 0;
+      for (unsigned i = 0; i < block_cnt; i++) {
+        DecompressBlocksTask::Block block;
+        block.info = blocks[desc.first_block + i];
+        block.src = data + pos;
+        block.dst = dst + static_cast<u64>(i) * c_cache_block_size;
+        block.dst_size = static_cast<unsigned>(min(desc.data_size - static_cast<u64>(i) * c_cache_block_size, static_cast<u64>(c_cache_block_size)));
+        CHECK_MSG(block.info.size <= block.dst_size && block.info.size <= desc.size - pos, c_corrupted_msg);
+        decompress_task.blocks.push_back(block);
+        pos += block.info.size;
+      }
+      CHECK_MSG(pos == desc.size, c_corrupted_msg);
+      column.swap(values);
+    }
+    else {
+      CHECK_MSG(desc.size == desc.data_size, c_corrupted_msg);
+      column.attach(reinterpret_cast<const T*>(data), cnt);
+    }
+  }
+};
 
-    ENCODE(mft_index[i].file_ref_num);
-    ENCODE(mft_index[i].parent_ref_num);
-    unsigned file_name_size = mft_index[i].file_name.size();
-    ENCODE(file_name_size);
-    buffer.add(reinterpret_cast<const unsigned char*>(mft_index[i].file_name.data()), mft_index[i].file_name.size() * sizeof(mft_index[i].file_name[0]));
-    ENCODE(mft_index[i].file_attr);
-    ENCODE(mft_index[i].creation_time);
-    ENCODE(mft_index[i].last_access_time);
-    ENCODE(mft_index[i].last_write_time);
-    ENCODE(mft_index[i].data_size);
-    ENCODE(mft_index[i].disk_size);
-    ENCODE(mft_index[i].valid_size);
-    ENCODE(mft_index[i].fragment_cnt);
-    ENCODE(mft_index[i].mft_rec_cnt);
-    ENCODE(mft_index[i].stream_cnt);
-    ENCODE(mft_index[i].hard_link_cnt);
-    ENCODE(mft_index[i].flags);
-  }
-  assert(buffer.size() == buffer_size);
-
-  Array<unsigned char> comp_buffer;
-  u32 comp_buffer_size = buffer.size() + buffer.size() / 16 + 64 + 3;
-  comp_buffer.extend(comp_buffer_size);
-  Array<unsigned char> comp_work_buffer;
-  comp_work_buffer.extend(LZO1X_1_MEM_COMPRESS);
-  lzo_uint sz = comp_buffer_size;
-  if (lzo1x_1_compress(buffer.buf(), buffer.size(), comp_buffer.buf(), &sz, comp_work_buffer.buf()) != LZO_E_OK) FAIL(MsgError(L"Compressor failure"));
-  comp_buffer_size = static_cast<unsigned>(sz);
-  comp_buffer.set_size(comp_buffer_size);
+void write_file(HANDLE h_file, const unsigned char* data, u64 size) {
+  const unsigned c_chunk_size = 16 * 1024 * 1024;
+  while (size) {
+    DWORD chunk_size = static_cast<DWORD>(min(size, static_cast<u64>(c_chunk_size)));
+    DWORD bw;
+    CHECK_SYS(WriteFile(h_file, data, chunk_size, &bw, NULL));
+    CHECK(bw == chunk_size);
+    data += chunk_size;
+    size -= chunk_size;
+  }
+}
 
-  progress.percent = 70;
-  progress.update_ui();
+class FilePanel::CacheProgress: public ProgressMonitor {
+protected:
+  virtual void do_update_ui() {
+    const unsigned c_client_xs = 60;
+    ObjectArray<UnicodeString> lines;
+    unsigned len1 = static_cast<unsigned>(percent * c_client_xs / 100);
+    if (len1 > c_client_xs) len1 = c_client_xs;
+    unsigned len2 = c_client_xs - len1;
+    lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
+    draw_text_box(far_get_msg(write ? MSG_FILE_PANEL_WRITE_CACHE_PROGRESS_TITLE : MSG_FILE_PANEL_READ_CACHE_PROGRESS_TITLE), lines, c_client_xs);
+    SetConsoleTitleW(UnicodeString::format(far_get_msg(write ? MSG_FILE_PANEL_WRITE_CACHE_PROGRESS_CONSOLE_TITLE : MSG_FILE_PANEL_READ_CACHE_PROGRESS_CONSOLE_TITLE).data(), percent).data());
+    far_set_progress_state(TBPF_NORMAL);
+    far_set_progress_value(percent, 100);
+  }
+public:
+  bool write;
+  unsigned percent;
+  CacheProgress(bool write): ProgressMonitor(true), write(write), percent(0) {
+  }
+};
 
-  lzo_uint32 header_checksum = lzo_crc32(0, reinterpret_cast<const lzo_bytep>(&c_cache_version), sizeof(c_cache_version));
-  header_checksum = lzo_crc32(header_checksum, reinterpret_cast<const lzo_bytep>(&buffer_size), sizeof(buffer_size));
-  header_checksum = lzo_crc32(header_checksum, reinterpret_cast<const lzo_bytep>(&comp_buffer_size), sizeof(comp_buffer_size));
-  lzo_uint32 comp_buffer_checksum = lzo_crc32(0, comp_buffer.data(), comp_buffer.size());
+// panels on the same volume share cache file and it cannot be rewritten while another panel has it mapped:
+// complete new file waits under this name until install_new_cache_file() succeeds on next store or load
+UnicodeString get_new_cache_name(const UnicodeString& cache_name) {
+  return cache_name + L".new";
+}
 
-  HANDLE h_file = CreateFileW(get_mft_index_cache_name().data(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-  CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
-  CLEAN(HANDLE, h_file, CloseHandle(h_file));
-  CHECK_SYS(SetFilePointer(h_file, sizeof(header_checksum) + sizeof(buffer_size) + sizeof(comp_buffer_size) + sizeof(comp_buffer_checksum) + comp_buffer.size(), NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER);
-  CHECK_SYS(SetEndOfFile(h_file));
-  CHECK_SYS(SetFilePointer(h_file, 0, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER);
-  DWORD bw;
-  CHECK_SYS(WriteFile(h_file, &header_checksum, sizeof(header_checksum), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, &c_cache_version, sizeof(c_cache_version), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, &buffer_size, sizeof(buffer_size), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, &comp_buffer_size, sizeof(comp_buffer_size), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, &comp_buffer_checksum, sizeof(comp_buffer_checksum), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, comp_buffer.data(), comp_buffer.size(), &bw, NULL));
+// returns false if cache file is still mapped
+bool install_new_cache_file(const UnicodeString& cache_name) {
+  if (MoveFileExW(get_new_cache_name(cache_name).data(), cache_name.data(), MOVEFILE_REPLACE_EXISTING)) return true;
+  DWORD error = GetLastError();
+  if ((error == ERROR_FILE_NOT_FOUND) || (error == ERROR_PATH_NOT_FOUND)) return true;
+  CHECK_SYS((error == ERROR_ACCESS_DENIED) || (error == ERROR_SHARING_VIOLATION) || (error == ERROR_USER_MAPPED_FILE));
+  return false;
+}
 
-  progress.percent = 100;
-  progress.update_ui();
+bool is_same_file(HANDLE h_file1, HANDLE h_file2) {
+  BY_HANDLE_FILE_INFORMATION info1, info2;
+  CHECK_SYS(GetFileInformationByHandle(h_file1, &info1));
+  CHECK_SYS(GetFileInformationByHandle(h_file2, &info2));
+  return (info1.dwVolumeSerialNumber == info2.dwVolumeSerialNumber) && (info1.nFileIndexHigh == info2.nFileIndexHigh) && (info1.nFileIndexLow == info2.nFileIndexLow);
 }
 
-void FilePanel::load_mft_index() {
-  class Progress: public ProgressMonitor {
-  protected:
-    virtual void do_update_ui() {
-      const unsigned c_client_xs = 60;
-      ObjectArray<UnicodeString> lines;
-      unsigned len1 = static_cast<unsigned>(percent * c_client_xs / 100);
-      if (len1 > c_client_xs) len1 = c_client_xs;
-      unsigned len2 = c_client_xs - len1;
-      lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
-      draw_text_box(far_get_msg(MSG_FILE_PANEL_READ_CACHE_PROGRESS_TITLE), lines, c_client_xs);
-      SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_FILE_PANEL_READ_CACHE_PROGRESS_CONSOLE_TITLE).data(), percent).data());
-      far_set_progress_state(TBPF_NORMAL);
-      far_set_progress_value(percent, 100);
+void FilePanel::store_mft_index() {
+  if (mft_index->size() == 0) return;
+
+  CacheProgress progress(true);
+
+  MftCacheHeader header;
+  memzero(header);
+  header.version = c_cache_version;
+  header.rec_cnt = mft_index->size();
+  header.column_cnt = c_cache_column_cnt;
+  header.usn_journal_id = usn_journal_id;
+  header.next_usn = next_usn;
+  header.block_size = c_cache_block_size;
+
+  UnicodeString cache_name = get_mft_index_cache_name();
+  install_new_cache_file(cache_name);
+  // index attached to cache file has not changed since it was loaded, only journal position is updated
+  // (unless file was replaced since then)
+  if (mft_index->mapping) {
+    HANDLE h_file = CreateFileW(cache_name.data(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
+    CLEAN(HANDLE, h_file, CloseHandle(h_file));
+    if (is_same_file(h_file, mft_index->mapping->handle())) {
+      const MftCacheHeader* cache_header = reinterpret_cast<const MftCacheHeader*>(mft_index->mapping->data());
+      header.block_cnt = cache_header->block_cnt;
+      memcpy(header.columns, cache_header->columns, sizeof(header.columns));
+      header.header_checksum = get_header_checksum(header, reinterpret_cast<const MftCacheBlock*>(cache_header + 1));
+      write_file(h_file, reinterpret_cast<const unsigned char*>(&header), sizeof(header));
+      return;
     }
-  public:
-    unsigned percent;
-    Progress(): ProgressMonitor(true), percent(0) {
+  }
+
+  MftColumnData columns;
+  MftIndex::for_each_column(*mft_index, columns);
+  assert(columns.data.size() == c_cache_column_cnt);
+  u64 total_size = 0;
+  for (unsigned i = 0; i < c_cache_column_cnt; i++) {
+    total_size += columns.size[i];
+    if (g_mft_cache_compression) {
+      header.columns[i].compressed = 1;
+      header.columns[i].first_block = header.block_cnt;
+      header.block_cnt += get_block_cnt(columns.size[i]);
     }
-  };
-  Progress progress;
+  }
+  std::vector<MftCacheBlock> blocks(header.block_cnt);
 
-  const wchar_t* c_corrupted_msg = L"Corrupted cache file";
-  const wchar_t* c_wrong_version_msg = L"Wrong cache file version";
-  HANDLE h_file = CreateFileW(get_mft_index_cache_name().data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  // file is written under temporary name, so that incomplete file is never installed
+  UnicodeString tmp_cache_name = cache_name + L".tmp";
+  HANDLE h_file = CreateFileW(tmp_cache_name.data(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
   CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
-  CLEAN(HANDLE, h_file, CloseHandle(h_file));
+  CLEAN(HANDLE, h_file, if (h_file != INVALID_HANDLE_VALUE) CloseHandle(h_file));
+  // header and block table are written last
+  write_file(h_file, reinterpret_cast<const unsigned char*>(&header), sizeof(header));
+  write_file(h_file, reinterpret_cast<const unsigned char*>(blocks.data()), blocks.size() * sizeof(MftCacheBlock));
+
+  // compressed blocks are kept in memory only for one batch
+  const unsigned batch_size = get_cpu_count() * 4;
+  CompressBlocksTask compress_task;
+  const unsigned char c_padding[8] = {};
+  u64 pos = sizeof(header) + blocks.size() * sizeof(MftCacheBlock);
+  u64 done_size = 0;
+  for (unsigned i = 0; i < c_cache_column_cnt; i++) {
+    MftCacheColumn& column = header.columns[i];
+    column.offset = pos;
+    column.data_size = columns.size[i];
+    if (column.compressed) {
+      unsigned block_cnt = get_block_cnt(column.data_size);
+      compress_task.data = columns.data[i];
+      compress_task.data_size = column.data_size;
+      compress_task.blocks = blocks.data() + column.first_block;
+      for (unsigned first_block = 0; first_block < block_cnt; first_block += batch_size) {
+        progress.percent = static_cast<unsigned>(done_size * 100 / total_size);
+        progress.update_ui();
+
+        unsigned cnt = min(batch_size, block_cnt - first_block);
+        compress_task.first_block = first_block;
+        compress_task.comp_data.resize(cnt);
+        run_parallel(compress_task, cnt);
+        for (unsigned j = 0; j < cnt; j++) {
+          write_file(h_file, compress_task.comp_data[j].data(), compress_task.comp_data[j].size());
+          column.size += compress_task.comp_data[j].size();
+        }
+        done_size += min(static_cast<u64>(cnt) * c_cache_block_size, column.data_size - static_cast<u64>(first_block) * c_cache_block_size);
+      }
+    }
+    else {
+      progress.percent = static_cast<unsigned>(done_size * 100 / total_size);
+      progress.update_ui();
 
+      column.size = column.data_size;
+      write_file(h_file, columns.data[i], column.size);
+      done_size += column.data_size;
+    }
+    pos += column.size;
+    unsigned padding_size = static_cast<unsigned>((8 - pos % 8) % 8);
+    write_file(h_file, c_padding, padding_size);
+    pos += padding_size;
+  }
+
+  header.header_checksum = get_header_checksum(header, blocks.data());
+  CHECK_SYS(SetFilePointer(h_file, 0, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER);
+  write_file(h_file, reinterpret_cast<const unsigned char*>(&header), sizeof(header));
+  write_file(h_file, reinterpret_cast<const unsigned char*>(blocks.data()), blocks.size() * sizeof(MftCacheBlock));
+  CHECK_SYS(CloseHandle(h_file));
+  h_file = INVALID_HANDLE_VALUE;
+
+  CHECK_SYS(MoveFileExW(tmp_cache_name.data(), get_new_cache_name(cache_name).data(), MOVEFILE_REPLACE_EXISTING));
+  if (!install_new_cache_file(cache_name)) DBG_LOG(UnicodeString(L"MFT cache file is mapped by another panel, update is deferred"));
+
+  progress.percent = 100;
+  progress.update_ui();
+}
+
+void FilePanel::load_mft_index_v0(const FileMapping& cache, MftIndex& index, CacheProgress& progress) {
+  const wchar_t* c_corrupted_msg = L"Corrupted cache file";
   u8 cache_version;
   u32 buffer_size;
   u32 comp_buffer_size;
   lzo_uint32 saved_header_checksum, saved_comp_buffer_checksum;
-  DWORD br;
-  CHECK_SYS(ReadFile(h_file, &saved_header_checksum, sizeof(saved_header_checksum), &br, NULL));
-  if (br != sizeof(saved_header_checksum)) FAIL(MsgError(c_corrupted_msg));
-  CHECK_SYS(ReadFile(h_file, &cache_version, sizeof(cache_version), &br, NULL));
-  if (br != sizeof(cache_version)) FAIL(MsgError(c_corrupted_msg));
-  CHECK_SYS(ReadFile(h_file, &buffer_size, sizeof(buffer_size), &br, NULL));
-  if (br != sizeof(buffer_size)) FAIL(MsgError(c_corrupted_msg));
-  CHECK_SYS(ReadFile(h_file, &comp_buffer_size, sizeof(comp_buffer_size), &br, NULL));
-  if (br != sizeof(comp_buffer_size)) FAIL(MsgError(c_corrupted_msg));
+  size_t cache_pos = 0;
+  #define READ(var) memcpy(&var, cache.data() + cache_pos, sizeof(var)); cache_pos += sizeof(var);
+  CHECK_MSG(cache.size() >= sizeof(saved_header_checksum) + sizeof(cache_version) + sizeof(buffer_size) + sizeof(comp_buffer_size) + sizeof(saved_comp_buffer_checksum), c_corrupted_msg);
+  READ(saved_header_checksum);
+  READ(cache_version);
+  READ(buffer_size);
+  READ(comp_buffer_size);
 
   lzo_uint32 header_checksum = lzo_crc32(0, reinterpret_cast<const lzo_bytep>(&cache_version), sizeof(cache_version));
   header_checksum = lzo_crc32(header_checksum, reinterpret_cast<const lzo_bytep>(&buffer_size), sizeof(buffer_size));
   header_checksum = lzo_crc32(header_checksum, reinterpret_cast<const lzo_bytep>(&comp_buffer_size), sizeof(comp_buffer_size));
   if (header_checksum != saved_header_checksum) FAIL(MsgError(c_corrupted_msg));
-  if (cache_version != c_cache_version) FAIL(MsgError(c_wrong_version_msg));
 
-  CHECK_SYS(ReadFile(h_file, &saved_comp_buffer_checksum, sizeof(saved_comp_buffer_checksum), &br, NULL));
-  if (br != sizeof(saved_comp_buffer_checksum)) FAIL(MsgError(c_corrupted_msg));
-  Array<unsigned char> comp_buffer;
-  comp_buffer.extend(comp_buffer_size);
-  CHECK_SYS(ReadFile(h_file, comp_buffer.buf(), comp_buffer_size, &br, NULL));
-  if (br != comp_buffer_size) FAIL(MsgError(c_corrupted_msg));
-  comp_buffer.set_size(comp_buffer_size);
+  READ(saved_comp_buffer_checksum);
+  if (comp_buffer_size > cache.size() - cache_pos) FAIL(MsgError(c_corrupted_msg));
+  const unsigned char* comp_buffer = cache.data() + cache_pos;
 
-  lzo_uint32 comp_buffer_checksum = lzo_crc32(0, comp_buffer.data(), comp_buffer.size());
+  lzo_uint32 comp_buffer_checksum = lzo_crc32(0, comp_buffer, comp_buffer_size);
   if (comp_buffer_checksum != saved_comp_buffer_checksum) FAIL(MsgError(c_corrupted_msg));
 
   progress.percent = 30;
   progress.update_ui();
 
   Array<unsigned char> buffer;
-  buffer.extend(buffer_size + 3);
-#ifdef _M_X64
-#  define decompress lzo1x_decompress
-#else
-#  define decompress lzo1x_decompress_asm_fast
-#endif
+  buffer.extend(buffer_size + c_decompress_slack);
   lzo_uint sz = buffer_size;
-  if (decompress(comp_buffer.data(), comp_buffer_size, buffer.buf(), &sz, NULL) != LZO_E_OK) FAIL(MsgError(c_corrupted_msg));
+  if (decompress(comp_buffer, comp_buffer_size, buffer.buf(), &sz, NULL) != LZO_E_OK) FAIL(MsgError(c_corrupted_msg));
   assert(sz == buffer_size);
   buffer.set_size(buffer_size);
 
   progress.percent = 70;
   progress.update_ui();
 
-  try {
-    #define DECODE(var) memcpy(&var, buffer.data() + pos, sizeof(var)); pos += sizeof(var);
-    unsigned pos = 0;
-    DECODE(usn_journal_id);
-    DECODE(next_usn);
-    unsigned count;
-    DECODE(count);
-    mft_index.extend(count);
-    FileRecord rec;
-    unsigned file_name_size;
-    for (unsigned i = 0; i < count; i++) {
-      progress.percent = 70 + i * 30 / count;
-      progress.update_ui();
+  #define DECODE(var) memcpy(&var, buffer.data() + pos, sizeof(var)); pos += sizeof(var);
+  unsigned pos = 0;
+  DECODE(usn_journal_id);
+  DECODE(next_usn);
+  unsigned count;
+  DECODE(count);
+  FileRecord rec;
+  CHECK_MSG(static_cast<u64>(FILE_RECORD_SIZE(rec) + sizeof(unsigned)) * count <= buffer_size - pos, c_corrupted_msg);
+  index.reserve(count, (buffer_size - pos - (FILE_RECORD_SIZE(rec) + sizeof(unsigned)) * count) / sizeof(wchar_t));
+  unsigned file_name_size;
+  for (unsigned i = 0; i < count; i++) {
+    progress.percent = 70 + i * 30 / count;
+    progress.update_ui();
+
+    DECODE(rec.file_ref_num);
+    DECODE(rec.parent_ref_num);
+    DECODE(file_name_size);
+    const wchar_t* file_name = reinterpret_cast<const wchar_t*>(buffer.data() + pos);
+    pos += file_name_size * sizeof(wchar_t);
+    DECODE(rec.file_attr);
+    DECODE(rec.creation_time);
+    DECODE(rec.last_access_time);
+    DECODE(rec.last_write_time);
+    DECODE(rec.data_size);
+    DECODE(rec.disk_size);
+    DECODE(rec.valid_size);
+    DECODE(rec.fragment_cnt);
+    DECODE(rec.mft_rec_cnt);
+    DECODE(rec.stream_cnt);
+    DECODE(rec.hard_link_cnt);
+    DECODE(rec.flags);
+    index.add(rec, file_name, file_name_size);
+  }
+  assert(pos == buffer_size);
+  index.build_child_index();
+}
 
-      DECODE(rec.file_ref_num);
-      DECODE(rec.parent_ref_num);
-      DECODE(file_name_size);
-      rec.file_name = UnicodeString(reinterpret_cast<const wchar_t*>(buffer.data() + pos), file_name_size);
-      pos += file_name_size * sizeof(wchar_t);
-      DECODE(rec.file_attr);
-      DECODE(rec.creation_time);
-      DECODE(rec.last_access_time);
-      DECODE(rec.last_write_time);
-      DECODE(rec.data_size);
-      DECODE(rec.disk_size);
-      DECODE(rec.valid_size);
-      DECODE(rec.fragment_cnt);
-      DECODE(rec.mft_rec_cnt);
-      DECODE(rec.stream_cnt);
-      DECODE(rec.hard_link_cnt);
-      DECODE(rec.flags);
-      mft_index += rec;
-    }
-    assert(pos == buffer_size);
+void FilePanel::load_mft_index_v2(const std::shared_ptr<FileMapping>& cache, MftIndex& index, CacheProgress& progress) {
+  const wchar_t* c_corrupted_msg = L"Corrupted cache file";
+  CHECK_MSG(cache->size() >= sizeof(MftCacheHeader), c_corrupted_msg);
+  MftCacheHeader header;
+  memcpy(&header, cache->data(), sizeof(header));
+  CHECK_MSG(header.block_cnt <= (cache->size() - sizeof(header)) / sizeof(MftCacheBlock), c_corrupted_msg);
+  const MftCacheBlock* blocks = reinterpret_cast<const MftCacheBlock*>(cache->data() + sizeof(header));
+  CHECK_MSG(header.header_checksum == get_header_checksum(header, blocks), c_corrupted_msg);
+  CHECK_MSG(header.column_cnt == c_cache_column_cnt && header.block_size == c_cache_block_size, c_corrupted_msg);
+  usn_journal_id = header.usn_journal_id;
+  next_usn = header.next_usn;
+
+  DecompressBlocksTask decompress_task;
+  MftColumnLoader loader(*cache, header, blocks, decompress_task);
+  MftIndex::for_each_column(index, loader);
+  CHECK_MSG(decompress_task.blocks.size() == header.block_cnt, c_corrupted_msg);
+  index.mapping = cache;
+
+  progress.percent = 10;
+  progress.update_ui();
+
+  // blocks are taken in file order, so later blocks are paged in while earlier ones are decompressed
+  run_parallel(decompress_task, static_cast<unsigned>(decompress_task.blocks.size()));
+
+  progress.percent = 90;
+  progress.update_ui();
+
+  CHECK_MSG(index.size() == header.rec_cnt, c_corrupted_msg);
+  index.validate();
+}
+
+void FilePanel::load_mft_index() {
+  CacheProgress progress(false);
+  unsigned start_time = GetTickCount();
+  UnicodeString cache_name = get_mft_index_cache_name();
+  // otherwise older file is loaded and journal is replayed from its position
+  install_new_cache_file(cache_name);
+  std::shared_ptr<FileMapping> cache(new FileMapping(cache_name));
+  try {
+    CHECK_MSG(cache->size() > sizeof(u32), L"Corrupted cache file");
+    u8 cache_version = cache->data()[sizeof(u32)];
+    std::shared_ptr<MftIndex> index(new MftIndex());
+    if (cache_version == c_cache_version) load_mft_index_v2(cache, *index, progress);
+    else if (cache_version == c_legacy_cache_version) load_mft_index_v0(*cache, *index, progress);
+    else FAIL(MsgError(L"Wrong cache file version"));
+    DBG_LOG(UnicodeString::format(L"MFT cache v%u: %u records, %u ms", cache_version, index->size(), GetTickCount() - start_time));
+    mft_index = index;
     root_dir_ref_num = mft_find_root();
   }
   catch (...) {
@@ -693,51 +1624,48 @@ FilePanel::Totals FilePanel::mft_get_totals(const ObjectArray<UnicodeString>& fi
     file_set.insert(mft_find_path(file_list[i]));
   }
 
-  std::map<u64, unsigned> file_ptrs;
-  Array<bool> tmp_array;
-  bool* untested = tmp_array.buf(mft_index.size());
-
   // find $BadClus
-  FileRecord fr;
-  fr.parent_ref_num = root_dir_ref_num;
-  fr.file_name = L"$BadClus";
-  unsigned bad_clus_ref_num = mft_index.bsearch<FileRecordCompare>(fr);
-
-  for (unsigned i = 0; i < mft_index.size(); i++) {
-    if (mft_index[i].ntfs_attr()) untested[i] = false; // do not count streams
-    else if (i == bad_clus_ref_num) untested[i] = false; // do not count $BadClus
-    else if (file_set.count(mft_index[i].file_ref_num)) {
-      file_ptrs.insert(std::pair<u64, unsigned>(mft_index[i].file_ref_num, i));
-      untested[i] = false;
+  unsigned bad_clus_ref_num = mft_index->find(root_dir_ref_num, L"$BadClus");
+
+  // each file is counted once (hard links), streams and $BadClus are not counted
+  std::vector<bool> counted(static_cast<size_t>(mft_index->ref_cnt()));
+  std::vector<unsigned> stack;
+  for (unsigned i = 0; i < mft_index->size(); i++) {
+    if (mft_index->ntfs_attr(i) || (i == bad_clus_ref_num)) continue;
+    u64 file_ref_num = mft_index->file_ref_num[i];
+    if (!counted[static_cast<size_t>(file_ref_num)] && file_set.count(file_ref_num)) {
+      counted[static_cast<size_t>(file_ref_num)] = true;
+      stack.push_back(i);
     }
-    else untested[i] = true;
-  }
-
-  while (true) {
-    size_t size = file_ptrs.size();
-    for (unsigned i = 0; i < mft_index.size(); i++) {
-      if (untested[i] && file_ptrs.count(mft_index[i].parent_ref_num)) {
-        untested[i] = false;
-        file_ptrs.insert(std::pair<u64, unsigned>(mft_index[i].file_ref_num, i));
-      }
-    }
-    if (size == file_ptrs.size()) break; // no change in size -> all files are found
   }
 
   Totals totals;
-  for (std::map<u64, unsigned>::const_iterator i = file_ptrs.begin(); i != file_ptrs.end(); i++) {
-    totals.data_size += mft_index[i->second].data_size;
-    totals.disk_size += mft_index[i->second].disk_size;
-    totals.fragment_cnt += mft_index[i->second].fragment_cnt;
-    if (mft_index[i->second].file_attr & FILE_ATTRIBUTE_DIRECTORY) {
+  while (!stack.empty()) {
+    unsigned idx = stack.back();
+    stack.pop_back();
+    totals.data_size += mft_index->data_size[idx];
+    totals.disk_size += mft_index->disk_size[idx];
+    totals.fragment_cnt += mft_index->fragment_cnt[idx];
+    if (mft_index->file_attr[idx] & FILE_ATTRIBUTE_DIRECTORY) {
       totals.dir_cnt++;
-      if (mft_index[i->second].file_attr & FILE_ATTRIBUTE_REPARSE_POINT) totals.dir_rp_cnt++;
+      if (mft_index->file_attr[idx] & FILE_ATTRIBUTE_REPARSE_POINT) totals.dir_rp_cnt++;
     }
     else {
       totals.file_cnt++;
-      if (mft_index[i->second].file_attr & FILE_ATTRIBUTE_REPARSE_POINT) totals.file_rp_cnt++;
+      if (mft_index->file_attr[idx] & FILE_ATTRIBUTE_REPARSE_POINT) totals.file_rp_cnt++;
+    }
+    if (mft_index->hard_link_cnt[idx] > 1) totals.hl_cnt++;
+
+    unsigned first, last;
+    mft_index->get_children(mft_index->file_ref_num[idx], first, last);
+    for (unsigned i = first; i < last; i++) {
+      if (mft_index->ntfs_attr(i) || (i == bad_clus_ref_num)) continue;
+      u64 file_ref_num = mft_index->file_ref_num[i];
+      if (!counted[static_cast<size_t>(file_ref_num)]) {
+        counted[static_cast<size_t>(file_ref_num)] = true;
+        stack.push_back(i);
+      }
     }
-    if (mft_index[i->second].hard_link_cnt > 1) totals.hl_cnt++;
   }
   return totals;
 }
@@ -0,0 +1,224 @@
+#include "crc.h"
+
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CRC_X86
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC_CLMUL_TARGET
+#else
+#include <cpuid.h>
+#define CRC_CLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#endif
+#endif
+
+namespace {
+
+uint64_t reflect(uint64_t value, unsigned bits) {
+  uint64_t result = 0;
+  for (unsigned i = 0; i < bits; i++) {
+    if (value & (static_cast<uint64_t>(1) << i)) result |= static_cast<uint64_t>(1) << (bits - 1 - i);
+  }
+  return result;
+}
+
+// x^n mod P, P includes x^32 term
+uint64_t xpow_mod(unsigned n, uint64_t poly) {
+  uint64_t rem = 1;
+  for (unsigned i = 0; i < n; i++) {
+    rem <<= 1;
+    if (rem & 0x100000000ULL) rem ^= poly;
+  }
+  return rem;
+}
+
+// x^64 div P (Barrett constant)
+uint64_t x64_div(uint64_t poly) {
+  uint64_t quot = 0;
+  uint64_t rem = 0;
+  for (int i = 64; i >= 0; i--) {
+    rem = (rem << 1) | (i == 64 ? 1 : 0);
+    if (rem & 0x100000000ULL) {
+      rem ^= poly;
+      quot |= static_cast<uint64_t>(1) << i;
+    }
+  }
+  return quot;
+}
+
+// folding constant: x^n mod P reflected into 33 bit operand of reflected CLMUL
+uint64_t fold_constant(unsigned n, uint64_t poly) {
+  return reflect(xpow_mod(n, poly), 32) << 1;
+}
+
+inline uint32_t load32(const uint8_t* data) {
+  // little endian targets only
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+#ifdef CRC_X86
+CrcKernel detect_kernel() {
+  int regs[4];
+#ifdef _MSC_VER
+  __cpuid(regs, 1);
+#else
+  unsigned a, b, c, d;
+  if (__get_cpuid(1, &a, &b, &c, &d) == 0) return ck_slice16;
+  regs[2] = static_cast<int>(c);
+#endif
+  const int c_pclmulqdq = 1 << 1;
+  const int c_sse41 = 1 << 19;
+  if ((regs[2] & c_pclmulqdq) && (regs[2] & c_sse41)) return ck_clmul;
+  return ck_slice16;
+}
+#else
+CrcKernel detect_kernel() {
+  return ck_slice16;
+}
+#endif
+
+const CrcKernel g_crc_kernel = detect_kernel();
+
+}
+
+CrcKernel crc_kernel() {
+  return g_crc_kernel;
+}
+
+bool crc_kernel_supported(CrcKernel kernel) {
+  return (kernel != ck_clmul) || (g_crc_kernel == ck_clmul);
+}
+
+CrcEngine::CrcEngine(uint32_t poly) {
+  uint32_t rpoly = static_cast<uint32_t>(reflect(poly, 32));
+  for (unsigned i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (unsigned j = 0; j < 8; j++) crc = (crc >> 1) ^ (crc & 1 ? rpoly : 0);
+    table[0][i] = crc;
+  }
+  for (unsigned i = 0; i < 256; i++) {
+    for (unsigned k = 1; k < 16; k++) table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+  }
+
+  uint64_t full_poly = 0x100000000ULL | poly;
+  k1k2[0] = fold_constant(4 * 128 + 32, full_poly);
+  k1k2[1] = fold_constant(4 * 128 - 32, full_poly);
+  k3k4[0] = fold_constant(128 + 32, full_poly);
+  k3k4[1] = fold_constant(128 - 32, full_poly);
+  k5 = fold_constant(64, full_poly);
+  poly_mu[0] = reflect(full_poly, 33);
+  poly_mu[1] = reflect(x64_div(full_poly), 33);
+}
+
+uint32_t CrcEngine::update_bytewise(uint32_t crc, const uint8_t* data, size_t size) const {
+  for (size_t i = 0; i < size; i++) crc = (crc >> 8) ^ table[0][(crc ^ data[i]) & 0xFF];
+  return crc;
+}
+
+uint32_t CrcEngine::update_slice16(uint32_t crc, const uint8_t* data, size_t size) const {
+  while (size >= 16) {
+    uint32_t a = load32(data) ^ crc;
+    uint32_t b = load32(data + 4);
+    uint32_t c = load32(data + 8);
+    uint32_t d = load32(data + 12);
+    crc = table[15][a & 0xFF] ^ table[14][(a >> 8) & 0xFF] ^ table[13][(a >> 16) & 0xFF] ^ table[12][a >> 24] ^
+      table[11][b & 0xFF] ^ table[10][(b >> 8) & 0xFF] ^ table[9][(b >> 16) & 0xFF] ^ table[8][b >> 24] ^
+      table[7][c & 0xFF] ^ table[6][(c >> 8) & 0xFF] ^ table[5][(c >> 16) & 0xFF] ^ table[4][c >> 24] ^
+      table[3][d & 0xFF] ^ table[2][(d >> 8) & 0xFF] ^ table[1][(d >> 16) & 0xFF] ^ table[0][d >> 24];
+    data += 16;
+    size -= 16;
+  }
+  return update_bytewise(crc, data, size);
+}
+
+#ifdef CRC_X86
+// Intel "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", reflected variant
+CRC_CLMUL_TARGET static uint32_t fold_clmul(uint32_t crc, const uint8_t* data, size_t size, const uint64_t* k1k2, const uint64_t* k3k4, uint64_t k5, const uint64_t* poly_mu) {
+  // size >= 64, multiple of 16
+  __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+  __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+  __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32));
+  __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+  __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(k1k2));
+  data += 64;
+  size -= 64;
+  // fold 4 x 128 bits in parallel
+  while (size >= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)));
+    data += 64;
+    size -= 64;
+  }
+  // fold into 128 bits
+  k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(k3k4));
+  __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+  while (size >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data))), x5);
+    data += 16;
+    size -= 16;
+  }
+  // 128 -> 64 bits
+  __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+  x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  k = _mm_set_epi64x(0, static_cast<long long>(k5));
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  // Barrett reduction to 32 bits
+  k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(poly_mu));
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+#endif
+
+uint32_t CrcEngine::update_clmul(uint32_t crc, const uint8_t* data, size_t size) const {
+#ifdef CRC_X86
+  if (size >= 64) {
+    size_t fold_size = size & ~static_cast<size_t>(15);
+    crc = fold_clmul(crc, data, fold_size, k1k2, k3k4, k5, poly_mu);
+    data += fold_size;
+    size -= fold_size;
+  }
+#endif
+  return update_slice16(crc, data, size);
+}
+
+uint32_t CrcEngine::update(uint32_t crc, const void* data, size_t size, CrcKernel kernel) const {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  if (kernel == ck_clmul) return update_clmul(crc, bytes, size);
+  else if (kernel == ck_slice16) return update_slice16(crc, bytes, size);
+  else return update_bytewise(crc, bytes, size);
+}
+
+const CrcEngine g_crc32_engine(0x04C11DB7);
+const CrcEngine g_crc16_engine(0x80050000);
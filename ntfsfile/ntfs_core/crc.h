@@ -0,0 +1,48 @@
+#pragma once
+
+// CRC-32 (zlib, same as lzo_crc32) and CRC-16 (ARC polynomial, same as CRC16::update)
+// both are reflected CRCs and share kernels: CRC-16 runs as 32 bit CRC with polynomial x^16 * P,
+// high 16 bits of register stay zero
+// kernel is chosen at startup: PCLMULQDQ folding if CPU has it, slicing-by-16 tables otherwise
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum CrcKernel {
+  ck_bytewise, // one table lookup per byte (reference)
+  ck_slice16, // 16 table lookups per 16 bytes
+  ck_clmul, // carry-less multiplication folding, needs PCLMULQDQ and SSE4.1
+};
+
+class CrcEngine {
+private:
+  uint32_t table[16][256];
+  // folding constants: x^n mod P (reflected, shifted left 1 bit)
+  uint64_t k1k2[2]; // fold 4 x 128 bits
+  uint64_t k3k4[2]; // fold 128 bits
+  uint64_t k5; // 64 -> 32 bits
+  uint64_t poly_mu[2]; // Barrett reduction
+  uint32_t update_bytewise(uint32_t crc, const uint8_t* data, size_t size) const;
+  uint32_t update_slice16(uint32_t crc, const uint8_t* data, size_t size) const;
+  uint32_t update_clmul(uint32_t crc, const uint8_t* data, size_t size) const;
+public:
+  // poly: normal representation of 32 bit polynomial without x^32 term
+  CrcEngine(uint32_t poly);
+  // crc: raw register value, no initial / final inversion
+  uint32_t update(uint32_t crc, const void* data, size_t size, CrcKernel kernel) const;
+};
+
+// fastest kernel supported by CPU
+CrcKernel crc_kernel();
+bool crc_kernel_supported(CrcKernel kernel);
+
+extern const CrcEngine g_crc32_engine;
+extern const CrcEngine g_crc16_engine;
+
+inline uint32_t crc32_update(uint32_t crc, const void* data, size_t size, CrcKernel kernel = crc_kernel()) {
+  return ~g_crc32_engine.update(~crc, data, size, kernel);
+}
+
+inline uint16_t crc16_update(uint16_t crc, const void* data, size_t size, CrcKernel kernel = crc_kernel()) {
+  return static_cast<uint16_t>(g_crc16_engine.update(crc, data, size, kernel));
+}
@@ -14,6 +14,39 @@ typedef enum {
   magic_empty = 0xffffffff,
 } NTFS_RECORD_TYPES;
 
+typedef struct {
+  u8 jump[3];
+  u64 oem_id;
+  u16 bytes_per_sector;
+  u8 sectors_per_cluster;
+  u16 reserved_sectors;
+  u8 fats;
+  u16 root_entries;
+  u16 sectors;
+  u8 media_type;
+  u16 sectors_per_fat;
+  u16 sectors_per_track;
+  u16 heads;
+  u32 hidden_sectors;
+  u32 large_sectors;
+  u8 physical_drive;
+  u8 current_head;
+  u8 extended_boot_signature;
+  u8 reserved2;
+  u64 number_of_sectors;
+  u64 mft_lcn;
+  u64 mftmirr_lcn;
+  s8 clusters_per_mft_record;
+  u8 reserved0[3];
+  s8 clusters_per_index_record;
+  u8 reserved1[3];
+  u64 volume_serial_number;
+  u32 checksum;
+} NTFS_BOOT_SECTOR;
+
+#define NTFS_OEM_ID 0x202020205346544eull // "NTFS    "
+#define NTFS_BLOCK_SIZE 512 // update sequence stride
+
 typedef enum {
   MFT_RECORD_IN_USE = 0x0001,
   MFT_RECORD_IS_DIRECTORY = 0x0002,
@@ -61,7 +94,7 @@ typedef enum {
   AT_END = 0xffffffff,
 } ATTR_TYPES;
 
-#define ATTR_TYPE_DEF(name) { AT_##name, L#name },
+#define ATTR_TYPE_DEF(name) { AT_##name, L"" #name },
 
 const struct {
   u32 type;
@@ -257,7 +290,7 @@ typedef struct _REPARSE_DATA_BUFFER {
       u16 SubstituteNameLength;
       u16 PrintNameOffset;
       u16 PrintNameLength;
-      WCHAR PathBuffer[1];
+      u16 PathBuffer[1];
     } MountPointReparseBuffer;
     struct {
       u16 SubstituteNameOffset;
@@ -265,7 +298,7 @@ typedef struct _REPARSE_DATA_BUFFER {
       u16 PrintNameOffset;
       u16 PrintNameLength;
       u32 flags;
-      WCHAR PathBuffer[1];
+      u16 PathBuffer[1];
     } SymbolicLinkReparseBuffer;
     struct {
       u8 DataBuffer[1];
@@ -273,6 +306,67 @@ typedef struct _REPARSE_DATA_BUFFER {
   };
 } REPARSE_DATA_BUFFER, *PREPARSE_DATA_BUFFER;
 
+typedef struct {
+  u32 entries_offset; // relative to this header
+  u32 index_length;
+  u32 allocated_size;
+  u8 flags;
+  u8 reserved[3];
+} INDEX_HEADER;
+
+typedef enum {
+  SMALL_INDEX = 0,
+  LARGE_INDEX = 1,
+} INDEX_HEADER_FLAGS;
+
+typedef struct {
+  u32 type;
+  u32 collation_rule;
+  u32 index_block_size;
+  s8 clusters_per_index_block;
+  u8 reserved[3];
+  INDEX_HEADER index;
+} INDEX_ROOT;
+
+typedef struct {
+  u32 magic;
+  u16 usa_ofs;
+  u16 usa_count;
+  u64 lsn;
+  u64 index_block_vcn;
+  INDEX_HEADER index;
+} INDEX_BLOCK;
+
+typedef enum {
+  INDEX_ENTRY_NODE = 1,
+  INDEX_ENTRY_END = 2,
+} INDEX_ENTRY_FLAGS;
+
+typedef struct {
+  u64 indexed_file;
+  u16 length;
+  u16 key_length;
+  u16 flags;
+  u16 reserved;
+} INDEX_ENTRY;
+
+// $UsnJrnl:$J record (same as USN_RECORD_V2)
+typedef struct {
+  u32 record_length;
+  u16 major_version;
+  u16 minor_version;
+  u64 file_reference_number;
+  u64 parent_file_reference_number;
+  s64 usn;
+  u64 time_stamp;
+  u32 reason;
+  u32 source_info;
+  u32 security_id;
+  u32 file_attributes;
+  u16 file_name_length;
+  u16 file_name_offset;
+} USN_RECORD_HEADER;
+
 #define FILE_REF(ref) ((ref) & 0x0000FFFFFFFFFFFFl)
 #define U64_TO_FILETIME(ft, dt) { (ft).dwLowDateTime = static_cast<DWORD>((dt) & 0xFFFFFFFF); (ft).dwHighDateTime = static_cast<DWORD>(((dt) >> 32) & 0xFFFFFFFF); }
 
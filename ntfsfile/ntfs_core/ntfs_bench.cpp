@@ -0,0 +1,827 @@
+// ntfs_core benchmark
+// ntfs_bench <image>: full MFT walk of raw NTFS image (dd copy of volume)
+// ntfs_bench -usn <count>: parse synthetic $UsnJrnl:$J buffer
+// ntfs_bench -runs <count>: decode random mapping pairs, results are verified against byte by byte decoder
+// ntfs_bench -records <count>: load records of synthetic in-memory volume one by one
+// ntfs_bench -attrlist <count>: load record whose non-resident attribute list has count runs, count device reads
+// ntfs_bench -mkimage <image> <count>: write synthetic volume with count MFT records
+// ntfs_bench -hardlinks <count>: count each of count files with 2-4 links once, hash table vs. sorted array
+// ntfs_bench -io <file>: read file in order with 1-8 MB blocks and 1-16 reads in flight, MB/s per setting
+// ntfs_bench -crc <MB>: CRC-32 / CRC-16 GB/s per kernel, results are verified against lzo_crc32 and CRC16::update algorithms
+// ntfs_bench -sha <MB>: SHA-1 / SHA-256 GB/s per kernel, results are verified against FIPS 180 test vectors
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "ntfs_core.h"
+#include "crc.h"
+#include "sha.h"
+#include "../crc16.cpp"
+
+#ifdef _MSC_VER
+#define fseeko _fseeki64
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+class ImageDevice: public BlockDevice {
+private:
+  FILE* file;
+public:
+  ImageDevice(const char* file_name) {
+    file = fopen(file_name, "rb");
+    if (file == NULL) throw std::runtime_error("Cannot open image file");
+  }
+  ~ImageDevice() {
+    fclose(file);
+  }
+  virtual void read(u64 pos, void* buf, unsigned size) {
+    if (fseeko(file, pos, SEEK_SET) != 0 || fread(buf, 1, size, file) != size) throw std::runtime_error("Unexpected end of volume data");
+  }
+};
+
+class MemoryDevice: public BlockDevice {
+public:
+  std::vector<u8> data;
+  virtual void read(u64 pos, void* buf, unsigned size) {
+    if (pos > data.size() || data.size() - pos < size) throw std::runtime_error("Unexpected end of volume data");
+    memcpy(buf, data.data() + pos, size);
+    read_cnt++;
+  }
+  unsigned read_cnt;
+  MemoryDevice(): read_cnt(0) {
+  }
+};
+
+struct IndexCounter: public IndexVisitor {
+  u64 entry_cnt;
+  IndexCounter(): entry_cnt(0) {
+  }
+  virtual void visit(const INDEX_ENTRY*) {
+    entry_cnt++;
+  }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void bench_image(const char* file_name) {
+  ImageDevice device(file_name);
+  NtfsGeometry geometry;
+  read_boot_sector(device, geometry);
+  printf("cluster size %u, file record size %u\n", geometry.cluster_size, geometry.file_rec_size);
+
+  const u16 c_i30_name[] = { '$', 'I', '3', '0' };
+  const unsigned c_chunk_size = 1024 * 1024;
+  Clock::time_point start = Clock::now();
+  MftReader mft_reader(device, geometry);
+  unsigned chunk_rec_cnt = c_chunk_size / geometry.file_rec_size;
+  std::vector<u8> chunk(chunk_rec_cnt * geometry.file_rec_size);
+  std::vector<DataRun> data_runs;
+  u64 base_rec_cnt = 0, name_cnt = 0, data_run_cnt = 0, error_cnt = 0;
+  IndexCounter index_counter;
+  for (u64 first_rec = 0; first_rec < mft_reader.record_count(); first_rec += chunk_rec_cnt) {
+    unsigned cnt = mft_reader.read_records(first_rec, chunk_rec_cnt, chunk.data());
+    for (unsigned i = 0; i < cnt; i++) {
+      const u8* rec = chunk.data() + i * geometry.file_rec_size;
+      const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(rec);
+      if ((mft_rec->magic != magic_FILE) || !(mft_rec->flags & MFT_RECORD_IN_USE) || (mft_rec->base_mft_record != 0)) continue;
+      base_rec_cnt++;
+      try {
+        for (unsigned attr_off = first_attribute(rec, geometry.file_rec_size); attr_off != -1; attr_off = next_attribute(rec, geometry.file_rec_size, attr_off)) {
+          const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(rec + attr_off);
+          if (attr_header->type == AT_FILE_NAME) name_cnt++;
+          if (attr_header->non_resident) {
+            decode_data_runs(rec, geometry.file_rec_size, attr_off, data_runs);
+            data_run_cnt += data_runs.size();
+          }
+        }
+        if (mft_rec->flags & MFT_RECORD_IS_DIRECTORY) walk_index(device, geometry, rec, geometry.file_rec_size, c_i30_name, 4, index_counter);
+      }
+      catch (const NtfsFormatError&) {
+        error_cnt++;
+      }
+    }
+  }
+  double time = elapsed(start);
+  printf("records %llu, base records %llu, names %llu, data runs %llu, index entries %llu, errors %llu\n",
+    static_cast<unsigned long long>(mft_reader.record_count()), static_cast<unsigned long long>(base_rec_cnt), static_cast<unsigned long long>(name_cnt),
+    static_cast<unsigned long long>(data_run_cnt), static_cast<unsigned long long>(index_counter.entry_cnt), static_cast<unsigned long long>(error_cnt));
+  printf("%.3f s, %.0f records/s\n", time, mft_reader.record_count() / time);
+}
+
+// journal of rec_cnt records touching 1/16 as many files, 1/8 of records are for sparse files
+void bench_usn(unsigned rec_cnt) {
+  const unsigned c_name_size = 24; // bytes
+  const unsigned c_rec_size = (sizeof(USN_RECORD_HEADER) + c_name_size + 7) / 8 * 8;
+  const u32 c_reasons[] = { 0x00000001, 0x00000002, 0x00000100, 0x00000200, 0x00001000, 0x00002000, 0x00008000, 0x80000000 };
+  std::vector<u8> buffer(static_cast<size_t>(rec_cnt) * c_rec_size);
+  unsigned file_cnt = rec_cnt / 16 + 1;
+  srand(1);
+  for (unsigned i = 0; i < rec_cnt; i++) {
+    USN_RECORD_HEADER* usn_rec = reinterpret_cast<USN_RECORD_HEADER*>(buffer.data() + static_cast<size_t>(i) * c_rec_size);
+    memset(usn_rec, 0, c_rec_size);
+    usn_rec->record_length = c_rec_size;
+    usn_rec->major_version = 2;
+    usn_rec->file_reference_number = (static_cast<u64>(i & 0xFFFF) << 48) | (rand() % file_cnt);
+    usn_rec->usn = static_cast<s64>(i) * c_rec_size;
+    usn_rec->reason = c_reasons[rand() % (sizeof(c_reasons) / sizeof(c_reasons[0]))];
+    usn_rec->file_attributes = rand() % 8 == 0 ? FILE_ATTR_SPARSE_FILE : 0;
+    usn_rec->file_name_length = c_name_size;
+    usn_rec->file_name_offset = sizeof(USN_RECORD_HEADER);
+  }
+
+  Clock::time_point start = Clock::now();
+  std::vector<u64> file_refs;
+  // journal is read in 4 MB pieces; close is ignored, data overwrite counts for sparse files only
+  const unsigned c_buffer_size = 0x400000 / c_rec_size * c_rec_size;
+  for (size_t pos = 0; pos < buffer.size(); pos += c_buffer_size) {
+    size_t size = buffer.size() - pos < c_buffer_size ? buffer.size() - pos : c_buffer_size;
+    parse_usn_records(buffer.data() + pos, static_cast<unsigned>(size), ~0x80000001u, 0x00000001, file_refs);
+  }
+  double parse_time = elapsed(start);
+  size_t match_cnt = file_refs.size();
+  std::sort(file_refs.begin(), file_refs.end());
+  file_refs.erase(std::unique(file_refs.begin(), file_refs.end()), file_refs.end());
+  double time = elapsed(start);
+  printf("records %u, matched %llu, files %llu\n", rec_cnt, static_cast<unsigned long long>(match_cnt), static_cast<unsigned long long>(file_refs.size()));
+  printf("parse %.3f s, total %.3f s, %.0f records/s\n", parse_time, time, rec_cnt / time);
+}
+
+// synthetic volume: $MFT is followed by files with STANDARD_INFORMATION, FILE_NAME and fragmented DATA
+const unsigned c_cluster_size = 4096;
+const unsigned c_file_rec_size = 1024;
+const unsigned c_mft_lcn = 4;
+
+// write update sequence array (reverse of apply_fixups)
+void protect_record(u8* rec, unsigned size, unsigned usa_ofs) {
+  MFT_RECORD* header = reinterpret_cast<MFT_RECORD*>(rec);
+  header->usa_ofs = usa_ofs;
+  header->usa_count = size / NTFS_BLOCK_SIZE + 1;
+  u16* usa = reinterpret_cast<u16*>(rec + usa_ofs);
+  usa[0] = 1;
+  for (unsigned i = 1; i < header->usa_count; i++) {
+    u16* block_end = reinterpret_cast<u16*>(rec + i * NTFS_BLOCK_SIZE) - 1;
+    usa[i] = *block_end;
+    *block_end = usa[0];
+  }
+}
+
+// mapping pair with minimal field sizes
+void add_data_run(std::vector<u8>& runs, u64 len, s64 off) {
+  unsigned len_l = 1;
+  while (len_l < 8 && (len >> (len_l * 8)) != 0) len_l++;
+  unsigned off_l = 1;
+  while (off_l < 8 && (off >> (off_l * 8 - 1)) != 0 && (off >> (off_l * 8 - 1)) != -1) off_l++;
+  runs.push_back(static_cast<u8>(len_l | (off_l << 4)));
+  for (unsigned i = 0; i < len_l; i++) runs.push_back(static_cast<u8>(len >> (i * 8)));
+  for (unsigned i = 0; i < off_l; i++) runs.push_back(static_cast<u8>(off >> (i * 8)));
+}
+
+class RecordBuilder {
+private:
+  u8* rec;
+  unsigned pos;
+  u16 instance;
+  ATTR_HEADER* add_header(u32 type, unsigned length) {
+    ATTR_HEADER* attr_header = reinterpret_cast<ATTR_HEADER*>(rec + pos);
+    attr_header->type = type;
+    attr_header->length = (length + 7) / 8 * 8;
+    attr_header->instance = instance++;
+    pos += attr_header->length;
+    return attr_header;
+  }
+public:
+  RecordBuilder(u8* rec, u16 flags): rec(rec), pos(0x38), instance(0) {
+    memset(rec, 0, c_file_rec_size);
+    MFT_RECORD* header = reinterpret_cast<MFT_RECORD*>(rec);
+    header->magic = magic_FILE;
+    header->sequence_number = 1;
+    header->link_count = 1;
+    header->attrs_offset = pos;
+    header->flags = flags;
+    header->bytes_allocated = c_file_rec_size;
+  }
+  void add_resident(u32 type, const void* value, unsigned size) {
+    const unsigned value_offset = sizeof(ATTR_HEADER) + sizeof(ATTR_RESIDENT);
+    ATTR_HEADER* attr_header = add_header(type, value_offset + size);
+    ATTR_RESIDENT* attr_info = reinterpret_cast<ATTR_RESIDENT*>(attr_header + 1);
+    attr_info->value_length = size;
+    attr_info->value_offset = value_offset;
+    memcpy(reinterpret_cast<u8*>(attr_header) + value_offset, value, size);
+  }
+  void add_non_resident(u32 type, const std::vector<u8>& runs, u64 size) {
+    const unsigned runs_offset = sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT);
+    ATTR_HEADER* attr_header = add_header(type, runs_offset + static_cast<unsigned>(runs.size()) + 1);
+    attr_header->non_resident = 1;
+    ATTR_NONRESIDENT* attr_info = reinterpret_cast<ATTR_NONRESIDENT*>(attr_header + 1);
+    attr_info->highest_vcn = size / c_cluster_size - 1;
+    attr_info->mapping_pairs_offset = runs_offset;
+    attr_info->allocated_size = attr_info->data_size = attr_info->initialized_size = size;
+    memcpy(reinterpret_cast<u8*>(attr_header) + runs_offset, runs.data(), runs.size());
+  }
+  void finish() {
+    *reinterpret_cast<u32*>(rec + pos) = AT_END;
+    reinterpret_cast<MFT_RECORD*>(rec)->bytes_in_use = pos + 8;
+    protect_record(rec, c_file_rec_size, 0x30);
+  }
+};
+
+void make_volume(unsigned rec_cnt, std::vector<u8>& volume) {
+  u64 mft_clusters = (static_cast<u64>(rec_cnt) * c_file_rec_size + c_cluster_size - 1) / c_cluster_size;
+  volume.assign(static_cast<size_t>((c_mft_lcn + mft_clusters) * c_cluster_size), 0);
+
+  NTFS_BOOT_SECTOR* boot_sector = reinterpret_cast<NTFS_BOOT_SECTOR*>(volume.data());
+  boot_sector->oem_id = NTFS_OEM_ID;
+  boot_sector->bytes_per_sector = NTFS_BLOCK_SIZE;
+  boot_sector->sectors_per_cluster = c_cluster_size / NTFS_BLOCK_SIZE;
+  boot_sector->mft_lcn = c_mft_lcn;
+  boot_sector->clusters_per_mft_record = -10; // 1024 bytes
+  boot_sector->clusters_per_index_record = 1;
+
+  u8* mft = volume.data() + c_mft_lcn * c_cluster_size;
+  std::vector<u8> runs;
+  add_data_run(runs, mft_clusters, c_mft_lcn);
+  RecordBuilder mft_rec(mft, MFT_RECORD_IN_USE);
+  mft_rec.add_non_resident(AT_DATA, runs, mft_clusters * c_cluster_size);
+  mft_rec.finish();
+
+  STANDARD_INFORMATION_ATTR std_info;
+  memset(&std_info, 0, sizeof(std_info));
+  u8 file_name[sizeof(FILE_NAME_ATTR) + 32 * 2];
+  for (unsigned i = 1; i < rec_cnt; i++) {
+    RecordBuilder file_rec(mft + static_cast<size_t>(i) * c_file_rec_size, MFT_RECORD_IN_USE);
+    std_info.creation_time = i;
+    file_rec.add_resident(AT_STANDARD_INFORMATION, &std_info, sizeof(std_info));
+    memset(file_name, 0, sizeof(file_name));
+    FILE_NAME_ATTR* fn_attr = reinterpret_cast<FILE_NAME_ATTR*>(file_name);
+    fn_attr->parent_directory = 5;
+    char name[32];
+    fn_attr->file_name_length = static_cast<u8>(sprintf(name, "file%u.dat", i));
+    for (unsigned j = 0; j < fn_attr->file_name_length; j++) reinterpret_cast<u16*>(fn_attr + 1)[j] = name[j];
+    file_rec.add_resident(AT_FILE_NAME, file_name, sizeof(FILE_NAME_ATTR) + fn_attr->file_name_length * 2);
+    // file data is never read, runs may point past end of volume
+    runs.clear();
+    add_data_run(runs, 16, 0x100000 + i * 64);
+    add_data_run(runs, 8, 32);
+    add_data_run(runs, 8, -16);
+    file_rec.add_non_resident(AT_DATA, runs, 32 * c_cluster_size);
+    file_rec.finish();
+  }
+}
+
+void make_image(const char* file_name, unsigned rec_cnt) {
+  std::vector<u8> volume;
+  make_volume(rec_cnt, volume);
+  FILE* file = fopen(file_name, "wb");
+  if (file == NULL) throw std::runtime_error("Cannot create image file");
+  bool ok = fwrite(volume.data(), 1, volume.size(), file) == volume.size();
+  if (fclose(file) != 0 || !ok) throw std::runtime_error("Cannot write image file");
+}
+
+unsigned count_attributes(const u8* rec, unsigned rec_size) {
+  unsigned cnt = 0;
+  for (unsigned attr_off = first_attribute(rec, rec_size); attr_off != -1; attr_off = next_attribute(rec, rec_size, attr_off)) cnt++;
+  return cnt;
+}
+
+// per record load as done by FileInfo: record read into scratch buffer in place
+// vs. record read after 12 byte FSCTL_GET_NTFS_FILE_RECORD header and moved to buffer start
+void bench_records(unsigned rec_cnt) {
+  MemoryDevice device;
+  make_volume(rec_cnt, device.data);
+  NtfsGeometry geometry;
+  read_boot_sector(device, geometry);
+  MftReader mft_reader(device, geometry);
+  const unsigned c_rec_offset = 16;
+  const unsigned c_fsctl_header_size = 12;
+
+  std::vector<u8> scratch(c_rec_offset + geometry.file_rec_size);
+  u64 attr_cnt = 0;
+  Clock::time_point start = Clock::now();
+  for (unsigned i = 0; i < rec_cnt; i++) {
+    mft_reader.read_record(i, scratch.data() + c_rec_offset);
+    attr_cnt += count_attributes(scratch.data() + c_rec_offset, geometry.file_rec_size);
+  }
+  double view_time = elapsed(start);
+
+  std::vector<u8> buf;
+  start = Clock::now();
+  for (unsigned i = 0; i < rec_cnt; i++) {
+    buf.resize(c_fsctl_header_size + geometry.file_rec_size);
+    mft_reader.read_record(i, buf.data() + c_fsctl_header_size);
+    memmove(buf.data(), buf.data() + c_fsctl_header_size, geometry.file_rec_size);
+    buf.resize(geometry.file_rec_size);
+    attr_cnt -= count_attributes(buf.data(), geometry.file_rec_size);
+  }
+  double move_time = elapsed(start);
+  if (attr_cnt != 0) throw std::runtime_error("Record mismatch");
+  printf("records %u, in place %.0f records/s, with move %.0f records/s\n", rec_cnt, rec_cnt / view_time, rec_cnt / move_time);
+}
+
+// straightforward decoder used as reference
+void decode_runs_ref(const u8* runs, std::vector<DataRun>& data_runs) {
+  data_runs.clear();
+  u64 lcn = 0;
+  for (unsigned idx = 0; runs[idx] != 0;) {
+    unsigned len_l = runs[idx] & 0x0F;
+    unsigned off_l = (runs[idx] & 0xF0) >> 4;
+    idx++;
+    u64 len = 0;
+    for (unsigned i = 0; i < len_l; i++) len |= static_cast<u64>(runs[idx++]) << (i * 8);
+    if (off_l == 0) {
+      data_runs.push_back(DataRun(-1, len));
+      continue;
+    }
+    u64 off = 0;
+    for (unsigned i = 0; i < off_l; i++) off |= static_cast<u64>(runs[idx++]) << (i * 8);
+    if (off_l < 8 && (off >> (off_l * 8 - 1)) & 1) off |= ~0ull << (off_l * 8); // sign
+    lcn += off;
+    data_runs.push_back(DataRun(lcn, len));
+  }
+}
+
+// non-resident attribute of fragmented file: run_cnt runs with random field sizes
+// (mostly short fields as on real volumes, sparse runs included)
+void make_data_runs(unsigned run_cnt, std::vector<u8>& attr) {
+  const unsigned c_runs_offset = sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT);
+  attr.assign(c_runs_offset, 0);
+  reinterpret_cast<ATTR_NONRESIDENT*>(attr.data() + sizeof(ATTR_HEADER))->mapping_pairs_offset = c_runs_offset;
+  for (unsigned i = 0; i < run_cnt; i++) {
+    unsigned len_l = rand() % 8 ? 1 + rand() % 2 : 1 + rand() % 8;
+    unsigned off_l = rand() % 16 == 0 ? 0 : rand() % 8 ? 2 + rand() % 2 : 1 + rand() % 8;
+    attr.push_back(static_cast<u8>(len_l | (off_l << 4)));
+    for (unsigned j = 0; j < len_l + off_l; j++) attr.push_back(static_cast<u8>(rand()));
+  }
+  attr.push_back(0);
+}
+
+void bench_runs(unsigned run_cnt) {
+  srand(1);
+  std::vector<u8> attr;
+  std::vector<DataRun> data_runs, ref_data_runs;
+  // equivalence on short random lists (end of buffer exercises byte by byte path)
+  for (unsigned i = 0; i < 100000; i++) {
+    make_data_runs(rand() % 8, attr);
+    decode_data_runs(attr.data(), static_cast<unsigned>(attr.size()), 0, data_runs);
+    decode_runs_ref(attr.data() + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT), ref_data_runs);
+    bool equal = data_runs.size() == ref_data_runs.size();
+    for (unsigned j = 0; equal && j < data_runs.size(); j++) equal = data_runs[j].lcn == ref_data_runs[j].lcn && data_runs[j].len == ref_data_runs[j].len;
+    if (!equal) throw std::runtime_error("Data run decoder mismatch");
+  }
+
+  make_data_runs(run_cnt, attr);
+  const unsigned c_iter_cnt = 100;
+  Clock::time_point start = Clock::now();
+  u64 total = 0;
+  for (unsigned i = 0; i < c_iter_cnt; i++) {
+    decode_data_runs(attr.data(), static_cast<unsigned>(attr.size()), 0, data_runs);
+    total += data_runs.size();
+  }
+  double time = elapsed(start);
+  start = Clock::now();
+  for (unsigned i = 0; i < c_iter_cnt; i++) {
+    decode_runs_ref(attr.data() + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT), ref_data_runs);
+    total -= ref_data_runs.size();
+  }
+  double ref_time = elapsed(start);
+  if (total != 0) throw std::runtime_error("Data run decoder mismatch");
+  printf("runs %u, %.0f runs/s (reference %.0f runs/s)\n", run_cnt, run_cnt * c_iter_cnt / time, run_cnt * c_iter_cnt / ref_time);
+}
+
+// non-resident attribute list split into run_cnt one cluster runs, every other one adjacent to previous
+// (as left by volume growing in place): contents and number of device reads
+void bench_attr_list(unsigned run_cnt) {
+  MemoryDevice device;
+  device.data.resize(static_cast<size_t>(run_cnt) * 2 * c_cluster_size);
+  for (size_t i = 0; i < device.data.size(); i++) device.data[i] = static_cast<u8>(i / c_cluster_size + i);
+  NtfsGeometry geometry;
+  geometry.sector_size = NTFS_BLOCK_SIZE;
+  geometry.cluster_size = c_cluster_size;
+  geometry.file_rec_size = c_file_rec_size;
+  geometry.mft_start_lcn = 0;
+
+  std::vector<u8> runs;
+  std::vector<u64> lcns;
+  u64 lcn = 0;
+  for (unsigned i = 0; i < run_cnt; i++) {
+    u64 next_lcn = i == 0 ? 0 : lcn + (i % 2 ? 1 : 2);
+    add_data_run(runs, 1, static_cast<s64>(next_lcn - lcn));
+    lcn = next_lcn;
+    lcns.push_back(lcn);
+  }
+  std::vector<u8> rec(c_file_rec_size + runs.size());
+  RecordBuilder builder(rec.data(), MFT_RECORD_IN_USE);
+  builder.add_non_resident(AT_ATTRIBUTE_LIST, runs, static_cast<u64>(run_cnt) * c_cluster_size);
+  std::vector<u8> value;
+  read_attribute(device, geometry, rec.data(), static_cast<unsigned>(rec.size()), 0x38, run_cnt * c_cluster_size, value);
+  if (value.size() != static_cast<size_t>(run_cnt) * c_cluster_size) throw std::runtime_error("Attribute size mismatch");
+  for (unsigned i = 0; i < run_cnt; i++) {
+    if (memcmp(value.data() + static_cast<size_t>(i) * c_cluster_size, device.data.data() + lcns[i] * c_cluster_size, c_cluster_size) != 0) throw std::runtime_error("Attribute data mismatch");
+  }
+  printf("runs %u, device reads %u\n", run_cnt, device.read_cnt);
+}
+
+// WinSxS-like tree: every file has 2-4 links, links are visited in random order
+// file analyzer keeps totals of first link and adds them for each further one
+struct LinkTotals {
+  u64 data_size;
+  u64 named_size;
+  u64 nr_size;
+};
+
+void bench_hard_links(unsigned file_cnt) {
+  std::vector<u64> visits;
+  srand(1);
+  for (unsigned i = 0; i < file_cnt; i++) {
+    u64 file_ref = (static_cast<u64>(i % 7 + 1) << 48) | (i + 16);
+    for (unsigned j = 0; j < 2 + i % 3; j++) visits.push_back(file_ref);
+  }
+  for (size_t i = visits.size(); i > 1; i--) std::swap(visits[i - 1], visits[(static_cast<size_t>(rand()) * (RAND_MAX + 1u) + rand()) % i]);
+
+  Clock::time_point start = Clock::now();
+  FileRefMap<LinkTotals> links;
+  u64 hl_size = 0;
+  for (size_t i = 0; i < visits.size(); i++) {
+    const LinkTotals* link = links.find(visits[i]);
+    if (link) hl_size += link->data_size;
+    else {
+      LinkTotals totals = { visits[i] & 0xFFFF, 0, 0 };
+      links.insert(visits[i], totals);
+    }
+  }
+  double time = elapsed(start);
+  printf("files %u, links %llu, hard link size %llu\n", file_cnt, static_cast<unsigned long long>(visits.size()), static_cast<unsigned long long>(hl_size));
+  printf("hash table %.3f s, %.0f links/s\n", time, visits.size() / time);
+
+  // previous method: array of full file infos, sorted after each insert
+  const unsigned c_max_sorted_cnt = 5000;
+  if (file_cnt > c_max_sorted_cnt) {
+    printf("sorted array skipped (more than %u files)\n", c_max_sorted_cnt);
+    return;
+  }
+  struct FatInfo {
+    u64 file_ref;
+    u8 attr_data[248];
+    bool operator<(const FatInfo& info) const {
+      return file_ref < info.file_ref;
+    }
+  };
+  start = Clock::now();
+  std::vector<FatInfo> infos;
+  u64 sorted_hl_size = 0;
+  for (size_t i = 0; i < visits.size(); i++) {
+    FatInfo info;
+    info.file_ref = visits[i];
+    std::vector<FatInfo>::const_iterator pos = std::lower_bound(infos.begin(), infos.end(), info);
+    if (pos != infos.end() && pos->file_ref == visits[i]) sorted_hl_size += pos->file_ref & 0xFFFF;
+    else {
+      infos.push_back(info);
+      std::sort(infos.begin(), infos.end());
+    }
+  }
+  time = elapsed(start);
+  if (sorted_hl_size != hl_size) throw std::runtime_error("Hard link totals mismatch");
+  printf("sorted array %.3f s, %.0f links/s\n", time, visits.size() / time);
+}
+
+// file opened for unbuffered positional reads from many threads
+class RawFile {
+private:
+#ifdef _WIN32
+  HANDLE handle;
+#else
+  int fd;
+#endif
+public:
+  bool unbuffered;
+  u64 size;
+  RawFile(const char* file_name) {
+#ifdef _WIN32
+    unbuffered = true;
+    handle = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+    if (handle == INVALID_HANDLE_VALUE) throw std::runtime_error("Cannot open file");
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(handle, &file_size);
+    size = file_size.QuadPart;
+#else
+    unbuffered = false;
+#ifdef O_DIRECT
+    fd = open(file_name, O_RDONLY | O_DIRECT);
+    unbuffered = fd != -1;
+    // not every file system supports direct I/O (tmpfs)
+    if (fd == -1)
+#endif
+      fd = open(file_name, O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Cannot open file");
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+#endif
+  }
+  ~RawFile() {
+#ifdef _WIN32
+    CloseHandle(handle);
+#else
+    close(fd);
+#endif
+  }
+  // returns less than size at end of file only
+  unsigned read(u64 pos, u8* buf, unsigned size) {
+#ifdef _WIN32
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = static_cast<DWORD>(pos);
+    ov.OffsetHigh = static_cast<DWORD>(pos >> 32);
+    DWORD read_size;
+    if (ReadFile(handle, buf, size, &read_size, &ov) == 0) {
+      if (GetLastError() == ERROR_HANDLE_EOF) return 0;
+      throw std::runtime_error("File read error");
+    }
+    return read_size;
+#else
+    unsigned done = 0;
+    while (done < size) {
+      ssize_t ret = pread(fd, buf + done, size - done, pos + done);
+      if (ret < 0) throw std::runtime_error("File read error");
+      if (ret == 0) break;
+      done += static_cast<unsigned>(ret);
+    }
+    return done;
+#endif
+  }
+};
+
+// thread based stand-in for content analysis I/O engine: every reader thread keeps one read in flight,
+// blocks are delivered in file order through ring of depth + 1 aligned buffers
+class BlockReader {
+private:
+  RawFile& file;
+  unsigned block_size;
+  unsigned depth;
+  u64 block_cnt;
+  std::vector<u8> mem;
+  std::vector<u8*> slots;
+  std::vector<unsigned> slot_size;
+  std::vector<bool> slot_done;
+  u64 next_read;
+  u64 next_deliver;
+  bool error;
+  std::mutex sync;
+  std::condition_variable cond;
+
+  void read_blocks() {
+    std::unique_lock<std::mutex> lock(sync);
+    while (!error && (next_read < block_cnt)) {
+      u64 block = next_read++;
+      // slot is reused when block occupying it was delivered
+      while (!error && (block >= next_deliver + slots.size())) cond.wait(lock);
+      if (error) break;
+      unsigned slot = static_cast<unsigned>(block % slots.size());
+      lock.unlock();
+      unsigned size;
+      try {
+        size = file.read(block * block_size, slots[slot], block_size);
+      }
+      catch (...) {
+        lock.lock();
+        error = true;
+        cond.notify_all();
+        break;
+      }
+      lock.lock();
+      slot_size[slot] = size;
+      slot_done[slot] = true;
+      cond.notify_all();
+    }
+  }
+
+public:
+  BlockReader(RawFile& file, unsigned block_size, unsigned depth): file(file), block_size(block_size), depth(depth), next_read(0), next_deliver(0), error(false) {
+    const unsigned c_align = 4096;
+    block_cnt = (file.size + block_size - 1) / block_size;
+    mem.resize(static_cast<size_t>(block_size) * (depth + 1) + c_align);
+    u8* base = mem.data() + (c_align - reinterpret_cast<uintptr_t>(mem.data()) % c_align) % c_align;
+    for (unsigned i = 0; i < depth + 1; i++) slots.push_back(base + static_cast<size_t>(i) * block_size);
+    slot_size.resize(slots.size());
+    slot_done.resize(slots.size());
+  }
+
+  template<class Consumer> void run(Consumer& consumer) {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < depth; i++) threads.push_back(std::thread(&BlockReader::read_blocks, this));
+    for (u64 block = 0; block < block_cnt; block++) {
+      unsigned slot = static_cast<unsigned>(block % slots.size());
+      {
+        std::unique_lock<std::mutex> lock(sync);
+        while (!error && !slot_done[slot]) cond.wait(lock);
+        if (error) break;
+      }
+      consumer(slots[slot], slot_size[slot]);
+      std::lock_guard<std::mutex> lock(sync);
+      slot_done[slot] = false;
+      next_deliver++;
+      cond.notify_all();
+    }
+    for (unsigned i = 0; i < threads.size(); i++) threads[i].join();
+    if (error) throw std::runtime_error("File read error");
+  }
+};
+
+// cheap order sensitive checksum stands in for digest stage and proves in order delivery
+// chained per 64 KB chunk so that result does not depend on block size
+struct BlockChecksum {
+  u64 checksum;
+  u64 data_size;
+  BlockChecksum(): checksum(0), data_size(0) {
+  }
+  void operator()(const u8* data, unsigned size) {
+    const unsigned c_chunk_size = 64 * 1024;
+    for (unsigned pos = 0; pos < size; pos += c_chunk_size) {
+      unsigned end = std::min(pos + c_chunk_size, size);
+      u64 sum = 0;
+      unsigned i = pos;
+      for (; i + sizeof(u64) <= end; i += sizeof(u64)) {
+        u64 word;
+        memcpy(&word, data + i, sizeof(word));
+        sum += word;
+      }
+      for (; i < end; i++) sum += data[i];
+      checksum = checksum * 0x100000001B3ULL + sum;
+    }
+    data_size += size;
+  }
+};
+
+void bench_io(const char* file_name) {
+  RawFile file(file_name);
+  printf("file size %llu, %s I/O\n", static_cast<unsigned long long>(file.size), file.unbuffered ? "unbuffered" : "buffered (page cache may serve repeated passes)");
+  const unsigned c_block_sizes[] = { 1, 2, 4, 8 }; // MB
+  const unsigned c_depths[] = { 1, 2, 4, 8, 16 };
+  u64 ref_checksum = 0;
+  bool first = true;
+  for (unsigned i = 0; i < sizeof(c_block_sizes) / sizeof(c_block_sizes[0]); i++) {
+    for (unsigned j = 0; j < sizeof(c_depths) / sizeof(c_depths[0]); j++) {
+      BlockReader reader(file, c_block_sizes[i] * 1024 * 1024, c_depths[j]);
+      BlockChecksum checksum;
+      Clock::time_point start = Clock::now();
+      reader.run(checksum);
+      double time = elapsed(start);
+      if (checksum.data_size != file.size) throw std::runtime_error("Short file read");
+      if (first) ref_checksum = checksum.checksum;
+      else if (checksum.checksum != ref_checksum) throw std::runtime_error("Blocks delivered out of order");
+      first = false;
+      printf("block %u MB, depth %2u: %.0f MB/s\n", c_block_sizes[i], c_depths[j], file.size / time / (1024 * 1024));
+    }
+  }
+}
+
+// bit by bit CRC-32, same as lzo_crc32 (zlib)
+u32 crc32_ref(u32 crc, const u8* data, size_t size) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (unsigned j = 0; j < 8; j++) crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+  }
+  return ~crc;
+}
+
+void bench_crc(unsigned size_mb) {
+  const char* c_kernel_names[] = { "bytewise", "slice16", "clmul" };
+  const char c_check[] = "123456789";
+  if (crc32_update(0, c_check, 9) != 0xCBF43926 || crc16_update(0xFFFF, c_check, 9) != 0x4B37) throw std::runtime_error("CRC check value mismatch");
+
+  // all alignments and tails, chained updates
+  std::vector<u8> data(4096 + 64);
+  srand(1);
+  for (size_t i = 0; i < data.size(); i++) data[i] = static_cast<u8>(rand());
+  for (unsigned kernel = ck_bytewise; kernel <= ck_clmul; kernel++) {
+    if (!crc_kernel_supported(static_cast<CrcKernel>(kernel))) continue;
+    for (unsigned offset = 0; offset < 16; offset++) {
+      for (unsigned size = 0; size <= 4096; size += size < 300 ? 1 : 61) {
+        const u8* p = data.data() + offset;
+        unsigned half = size / 3;
+        u32 crc32 = crc32_update(crc32_update(0x12345678, p, half, static_cast<CrcKernel>(kernel)), p + half, size - half, static_cast<CrcKernel>(kernel));
+        if (crc32 != crc32_ref(0x12345678, p, size)) throw std::runtime_error("CRC-32 mismatch");
+        u16 crc16 = crc16_update(crc16_update(0x5678, p, half, static_cast<CrcKernel>(kernel)), p + half, size - half, static_cast<CrcKernel>(kernel));
+        if (crc16 != CRC16::update(0x5678, p, size)) throw std::runtime_error("CRC-16 mismatch");
+      }
+    }
+  }
+  printf("kernels verified, default %s\n", c_kernel_names[crc_kernel()]);
+
+  std::vector<u8> buffer(static_cast<size_t>(size_mb) * 1024 * 1024);
+  for (size_t i = 0; i < buffer.size(); i++) buffer[i] = static_cast<u8>(i * 131 + (i >> 12));
+  Clock::time_point start = Clock::now();
+  u16 crc16_table = CRC16::update(CRC16::init(), buffer.data(), buffer.size());
+  printf("CRC16::update: %.2f GB/s\n", buffer.size() / elapsed(start) / 1e9);
+  for (unsigned kernel = ck_bytewise; kernel <= ck_clmul; kernel++) {
+    if (!crc_kernel_supported(static_cast<CrcKernel>(kernel))) continue;
+    start = Clock::now();
+    u32 crc32 = crc32_update(0, buffer.data(), buffer.size(), static_cast<CrcKernel>(kernel));
+    double crc32_time = elapsed(start);
+    start = Clock::now();
+    u16 crc16 = crc16_update(0xFFFF, buffer.data(), buffer.size(), static_cast<CrcKernel>(kernel));
+    double crc16_time = elapsed(start);
+    if (crc16 != crc16_table) throw std::runtime_error("CRC-16 mismatch");
+    printf("%-8s CRC-32 %.2f GB/s, CRC-16 %.2f GB/s (%08x %04x)\n", c_kernel_names[kernel], buffer.size() / crc32_time / 1e9, buffer.size() / crc16_time / 1e9, crc32, crc16);
+  }
+}
+
+template<class Hash> std::string sha_hex(ShaKernel kernel, const u8* data, size_t size, size_t split) {
+  Hash hash(kernel);
+  hash.update(data, split);
+  hash.update(data + split, size - split);
+  u8 digest[Hash::c_digest_size];
+  hash.final(digest);
+  std::string hex;
+  for (unsigned i = 0; i < sizeof(digest); i++) {
+    char byte[3];
+    sprintf(byte, "%02x", digest[i]);
+    hex += byte;
+  }
+  return hex;
+}
+
+template<class Hash> double sha_speed(ShaKernel kernel, const std::vector<u8>& buffer) {
+  Clock::time_point start = Clock::now();
+  Hash hash(kernel);
+  hash.update(buffer.data(), buffer.size());
+  u8 digest[Hash::c_digest_size];
+  hash.final(digest);
+  return buffer.size() / elapsed(start) / 1e9;
+}
+
+void bench_sha(unsigned size_mb) {
+  const char* c_kernel_names[] = { "portable", "shani" };
+  const u8* c_abc = reinterpret_cast<const u8*>("abc");
+  std::vector<u8> million_a(1000000, 'a');
+  std::vector<u8> data(4096);
+  srand(1);
+  for (size_t i = 0; i < data.size(); i++) data[i] = static_cast<u8>(rand());
+  for (unsigned kernel = sk_portable; kernel <= sk_shani; kernel++) {
+    ShaKernel k = static_cast<ShaKernel>(kernel);
+    if (!sha_kernel_supported(k)) continue;
+    if (sha_hex<Sha1>(k, c_abc, 3, 1) != "a9993e364706816aba3e25717850c26c9cd0d89d" ||
+      sha_hex<Sha1>(k, million_a.data(), million_a.size(), 333) != "34aa973cd4c4daa4f61eeb2bdbad27316534016f" ||
+      sha_hex<Sha256>(k, c_abc, 3, 2) != "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" ||
+      sha_hex<Sha256>(k, million_a.data(), million_a.size(), 65) != "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0") {
+      throw std::runtime_error("SHA test vector mismatch");
+    }
+    // padding of every tail size, chained updates
+    for (size_t size = 0; size <= 300; size++) {
+      if (sha_hex<Sha1>(k, data.data(), size, size / 3) != sha_hex<Sha1>(sk_portable, data.data(), size, 0) ||
+        sha_hex<Sha256>(k, data.data(), size, size / 3) != sha_hex<Sha256>(sk_portable, data.data(), size, 0)) {
+        throw std::runtime_error("SHA kernel mismatch");
+      }
+    }
+  }
+  printf("kernels verified, default %s\n", c_kernel_names[sha_kernel()]);
+
+  std::vector<u8> buffer(static_cast<size_t>(size_mb) * 1024 * 1024);
+  for (size_t i = 0; i < buffer.size(); i++) buffer[i] = static_cast<u8>(i * 131 + (i >> 12));
+  for (unsigned kernel = sk_portable; kernel <= sk_shani; kernel++) {
+    ShaKernel k = static_cast<ShaKernel>(kernel);
+    if (!sha_kernel_supported(k)) continue;
+    printf("%-8s SHA-1 %.2f GB/s, SHA-256 %.2f GB/s\n", c_kernel_names[kernel], sha_speed<Sha1>(k, buffer), sha_speed<Sha256>(k, buffer));
+  }
+}
+
+int main(int argc, char** argv) {
+  try {
+    if (argc == 3 && strcmp(argv[1], "-usn") == 0) bench_usn(static_cast<unsigned>(strtoul(argv[2], NULL, 10)));
+    else if (argc == 3 && strcmp(argv[1], "-runs") == 0) bench_runs(static_cast<unsigned>(strtoul(argv[2], NULL, 10)));
+    else if (argc == 3 && strcmp(argv[1], "-records") == 0) bench_records(static_cast<unsigned>(strtoul(argv[2], NULL, 10)));
+    else if (argc == 3 && strcmp(argv[1], "-attrlist") == 0) bench_attr_list(static_cast<unsigned>(strtoul(argv[2], NULL, 10)));
+    else if (argc == 3 && strcmp(argv[1], "-hardlinks") == 0) bench_hard_links(static_cast<unsigned>(strtoul(argv[2], NULL, 10)));
+    else if (argc == 3 && strcmp(argv[1], "-io") == 0) bench_io(argv[2]);
+    else if (argc == 3 && strcmp(argv[1], "-crc") == 0) bench_crc(static_cast<unsigned>(strtoul(argv[2], NULL, 10)));
+    else if (argc == 3 && strcmp(argv[1], "-sha") == 0) bench_sha(static_cast<unsigned>(strtoul(argv[2], NULL, 10)));
+    else if (argc == 4 && strcmp(argv[1], "-mkimage") == 0) make_image(argv[2], static_cast<unsigned>(strtoul(argv[3], NULL, 10)));
+    else if (argc == 2) bench_image(argv[1]);
+    else {
+      fprintf(stderr, "usage: ntfs_bench <image> | -usn <count> | -runs <count> | -records <count> | -attrlist <count> | -hardlinks <count> | -io <file> | -crc <MB> | -sha <MB> | -mkimage <image> <count>\n");
+      return 2;
+    }
+  }
+  catch (const std::exception& e) {
+    fprintf(stderr, "error: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,384 @@
+#include "ntfs_core.h"
+
+#define MAX_ATTR_LIST_SIZE (10 * 1024 * 1024)
+#define MAX_INDEX_BITMAP_SIZE (1024 * 1024)
+#define INDEX_CHUNK_SIZE (1024 * 1024)
+#define CHECK_FMT(code) { if (!(code)) throw NtfsFormatError(); }
+
+void read_boot_sector(BlockDevice& device, NtfsGeometry& geometry) {
+  NTFS_BOOT_SECTOR boot_sector;
+  geometry.sector_size = NTFS_BLOCK_SIZE;
+  device.read(0, &boot_sector, sizeof(boot_sector));
+  if (boot_sector.oem_id != NTFS_OEM_ID) throw std::runtime_error("Only NTFS volumes are supported");
+  if (boot_sector.bytes_per_sector < NTFS_BLOCK_SIZE || (boot_sector.bytes_per_sector & (boot_sector.bytes_per_sector - 1)) != 0) throw std::runtime_error("Invalid NTFS boot sector");
+  geometry.sector_size = boot_sector.bytes_per_sector;
+  if (boot_sector.sectors_per_cluster > 0x80) geometry.cluster_size = geometry.sector_size << (256 - boot_sector.sectors_per_cluster);
+  else geometry.cluster_size = geometry.sector_size * boot_sector.sectors_per_cluster;
+  if (boot_sector.clusters_per_mft_record > 0) geometry.file_rec_size = geometry.cluster_size * boot_sector.clusters_per_mft_record;
+  else geometry.file_rec_size = 1 << -boot_sector.clusters_per_mft_record;
+  if (geometry.cluster_size == 0 || geometry.file_rec_size < NTFS_BLOCK_SIZE) throw std::runtime_error("Invalid NTFS boot sector");
+  geometry.mft_start_lcn = boot_sector.mft_lcn;
+}
+
+bool apply_fixups(u8* rec, unsigned size) {
+  const MFT_RECORD* header = reinterpret_cast<const MFT_RECORD*>(rec);
+  unsigned usa_ofs = header->usa_ofs;
+  unsigned usa_count = header->usa_count;
+  if ((size % NTFS_BLOCK_SIZE != 0) || (usa_ofs & 1) || (usa_ofs + usa_count * 2 > size) || (size / NTFS_BLOCK_SIZE + 1 != usa_count)) return false;
+  const u16* usa = reinterpret_cast<const u16*>(rec + usa_ofs);
+  for (unsigned i = 1; i < usa_count; i++) {
+    u16* block_end = reinterpret_cast<u16*>(rec + i * NTFS_BLOCK_SIZE) - 1;
+    if (*block_end != usa[0]) return false;
+    *block_end = usa[i];
+  }
+  return true;
+}
+
+// validate attribute header at attr_off
+static unsigned check_attribute(const u8* rec, unsigned rec_size, unsigned attr_off) {
+  CHECK_FMT(attr_off <= rec_size && rec_size - attr_off >= sizeof(u32));
+  const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(rec + attr_off);
+  if (attr_header->type == AT_END) return -1;
+  CHECK_FMT(rec_size - attr_off >= sizeof(ATTR_HEADER));
+  CHECK_FMT(attr_header->length != 0 && attr_header->length <= rec_size - attr_off); // prevent infinite loop
+  return attr_off;
+}
+
+unsigned first_attribute(const u8* rec, unsigned rec_size) {
+  CHECK_FMT(rec_size >= sizeof(MFT_RECORD));
+  const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(rec);
+  return check_attribute(rec, rec_size, mft_rec->attrs_offset);
+}
+
+unsigned next_attribute(const u8* rec, unsigned rec_size, unsigned attr_off) {
+  const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(rec + attr_off);
+  return check_attribute(rec, rec_size, attr_off + attr_header->length);
+}
+
+unsigned find_attribute(const u8* rec, unsigned rec_size, u32 type, u16 instance) {
+  for (unsigned attr_off = first_attribute(rec, rec_size); attr_off != -1; attr_off = next_attribute(rec, rec_size, attr_off)) {
+    const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(rec + attr_off);
+    if ((type == attr_header->type) && ((instance == 0) || (instance == attr_header->instance))) return attr_off;
+  }
+  return -1;
+}
+
+unsigned find_named_attribute(const u8* rec, unsigned rec_size, u32 type, const u16* name, unsigned name_size) {
+  for (unsigned attr_off = first_attribute(rec, rec_size); attr_off != -1; attr_off = next_attribute(rec, rec_size, attr_off)) {
+    const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(rec + attr_off);
+    if ((type != attr_header->type) || (name_size != attr_header->name_length)) continue;
+    CHECK_FMT(attr_header->name_offset + name_size * 2 <= attr_header->length);
+    if (memcmp(rec + attr_off + attr_header->name_offset, name, name_size * 2) == 0) return attr_off;
+  }
+  return -1;
+}
+
+// unaligned little endian load (NTFS data is always little endian)
+static inline u64 load_u64(const u8* data) {
+  u64 value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+void decode_data_runs(const u8* rec, unsigned rec_size, unsigned attr_off, std::vector<DataRun>& data_runs) {
+  data_runs.clear();
+  CHECK_FMT(attr_off + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT) <= rec_size);
+  const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(rec + attr_off + sizeof(ATTR_HEADER));
+
+  unsigned idx = attr_off + attr_info->mapping_pairs_offset;
+  u64 lcn = 0;
+  while (true) {
+    CHECK_FMT(idx < rec_size);
+    if (rec[idx] == 0) break; // end marker
+    unsigned len_l = rec[idx] & 0x0F;
+    unsigned off_l = (rec[idx] & 0xF0) >> 4;
+    idx++;
+    CHECK_FMT(len_l <= 8 && off_l <= 8 && idx + len_l + off_l <= rec_size);
+    u64 len = 0;
+    s64 off = 0;
+    if (idx + len_l + 8 <= rec_size) {
+      // fast path: whole fields are loaded at once, offset is sign extended by arithmetic shift
+      if (len_l) len = load_u64(rec + idx) & (~0ull >> (64 - len_l * 8));
+      if (off_l) off = static_cast<s64>(load_u64(rec + idx + len_l) << (64 - off_l * 8)) >> (64 - off_l * 8);
+      idx += len_l + off_l;
+    }
+    else {
+      // near the end of record
+      unsigned i;
+      for (i = 0; i < len_l; i++) {
+        len += static_cast<u64>(rec[idx++]) << (i * 8);
+      }
+      if (off_l) {
+        for (i = 0; i + 1 < off_l; i++) {
+          off |= static_cast<u64>(rec[idx++]) << (i * 8);
+        }
+        off |= static_cast<s64>(static_cast<s8>(rec[idx++])) << (i * 8);
+      }
+    }
+    if (off_l == 0) {
+      data_runs.push_back(DataRun(-1, len)); // sparse
+      continue;
+    }
+    lcn = lcn + off;
+    data_runs.push_back(DataRun(lcn, len));
+  }
+}
+
+// read size bytes at offset of non-resident attribute data; runs that are adjacent on disk are read at once
+static void read_runs(BlockDevice& device, const NtfsGeometry& geometry, const std::vector<DataRun>& data_runs, u64 offset, u8* buf, unsigned size) {
+  u64 read_pos = 0;
+  unsigned read_size = 0;
+  u64 run_start = 0;
+  for (unsigned i = 0; (i < data_runs.size()) && (size != 0); i++) {
+    u64 run_end = run_start + data_runs[i].len * geometry.cluster_size;
+    if (offset < run_end) {
+      CHECK_FMT(data_runs[i].lcn != -1); // compressed or sparse not allowed
+      u64 run_left = run_end - offset;
+      unsigned part_size = run_left < size ? static_cast<unsigned>(run_left) : size;
+      u64 part_pos = data_runs[i].lcn * geometry.cluster_size + (offset - run_start);
+      if ((read_size != 0) && (read_pos + read_size != part_pos)) {
+        device.read(read_pos, buf, read_size);
+        buf += read_size;
+        read_size = 0;
+      }
+      if (read_size == 0) read_pos = part_pos;
+      read_size += part_size;
+      offset += part_size;
+      size -= part_size;
+    }
+    run_start = run_end;
+  }
+  if (read_size != 0) device.read(read_pos, buf, read_size);
+  CHECK_FMT(size == 0);
+}
+
+u64 get_attribute_buffer_size(const u8* rec, unsigned rec_size, unsigned attr_off) {
+  CHECK_FMT(attr_off + sizeof(ATTR_HEADER) <= rec_size);
+  const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(rec + attr_off);
+  if (attr_header->non_resident) {
+    CHECK_FMT(attr_off + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT) <= rec_size);
+    return reinterpret_cast<const ATTR_NONRESIDENT*>(rec + attr_off + sizeof(ATTR_HEADER))->allocated_size;
+  }
+  else {
+    CHECK_FMT(attr_off + sizeof(ATTR_HEADER) + sizeof(ATTR_RESIDENT) <= rec_size);
+    return reinterpret_cast<const ATTR_RESIDENT*>(rec + attr_off + sizeof(ATTR_HEADER))->value_length;
+  }
+}
+
+unsigned read_attribute(BlockDevice& device, const NtfsGeometry& geometry, const u8* rec, unsigned rec_size, unsigned attr_off, u8* buf, unsigned max_size) {
+  CHECK_FMT(get_attribute_buffer_size(rec, rec_size, attr_off) <= max_size);
+  const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(rec + attr_off);
+  if (attr_header->non_resident) {
+    const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(rec + attr_off + sizeof(ATTR_HEADER));
+    CHECK_FMT(attr_info->data_size <= attr_info->allocated_size);
+    std::vector<DataRun> data_runs;
+    decode_data_runs(rec, rec_size, attr_off, data_runs);
+    // calculate disk size using data runs
+    u64 attr_disk_size = 0;
+    for (unsigned i = 0; i < data_runs.size(); i++) {
+      attr_disk_size += data_runs[i].len * geometry.cluster_size;
+    }
+    CHECK_FMT(attr_disk_size == attr_info->allocated_size);
+    if (attr_info->allocated_size) read_runs(device, geometry, data_runs, 0, buf, static_cast<unsigned>(attr_info->allocated_size));
+    return static_cast<unsigned>(attr_info->data_size);
+  }
+  else {
+    const ATTR_RESIDENT* attr_info = reinterpret_cast<const ATTR_RESIDENT*>(rec + attr_off + sizeof(ATTR_HEADER));
+    CHECK_FMT(attr_off + attr_info->value_offset + attr_info->value_length <= rec_size);
+    memcpy(buf, rec + attr_off + attr_info->value_offset, attr_info->value_length);
+    return attr_info->value_length;
+  }
+}
+
+void read_attribute(BlockDevice& device, const NtfsGeometry& geometry, const u8* rec, unsigned rec_size, unsigned attr_off, unsigned max_size, std::vector<u8>& value) {
+  u64 buf_size = get_attribute_buffer_size(rec, rec_size, attr_off);
+  CHECK_FMT(buf_size <= max_size);
+  value.resize(static_cast<size_t>(buf_size));
+  value.resize(read_attribute(device, geometry, rec, rec_size, attr_off, value.data(), max_size));
+}
+
+void walk_attr_list(const u8* attr_list, unsigned size, AttrListVisitor& visitor) {
+  unsigned idx = 0;
+  while (idx != size) {
+    CHECK_FMT(idx + sizeof(ATTR_LIST_ENTRY) <= size);
+    const ATTR_LIST_ENTRY* attr_list_entry = reinterpret_cast<const ATTR_LIST_ENTRY*>(attr_list + idx);
+    CHECK_FMT(attr_list_entry->length != 0 && attr_list_entry->length <= size - idx);
+    visitor.visit(attr_list_entry);
+    idx += attr_list_entry->length;
+  }
+}
+
+void walk_index_entries(const u8* index_header, unsigned size, IndexVisitor& visitor) {
+  CHECK_FMT(size >= sizeof(INDEX_HEADER));
+  const INDEX_HEADER* header = reinterpret_cast<const INDEX_HEADER*>(index_header);
+  CHECK_FMT(header->index_length <= size);
+  unsigned pos = header->entries_offset;
+  while (true) {
+    CHECK_FMT(pos <= header->index_length && header->index_length - pos >= sizeof(INDEX_ENTRY));
+    const INDEX_ENTRY* entry = reinterpret_cast<const INDEX_ENTRY*>(index_header + pos);
+    CHECK_FMT(entry->length >= sizeof(INDEX_ENTRY) && entry->length <= header->index_length - pos);
+    if (entry->flags & INDEX_ENTRY_END) break;
+    CHECK_FMT(sizeof(INDEX_ENTRY) + entry->key_length <= entry->length);
+    visitor.visit(entry);
+    pos += entry->length;
+  }
+}
+
+bool walk_index(BlockDevice& device, const NtfsGeometry& geometry, const u8* rec, unsigned rec_size, const u16* name, unsigned name_size, IndexVisitor& visitor) {
+  unsigned root_off = find_named_attribute(rec, rec_size, AT_INDEX_ROOT, name, name_size);
+  if (root_off == -1) return false;
+  const ATTR_HEADER* root_header = reinterpret_cast<const ATTR_HEADER*>(rec + root_off);
+  CHECK_FMT(!root_header->non_resident);
+  CHECK_FMT(root_off + sizeof(ATTR_HEADER) + sizeof(ATTR_RESIDENT) <= rec_size);
+  const ATTR_RESIDENT* root_info = reinterpret_cast<const ATTR_RESIDENT*>(rec + root_off + sizeof(ATTR_HEADER));
+  unsigned root_value_off = root_off + root_info->value_offset;
+  CHECK_FMT(root_info->value_length >= sizeof(INDEX_ROOT) && root_value_off + root_info->value_length <= rec_size);
+  const INDEX_ROOT* root = reinterpret_cast<const INDEX_ROOT*>(rec + root_value_off);
+
+  // large index: B+ tree nodes are stored in INDX blocks, in-use blocks are marked in bitmap
+  unsigned alloc_off = -1;
+  std::vector<u8> bitmap;
+  if (root->index.flags & LARGE_INDEX) {
+    alloc_off = find_named_attribute(rec, rec_size, AT_INDEX_ALLOCATION, name, name_size);
+    unsigned bitmap_off = find_named_attribute(rec, rec_size, AT_BITMAP, name, name_size);
+    if ((alloc_off == -1) || (bitmap_off == -1)) return false;
+    CHECK_FMT(reinterpret_cast<const ATTR_HEADER*>(rec + alloc_off)->non_resident);
+    read_attribute(device, geometry, rec, rec_size, bitmap_off, MAX_INDEX_BITMAP_SIZE, bitmap);
+  }
+
+  walk_index_entries(rec + root_value_off + offsetof(INDEX_ROOT, index), root_info->value_length - offsetof(INDEX_ROOT, index), visitor);
+  if (alloc_off == -1) return true;
+
+  CHECK_FMT(alloc_off + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT) <= rec_size);
+  const ATTR_NONRESIDENT* alloc_info = reinterpret_cast<const ATTR_NONRESIDENT*>(rec + alloc_off + sizeof(ATTR_HEADER));
+  unsigned block_size = root->index_block_size;
+  CHECK_FMT(block_size >= NTFS_BLOCK_SIZE && block_size % NTFS_BLOCK_SIZE == 0 && block_size <= INDEX_CHUNK_SIZE);
+  std::vector<DataRun> data_runs;
+  decode_data_runs(rec, rec_size, alloc_off, data_runs);
+  u64 block_cnt = alloc_info->data_size / block_size;
+  if (block_cnt > static_cast<u64>(bitmap.size()) * 8) block_cnt = static_cast<u64>(bitmap.size()) * 8;
+
+  // read allocation in large chunks, unused blocks are skipped after read
+  unsigned chunk_block_cnt = INDEX_CHUNK_SIZE / block_size;
+  std::vector<u8> chunk(chunk_block_cnt * block_size);
+  for (u64 first_block = 0; first_block < block_cnt; first_block += chunk_block_cnt) {
+    unsigned cnt = block_cnt - first_block < chunk_block_cnt ? static_cast<unsigned>(block_cnt - first_block) : chunk_block_cnt;
+    read_runs(device, geometry, data_runs, first_block * block_size, chunk.data(), cnt * block_size);
+    for (unsigned i = 0; i < cnt; i++) {
+      u64 block = first_block + i;
+      if ((bitmap[static_cast<size_t>(block / 8)] & (1 << (block % 8))) == 0) continue;
+      u8* index_block = chunk.data() + i * block_size;
+      CHECK_FMT(reinterpret_cast<const INDEX_BLOCK*>(index_block)->magic == magic_INDX);
+      CHECK_FMT(apply_fixups(index_block, block_size));
+      walk_index_entries(index_block + offsetof(INDEX_BLOCK, index), block_size - offsetof(INDEX_BLOCK, index), visitor);
+    }
+  }
+  return true;
+}
+
+void parse_usn_records(const u8* buffer, unsigned size, u32 reason_mask, u32 attr_reason_mask, std::vector<u64>& file_refs) {
+  unsigned pos = 0;
+  while (pos + sizeof(USN_RECORD_HEADER) <= size) {
+    const USN_RECORD_HEADER* usn_rec = reinterpret_cast<const USN_RECORD_HEADER*>(buffer + pos);
+    if ((usn_rec->record_length == 0) || (usn_rec->record_length > size - pos)) break;
+    u32 mask = reason_mask;
+    if (usn_rec->file_attributes & (FILE_ATTR_SPARSE_FILE | FILE_ATTR_COMPRESSED)) mask |= attr_reason_mask;
+    if (usn_rec->reason & mask) file_refs.push_back(FILE_REF(usn_rec->file_reference_number));
+    pos += usn_rec->record_length;
+  }
+}
+
+// collects $MFT DATA extension records from attribute list
+struct MftExtRecCollector: public AttrListVisitor {
+  std::vector<const ATTR_LIST_ENTRY*> entries;
+  virtual void visit(const ATTR_LIST_ENTRY* entry) {
+    if ((entry->type == AT_DATA) && (entry->lowest_vcn != 0)) entries.push_back(entry);
+  }
+};
+
+MftReader::MftReader(BlockDevice& device, const NtfsGeometry& geometry): device(device), geometry(geometry), rec_cnt(0) {
+  // $MFT base record is the first record at MftStartLcn
+  std::vector<u8> rec(geometry.file_rec_size);
+  device.read(geometry.mft_start_lcn * geometry.cluster_size, rec.data(), geometry.file_rec_size);
+  CHECK_FMT(apply_fixups(rec.data(), geometry.file_rec_size));
+  const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(rec.data());
+  CHECK_FMT((mft_rec->magic == magic_FILE) && (mft_rec->flags & MFT_RECORD_IN_USE));
+
+  unsigned attr_off = find_attribute(rec.data(), geometry.file_rec_size, AT_DATA);
+  CHECK_FMT(attr_off != -1);
+  const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(rec.data() + attr_off);
+  CHECK_FMT(attr_header->non_resident);
+  add_extents(rec.data(), attr_off);
+  const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(rec.data() + attr_off + sizeof(ATTR_HEADER));
+  rec_cnt = attr_info->initialized_size / geometry.file_rec_size;
+
+  // fragmented $MFT: remaining data runs are stored in extension records
+  unsigned attr_list_off = find_attribute(rec.data(), geometry.file_rec_size, AT_ATTRIBUTE_LIST);
+  if (attr_list_off != -1) {
+    std::vector<u8> attr_list;
+    read_attribute(device, geometry, rec.data(), geometry.file_rec_size, attr_list_off, MAX_ATTR_LIST_SIZE, attr_list);
+    MftExtRecCollector collector;
+    walk_attr_list(attr_list.data(), static_cast<unsigned>(attr_list.size()), collector);
+    std::vector<u8> ext_rec(geometry.file_rec_size);
+    for (unsigned i = 0; i < collector.entries.size(); i++) {
+      // extension records are expected to be inside already known part of $MFT
+      read_record(FILE_REF(collector.entries[i]->mft_reference), ext_rec.data());
+      unsigned ext_attr_off = find_attribute(ext_rec.data(), geometry.file_rec_size, AT_DATA, collector.entries[i]->instance);
+      CHECK_FMT(ext_attr_off != -1);
+      add_extents(ext_rec.data(), ext_attr_off);
+    }
+  }
+
+  CHECK_FMT(extents.size() != 0);
+  CHECK_FMT(rec_cnt * geometry.file_rec_size <= (extents.back().vcn + extents.back().len) * geometry.cluster_size);
+}
+
+void MftReader::add_extents(const u8* rec, unsigned attr_off) {
+  std::vector<DataRun> data_runs;
+  decode_data_runs(rec, geometry.file_rec_size, attr_off, data_runs);
+  const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(rec + attr_off + sizeof(ATTR_HEADER));
+  Extent extent;
+  extent.vcn = extents.size() ? extents.back().vcn + extents.back().len : 0;
+  CHECK_FMT(attr_info->lowest_vcn == extent.vcn);
+  for (unsigned i = 0; i < data_runs.size(); i++) {
+    CHECK_FMT(data_runs[i].lcn != -1); // $MFT cannot be sparse
+    extent.lcn = data_runs[i].lcn;
+    extent.len = data_runs[i].len;
+    extents.push_back(extent);
+    extent.vcn += extent.len;
+  }
+}
+
+// map $MFT data offset to volume offset(s)
+void MftReader::read_data(u64 offset, u8* buf, unsigned size) {
+  for (unsigned i = 0; (i < extents.size()) && (size != 0); i++) {
+    u64 ext_start = extents[i].vcn * geometry.cluster_size;
+    u64 ext_end = ext_start + extents[i].len * geometry.cluster_size;
+    if (offset >= ext_end) continue;
+    u64 ext_left = ext_end - offset;
+    unsigned part_size = ext_left < size ? static_cast<unsigned>(ext_left) : size;
+    device.read(extents[i].lcn * geometry.cluster_size + (offset - ext_start), buf, part_size);
+    offset += part_size;
+    buf += part_size;
+    size -= part_size;
+  }
+  CHECK_FMT(size == 0);
+}
+
+unsigned MftReader::read_records(u64 first_rec, unsigned max_rec_cnt, u8* buf) {
+  if (first_rec >= rec_cnt) return 0;
+  unsigned cnt = rec_cnt - first_rec < max_rec_cnt ? static_cast<unsigned>(rec_cnt - first_rec) : max_rec_cnt;
+  read_data(first_rec * geometry.file_rec_size, buf, cnt * geometry.file_rec_size);
+  for (unsigned i = 0; i < cnt; i++) {
+    u8* rec = buf + i * geometry.file_rec_size;
+    MFT_RECORD* mft_rec = reinterpret_cast<MFT_RECORD*>(rec);
+    if ((mft_rec->magic != magic_FILE) || !apply_fixups(rec, geometry.file_rec_size)) mft_rec->magic = magic_BAAD;
+  }
+  return cnt;
+}
+
+void MftReader::read_record(u64 rec_num, u8* buf) {
+  CHECK_FMT(rec_num < rec_cnt);
+  read_data(rec_num * geometry.file_rec_size, buf, geometry.file_rec_size);
+  CHECK_FMT(apply_fixups(buf, geometry.file_rec_size));
+}
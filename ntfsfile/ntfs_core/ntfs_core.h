@@ -0,0 +1,183 @@
+#pragma once
+
+// platform independent parsing of raw NTFS data structures
+// (no Win32 dependencies, volume data is accessed through BlockDevice)
+
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+#include <stdexcept>
+
+#ifdef _MSC_VER
+typedef unsigned __int8 u8;
+typedef unsigned __int16 u16;
+typedef unsigned __int32 u32;
+typedef unsigned __int64 u64;
+typedef __int8 s8;
+typedef __int16 s16;
+typedef __int32 s32;
+typedef __int64 s64;
+#else
+#include <stdint.h>
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+#endif
+
+#include "ntfs.h"
+
+class NtfsFormatError: public std::runtime_error {
+public:
+  NtfsFormatError(): std::runtime_error("NTFS data structure parsing problem") {
+  }
+};
+
+// raw volume data: volume handle, image file, memory buffer
+class BlockDevice {
+public:
+  virtual ~BlockDevice() {
+  }
+  virtual void read(u64 pos, void* buf, unsigned size) = 0;
+};
+
+struct NtfsGeometry {
+  unsigned sector_size;
+  unsigned cluster_size;
+  unsigned file_rec_size;
+  u64 mft_start_lcn;
+};
+
+// take volume geometry from boot sector
+void read_boot_sector(BlockDevice& device, NtfsGeometry& geometry);
+
+// apply update sequence array fixups to NTFS record (FILE, INDX) in memory
+// returns false if record is damaged
+bool apply_fixups(u8* rec, unsigned size);
+
+struct DataRun {
+  u64 lcn; // -1 for sparse run
+  u64 len;
+  DataRun(u64 lcn, u64 len): lcn(lcn), len(len) {
+  }
+};
+
+// returns offset of attribute in MFT record or -1 if not found; instance 0 matches any attribute of given type
+unsigned find_attribute(const u8* rec, unsigned rec_size, u32 type, u16 instance = 0);
+// same for named attribute (name_size in characters)
+unsigned find_named_attribute(const u8* rec, unsigned rec_size, u32 type, const u16* name, unsigned name_size);
+// attribute iteration: returns offset of first/next attribute or -1 after last one
+unsigned first_attribute(const u8* rec, unsigned rec_size);
+unsigned next_attribute(const u8* rec, unsigned rec_size, unsigned attr_off);
+void decode_data_runs(const u8* rec, unsigned rec_size, unsigned attr_off, std::vector<DataRun>& data_runs);
+// buffer size needed to read attribute: value size of resident attribute, allocated size of non-resident one
+u64 get_attribute_buffer_size(const u8* rec, unsigned rec_size, unsigned attr_off);
+// resident attribute value or contents of non-resident attribute (not compressed or sparse) up to max_size bytes
+// adjacent data runs are read at once; returns value size
+unsigned read_attribute(BlockDevice& device, const NtfsGeometry& geometry, const u8* rec, unsigned rec_size, unsigned attr_off, u8* buf, unsigned max_size);
+void read_attribute(BlockDevice& device, const NtfsGeometry& geometry, const u8* rec, unsigned rec_size, unsigned attr_off, unsigned max_size, std::vector<u8>& value);
+
+// ATTRIBUTE_LIST value
+class AttrListVisitor {
+public:
+  virtual void visit(const ATTR_LIST_ENTRY* entry) = 0;
+};
+void walk_attr_list(const u8* attr_list, unsigned size, AttrListVisitor& visitor);
+
+// INDEX_HEADER of INDEX_ROOT value or INDX block; visitor is called for all entries except end marker
+class IndexVisitor {
+public:
+  virtual void visit(const INDEX_ENTRY* entry) = 0;
+};
+void walk_index_entries(const u8* index_header, unsigned size, IndexVisitor& visitor);
+// all entries of named index (L"$I30" for directories) stored in MFT record
+// returns false if index attributes are not in this record (attribute list)
+bool walk_index(BlockDevice& device, const NtfsGeometry& geometry, const u8* rec, unsigned rec_size, const u16* name, unsigned name_size, IndexVisitor& visitor);
+
+// $UsnJrnl:$J records: references of files with any of reason_mask reasons are appended to file_refs
+// attr_reason_mask reasons count only for sparse or compressed files
+void parse_usn_records(const u8* buffer, unsigned size, u32 reason_mask, u32 attr_reason_mask, std::vector<u64>& file_refs);
+
+// direct access to MFT records bypassing FSCTL_GET_NTFS_FILE_RECORD
+// $MFT data runs are decoded once, records are read from volume in large sequential chunks
+class MftReader {
+private:
+  struct Extent {
+    u64 vcn;
+    u64 lcn;
+    u64 len;
+  };
+  BlockDevice& device;
+  NtfsGeometry geometry;
+  std::vector<Extent> extents;
+  u64 rec_cnt;
+  MftReader(const MftReader&);
+  MftReader& operator=(const MftReader&);
+  void add_extents(const u8* rec, unsigned attr_off);
+  void read_data(u64 offset, u8* buf, unsigned size);
+public:
+  MftReader(BlockDevice& device, const NtfsGeometry& geometry);
+  u64 record_count() const {
+    return rec_cnt;
+  }
+  // read up to max_rec_cnt records starting at first_rec; unusable records are marked with magic_BAAD
+  unsigned read_records(u64 first_rec, unsigned max_rec_cnt, u8* buf);
+  // buf must hold file_rec_size bytes
+  void read_record(u64 rec_num, u8* buf);
+};
+
+// open addressing hash table from file reference (non-zero) to small value
+// used to count every hard-linked file once; lookups do not allocate
+template<class V> class FileRefMap {
+private:
+  struct Slot {
+    u64 file_ref;
+    V value;
+  };
+  std::vector<Slot> slots; // power of 2 size, file_ref == 0 marks free slot
+  size_t cnt;
+  size_t slot_idx(u64 file_ref) const {
+    // Fibonacci hashing: record numbers are dense, sequence numbers sit in top bits
+    return static_cast<size_t>((file_ref * 0x9E3779B97F4A7C15ull) >> 32) & (slots.size() - 1);
+  }
+  void grow() {
+    std::vector<Slot> old_slots(slots.empty() ? 64 : slots.size() * 2);
+    old_slots.swap(slots);
+    for (size_t i = 0; i < slots.size(); i++) slots[i].file_ref = 0;
+    for (size_t i = 0; i < old_slots.size(); i++) {
+      if (old_slots[i].file_ref == 0) continue;
+      size_t idx = slot_idx(old_slots[i].file_ref);
+      while (slots[idx].file_ref != 0) idx = (idx + 1) & (slots.size() - 1);
+      slots[idx] = old_slots[i];
+    }
+  }
+public:
+  FileRefMap(): cnt(0) {
+  }
+  size_t size() const {
+    return cnt;
+  }
+  const V* find(u64 file_ref) const {
+    if (slots.empty()) return NULL;
+    for (size_t idx = slot_idx(file_ref); slots[idx].file_ref != 0; idx = (idx + 1) & (slots.size() - 1)) {
+      if (slots[idx].file_ref == file_ref) return &slots[idx].value;
+    }
+    return NULL;
+  }
+  // returns false and keeps stored value if file_ref is already present
+  bool insert(u64 file_ref, const V& value) {
+    if ((cnt + 1) * 2 > slots.size()) grow();
+    size_t idx = slot_idx(file_ref);
+    for (; slots[idx].file_ref != 0; idx = (idx + 1) & (slots.size() - 1)) {
+      if (slots[idx].file_ref == file_ref) return false;
+    }
+    slots[idx].file_ref = file_ref;
+    slots[idx].value = value;
+    cnt++;
+    return true;
+  }
+};
@@ -0,0 +1,353 @@
+#include "sha.h"
+
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SHA_X86
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <smmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHA_NI_TARGET
+#else
+#include <cpuid.h>
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1")))
+#endif
+#endif
+
+namespace {
+
+inline uint32_t rol(uint32_t value, unsigned bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+inline uint32_t ror(uint32_t value, unsigned bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+
+inline uint32_t load_be32(const uint8_t* data) {
+  return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) | (static_cast<uint32_t>(data[2]) << 8) | data[3];
+}
+
+inline void store_be32(uint8_t* data, uint32_t value) {
+  data[0] = static_cast<uint8_t>(value >> 24);
+  data[1] = static_cast<uint8_t>(value >> 16);
+  data[2] = static_cast<uint8_t>(value >> 8);
+  data[3] = static_cast<uint8_t>(value);
+}
+
+const uint32_t c_sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+void sha1_compress_portable(uint32_t* state, const uint8_t* blocks, size_t block_cnt) {
+  for (size_t n = 0; n < block_cnt; n++, blocks += 64) {
+    uint32_t w[80];
+    for (unsigned i = 0; i < 16; i++) w[i] = load_be32(blocks + i * 4);
+    for (unsigned i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (unsigned i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      }
+      else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      }
+      else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      }
+      else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t t = rol(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rol(b, 30);
+      b = a;
+      a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+void sha256_compress_portable(uint32_t* state, const uint8_t* blocks, size_t block_cnt) {
+  for (size_t n = 0; n < block_cnt; n++, blocks += 64) {
+    uint32_t w[64];
+    for (unsigned i = 0; i < 16; i++) w[i] = load_be32(blocks + i * 4);
+    for (unsigned i = 16; i < 64; i++) {
+      uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for (unsigned i = 0; i < 64; i++) {
+      uint32_t s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + c_sha256_k[i] + w[i];
+      uint32_t s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#ifdef SHA_X86
+
+// 4 rounds: e_in gets next message words, e_out saves a for next group
+#define SHA1_ROUNDS4(e_in, e_out, w, f) \
+  e_in = _mm_sha1nexte_epu32(e_in, w); \
+  e_out = abcd; \
+  abcd = _mm_sha1rnds4_epu32(abcd, e_in, f);
+
+// rounds of groups 4-16 with full message schedule
+#define SHA1_GROUP(e_in, e_out, w, w_next, w_prev2, w_prev, f) \
+  SHA1_ROUNDS4(e_in, e_out, w, f) \
+  w_next = _mm_sha1msg2_epu32(w_next, w); \
+  w_prev = _mm_sha1msg1_epu32(w_prev, w); \
+  w_prev2 = _mm_xor_si128(w_prev2, w);
+
+SHA_NI_TARGET void sha1_compress_shani(uint32_t* state, const uint8_t* blocks, size_t block_cnt) {
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+  __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+  __m128i e1;
+  for (size_t n = 0; n < block_cnt; n++, blocks += 64) {
+    __m128i abcd_save = abcd;
+    __m128i e0_save = e0;
+    __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks)), mask);
+    __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16)), mask);
+    __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 32)), mask);
+    __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 48)), mask);
+
+    e0 = _mm_add_epi32(e0, w0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    SHA1_ROUNDS4(e1, e0, w1, 0)
+    w0 = _mm_sha1msg1_epu32(w0, w1);
+    SHA1_ROUNDS4(e0, e1, w2, 0)
+    w1 = _mm_sha1msg1_epu32(w1, w2);
+    w0 = _mm_xor_si128(w0, w2);
+    SHA1_ROUNDS4(e1, e0, w3, 0)
+    w0 = _mm_sha1msg2_epu32(w0, w3);
+    w2 = _mm_sha1msg1_epu32(w2, w3);
+    w1 = _mm_xor_si128(w1, w3);
+    SHA1_GROUP(e0, e1, w0, w1, w2, w3, 0)
+    SHA1_GROUP(e1, e0, w1, w2, w3, w0, 1)
+    SHA1_GROUP(e0, e1, w2, w3, w0, w1, 1)
+    SHA1_GROUP(e1, e0, w3, w0, w1, w2, 1)
+    SHA1_GROUP(e0, e1, w0, w1, w2, w3, 1)
+    SHA1_GROUP(e1, e0, w1, w2, w3, w0, 1)
+    SHA1_GROUP(e0, e1, w2, w3, w0, w1, 2)
+    SHA1_GROUP(e1, e0, w3, w0, w1, w2, 2)
+    SHA1_GROUP(e0, e1, w0, w1, w2, w3, 2)
+    SHA1_GROUP(e1, e0, w1, w2, w3, w0, 2)
+    SHA1_GROUP(e0, e1, w2, w3, w0, w1, 2)
+    SHA1_GROUP(e1, e0, w3, w0, w1, w2, 3)
+    SHA1_GROUP(e0, e1, w0, w1, w2, w3, 3)
+    SHA1_ROUNDS4(e1, e0, w1, 3)
+    w2 = _mm_sha1msg2_epu32(w2, w1);
+    w3 = _mm_xor_si128(w3, w1);
+    SHA1_ROUNDS4(e0, e1, w2, 3)
+    w3 = _mm_sha1msg2_epu32(w3, w2);
+    SHA1_ROUNDS4(e1, e0, w3, 3)
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+// 4 rounds: two sha256rnds2 with message words + constants
+#define SHA256_ROUNDS4(w, i) { \
+  __m128i msg = _mm_add_epi32(w, _mm_loadu_si128(reinterpret_cast<const __m128i*>(c_sha256_k + i))); \
+  state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+  state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E)); \
+}
+
+// message words for next group
+#define SHA256_SCHEDULE(w, w_next, w_prev) \
+  w_next = _mm_sha256msg2_epu32(_mm_add_epi32(w_next, _mm_alignr_epi8(w, w_prev, 4)), w);
+
+#define SHA256_GROUP(w, w_next, w_prev, i) \
+  SHA256_ROUNDS4(w, i) \
+  SHA256_SCHEDULE(w, w_next, w_prev) \
+  w_prev = _mm_sha256msg1_epu32(w_prev, w);
+
+SHA_NI_TARGET void sha256_compress_shani(uint32_t* state, const uint8_t* blocks, size_t block_cnt) {
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1); // CDAB
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B); // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+  for (size_t n = 0; n < block_cnt; n++, blocks += 64) {
+    __m128i abef_save = state0;
+    __m128i cdgh_save = state1;
+    __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks)), mask);
+    __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16)), mask);
+    __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 32)), mask);
+    __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 48)), mask);
+
+    SHA256_ROUNDS4(w0, 0)
+    SHA256_ROUNDS4(w1, 4)
+    w0 = _mm_sha256msg1_epu32(w0, w1);
+    SHA256_ROUNDS4(w2, 8)
+    w1 = _mm_sha256msg1_epu32(w1, w2);
+    SHA256_GROUP(w3, w0, w2, 12)
+    SHA256_GROUP(w0, w1, w3, 16)
+    SHA256_GROUP(w1, w2, w0, 20)
+    SHA256_GROUP(w2, w3, w1, 24)
+    SHA256_GROUP(w3, w0, w2, 28)
+    SHA256_GROUP(w0, w1, w3, 32)
+    SHA256_GROUP(w1, w2, w0, 36)
+    SHA256_GROUP(w2, w3, w1, 40)
+    SHA256_GROUP(w3, w0, w2, 44)
+    SHA256_GROUP(w0, w1, w3, 48)
+    SHA256_ROUNDS4(w1, 52)
+    SHA256_SCHEDULE(w1, w2, w0)
+    SHA256_ROUNDS4(w2, 56)
+    SHA256_SCHEDULE(w2, w3, w1)
+    SHA256_ROUNDS4(w3, 60)
+
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+  }
+  tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+
+ShaKernel detect_kernel() {
+  int regs1[4], regs7[4];
+#ifdef _MSC_VER
+  __cpuid(regs1, 0);
+  if (regs1[0] < 7) return sk_portable;
+  __cpuid(regs1, 1);
+  __cpuidex(regs7, 7, 0);
+#else
+  unsigned a, b, c, d;
+  if ((__get_cpuid_max(0, NULL) < 7) || (__get_cpuid(1, &a, &b, &c, &d) == 0)) return sk_portable;
+  regs1[2] = static_cast<int>(c);
+  __cpuid_count(7, 0, a, b, c, d);
+  regs7[1] = static_cast<int>(b);
+#endif
+  const int c_sse41 = 1 << 19; // cpuid 1, ecx
+  const int c_sha = 1 << 29; // cpuid 7, ebx
+  if ((regs1[2] & c_sse41) && (regs7[1] & c_sha)) return sk_shani;
+  return sk_portable;
+}
+
+#else
+
+ShaKernel detect_kernel() {
+  return sk_portable;
+}
+
+#endif
+
+const ShaKernel g_sha_kernel = detect_kernel();
+
+}
+
+ShaKernel sha_kernel() {
+  return g_sha_kernel;
+}
+
+bool sha_kernel_supported(ShaKernel kernel) {
+  return (kernel != sk_shani) || (g_sha_kernel == sk_shani);
+}
+
+template<unsigned state_size> void ShaContext<state_size>::update(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  total_size += size;
+  if (buffer_size != 0) {
+    size_t part = 64 - buffer_size < size ? 64 - buffer_size : size;
+    memcpy(buffer + buffer_size, bytes, part);
+    buffer_size += static_cast<unsigned>(part);
+    bytes += part;
+    size -= part;
+    if (buffer_size < 64) return;
+    compress(state, buffer, 1);
+    buffer_size = 0;
+  }
+  if (size >= 64) {
+    compress(state, bytes, size / 64);
+    bytes += size & ~static_cast<size_t>(63);
+    size &= 63;
+  }
+  memcpy(buffer, bytes, size);
+  buffer_size = static_cast<unsigned>(size);
+}
+
+template<unsigned state_size> void ShaContext<state_size>::finish(uint8_t* digest) {
+  uint64_t bit_size = total_size * 8;
+  buffer[buffer_size++] = 0x80;
+  if (buffer_size > 56) {
+    memset(buffer + buffer_size, 0, 64 - buffer_size);
+    compress(state, buffer, 1);
+    buffer_size = 0;
+  }
+  memset(buffer + buffer_size, 0, 56 - buffer_size);
+  store_be32(buffer + 56, static_cast<uint32_t>(bit_size >> 32));
+  store_be32(buffer + 60, static_cast<uint32_t>(bit_size));
+  compress(state, buffer, 1);
+  for (unsigned i = 0; i < state_size; i++) store_be32(digest + i * 4, state[i]);
+}
+
+template class ShaContext<5>;
+template class ShaContext<8>;
+
+Sha1::Sha1(ShaKernel kernel) {
+  const uint32_t c_init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  memcpy(state, c_init, sizeof(state));
+#ifdef SHA_X86
+  compress = kernel == sk_shani ? sha1_compress_shani : sha1_compress_portable;
+#else
+  compress = sha1_compress_portable;
+#endif
+}
+
+Sha256::Sha256(ShaKernel kernel) {
+  const uint32_t c_init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  memcpy(state, c_init, sizeof(state));
+#ifdef SHA_X86
+  compress = kernel == sk_shani ? sha256_compress_shani : sha256_compress_portable;
+#else
+  compress = sha256_compress_portable;
+#endif
+}
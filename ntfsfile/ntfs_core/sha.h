@@ -0,0 +1,51 @@
+#pragma once
+
+// SHA-1 / SHA-256 with compression function chosen at startup:
+// SHA extensions (SHA-NI) if CPU has them, portable C otherwise
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum ShaKernel {
+  sk_portable,
+  sk_shani, // needs SHA extensions and SSE4.1
+};
+
+// fastest kernel supported by CPU
+ShaKernel sha_kernel();
+bool sha_kernel_supported(ShaKernel kernel);
+
+typedef void (*ShaCompress)(uint32_t* state, const uint8_t* blocks, size_t block_cnt);
+
+// 64 byte block buffering and length padding shared by both hashes
+template<unsigned state_size> class ShaContext {
+protected:
+  uint32_t state[state_size];
+  uint64_t total_size;
+  uint8_t buffer[64];
+  unsigned buffer_size;
+  ShaCompress compress;
+  ShaContext(): total_size(0), buffer_size(0) {
+  }
+  void finish(uint8_t* digest);
+public:
+  void update(const void* data, size_t size);
+};
+
+class Sha1: public ShaContext<5> {
+public:
+  static const unsigned c_digest_size = 20;
+  Sha1(ShaKernel kernel = sha_kernel());
+  void final(uint8_t* digest) {
+    finish(digest);
+  }
+};
+
+class Sha256: public ShaContext<8> {
+public:
+  static const unsigned c_digest_size = 32;
+  Sha256(ShaKernel kernel = sha_kernel());
+  void final(uint8_t* digest) {
+    finish(digest);
+  }
+};
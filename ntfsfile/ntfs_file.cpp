@@ -1,13 +1,14 @@
 #define _ERROR_WINDOWS
 #include "error.h"
 
-#include "volume.h"
 #include "utils.h"
-#include "ntfs.h"
+#include "ntfs_core/ntfs_core.h"
+#include "volume.h"
 #include "ntfs_file.h"
 
 #define NTFS_FMT_ERR MsgError(L"NTFS data structure parsing problem")
 #define NTFS_FILE_REC_HEADER_SIZE offsetof(NTFS_FILE_RECORD_OUTPUT_BUFFER, FileRecordBuffer)
+#define MFT_REC_OFFSET 16 // record position in scratch buffer (aligned, FSCTL output header fits before it)
 #define MAX_ATTR_LIST_SIZE (10 * 1024 * 1024)
 #define CHECK_FMT(code) { if (!(code)) FAIL(NTFS_FMT_ERR); }
 
@@ -72,24 +73,45 @@ void FileInfo::find_full_paths() {
   }
 }
 
-u64 FileInfo::load_mft_record(u64 mft_rec_num, Array<u8>& ntfs_file_rec_buf) {
+u64 FileInfo::load_mft_record(u64 mft_rec_num, MftRecord& ntfs_file_rec_buf) {
+  if (mft_chunk && (FILE_REF(mft_rec_num) - mft_chunk_first_rec < mft_chunk_rec_cnt)) {
+    u16 seq_num = static_cast<u16>(mft_rec_num >> 48);
+    mft_rec_num = FILE_REF(mft_rec_num);
+    ntfs_file_rec_buf.set(mft_chunk + static_cast<size_t>(mft_rec_num - mft_chunk_first_rec) * volume->file_rec_size, volume->file_rec_size);
+    const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(ntfs_file_rec_buf.data());
+    CHECK_FMT(mft_rec->magic == magic_FILE);
+    // chunk may be older than reference: record was freed and reused since
+    CHECK_FMT((seq_num == 0) || (mft_rec->sequence_number == seq_num));
+    return mft_rec_num;
+  }
+  u8* rec_buf = ntfs_file_rec_buf.buf(MFT_REC_OFFSET + volume->file_rec_size) + MFT_REC_OFFSET;
+  if (mft_reader) {
+    mft_rec_num = FILE_REF(mft_rec_num);
+    mft_reader->read_record(mft_rec_num, rec_buf);
+    ntfs_file_rec_buf.set(rec_buf, volume->file_rec_size);
+    const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(ntfs_file_rec_buf.data());
+    CHECK_FMT(mft_rec->magic == magic_FILE);
+    return mft_rec_num;
+  }
+
   NTFS_FILE_RECORD_INPUT_BUFFER ntfs_file_rec_in;
   ntfs_file_rec_in.FileReferenceNumber.QuadPart = mft_rec_num;
 
   unsigned ntfs_file_rec_out_size = NTFS_FILE_REC_HEADER_SIZE + volume->file_rec_size;
+  u8* ntfs_file_rec_out_buf = rec_buf - NTFS_FILE_REC_HEADER_SIZE;
 
   DWORD bytes_ret;
-  CHECK_SYS(DeviceIoControl(volume->handle, FSCTL_GET_NTFS_FILE_RECORD, &ntfs_file_rec_in, sizeof(ntfs_file_rec_in), ntfs_file_rec_buf.buf(ntfs_file_rec_out_size), ntfs_file_rec_out_size, &bytes_ret, NULL));
-  ntfs_file_rec_buf.set_size(bytes_ret);
+  CHECK_SYS(DeviceIoControl(volume->handle, FSCTL_GET_NTFS_FILE_RECORD, &ntfs_file_rec_in, sizeof(ntfs_file_rec_in), ntfs_file_rec_out_buf, ntfs_file_rec_out_size, &bytes_ret, NULL));
 
-  CHECK_FMT(ntfs_file_rec_buf.size() >= NTFS_FILE_REC_HEADER_SIZE);
-  const NTFS_FILE_RECORD_OUTPUT_BUFFER* ntfs_file_rec_out = reinterpret_cast<const NTFS_FILE_RECORD_OUTPUT_BUFFER*>(ntfs_file_rec_buf.data());
-  CHECK_FMT(ntfs_file_rec_buf.size() == NTFS_FILE_REC_HEADER_SIZE + ntfs_file_rec_out->FileRecordLength);
+  CHECK_FMT(bytes_ret >= NTFS_FILE_REC_HEADER_SIZE);
+  const NTFS_FILE_RECORD_OUTPUT_BUFFER* ntfs_file_rec_out = reinterpret_cast<const NTFS_FILE_RECORD_OUTPUT_BUFFER*>(ntfs_file_rec_out_buf);
+  CHECK_FMT(bytes_ret == NTFS_FILE_REC_HEADER_SIZE + ntfs_file_rec_out->FileRecordLength);
   CHECK_FMT(ntfs_file_rec_out->FileRecordLength >= sizeof(MFT_RECORD));
 
   mft_rec_num = FILE_REF(ntfs_file_rec_out->FileReferenceNumber.QuadPart);
 
-  ntfs_file_rec_buf.remove(0, NTFS_FILE_REC_HEADER_SIZE);
+  // record follows output header, no need to move it
+  ntfs_file_rec_buf.set(rec_buf, ntfs_file_rec_out->FileRecordLength);
 
   const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(ntfs_file_rec_buf.data());
   CHECK_FMT(mft_rec->magic == magic_FILE);
@@ -97,64 +119,7 @@ u64 FileInfo::load_mft_record(u64 mft_rec_num, Array<u8>& ntfs_file_rec_buf) {
   return mft_rec_num;
 }
 
-unsigned FileInfo::find_attribute(const Array<u8>& ntfs_file_rec_buf, u32 type, u16 instance) {
-  const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(ntfs_file_rec_buf.data());
-
-  unsigned attr_off = mft_rec->attrs_offset;
-  while (true) {
-    const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(ntfs_file_rec_buf.data() + attr_off);
-    CHECK_FMT(attr_off + sizeof(attr_header->type) <= ntfs_file_rec_buf.size());
-    if (attr_header->type == AT_END) return -1; // not found
-    CHECK_FMT(attr_off + sizeof(ATTR_HEADER) <= ntfs_file_rec_buf.size());
-
-    if (type == attr_header->type) {
-      if ((instance == 0) || (instance == attr_header->instance)) return attr_off; // found
-    }
-
-    CHECK_FMT(attr_header->length != 0); // prevent infinite loop
-    attr_off += attr_header->length;
-  }
-}
-
-Array<FileInfo::DataRun> FileInfo::decode_data_runs(const Array<u8>& ntfs_file_rec_buf, unsigned attr_off) {
-  Array<DataRun> data_run_list;
-
-  CHECK_FMT(attr_off + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT) <= ntfs_file_rec_buf.size());
-  const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(ntfs_file_rec_buf.data() + attr_off + sizeof(ATTR_HEADER));
-
-  const u8* data_runs = ntfs_file_rec_buf.data();
-  unsigned idx = attr_off + attr_info->mapping_pairs_offset;
-  data_run_list.extend((ntfs_file_rec_buf.size() - idx) / 3);
-  u64 lcn = 0;
-  while (true) {
-    CHECK_FMT(idx < ntfs_file_rec_buf.size());
-    if (data_runs[idx] == 0) break; // end marker
-    unsigned len_l = data_runs[idx] & 0x0F;
-    unsigned off_l = (data_runs[idx] & 0xF0) >> 4;
-    idx++;
-    CHECK_FMT(idx + len_l + off_l <= ntfs_file_rec_buf.size());
-    u64 len = 0;
-    unsigned i;
-    for (i = 0; i < len_l; i++) {
-      len += static_cast<u64>(data_runs[idx++]) << (i * 8);
-    }
-    if (off_l == 0) {
-      data_run_list += DataRun(-1, len); // sparse
-      continue;
-    }
-    s64 off = 0;
-    for (i = 0; i + 1 < off_l; i++) {
-      off |= static_cast<u64>(data_runs[idx++]) << (i * 8);
-    }
-    off |= static_cast<s64>(static_cast<s8>(data_runs[idx++])) << (i * 8);
-    lcn = lcn + off;
-    data_run_list += DataRun(lcn, len);
-  }
-
-  return data_run_list;
-}
-
-void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned attr_off) {
+void FileInfo::process_attribute(const MftRecord& ntfs_file_rec_buf, unsigned attr_off) {
   const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(ntfs_file_rec_buf.data());
   const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(ntfs_file_rec_buf.data() + attr_off);
   CHECK_FMT(attr_off + sizeof(ATTR_HEADER) <= ntfs_file_rec_buf.size());
@@ -256,7 +221,8 @@ void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned at
       extent = attr_info->lowest_vcn != 0;
     }
     // fragments
-    Array<DataRun> data_runs = decode_data_runs(ntfs_file_rec_buf, attr_off);
+    std::vector<DataRun> data_runs;
+    decode_data_runs(ntfs_file_rec_buf.data(), ntfs_file_rec_buf.size(), attr_off, data_runs);
     u64 fragments = 0;
     if (!extent) {
       prev_lcn = 0;
@@ -280,22 +246,42 @@ void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned at
   }
 }
 
-void FileInfo::process_attr_list_entry(const ATTR_LIST_ENTRY* attr_list_entry, Array<u64>& ext_rec_list) {
-  if (attr_list_entry->mft_reference == base_file_rec_num) {
-    unsigned attr_off = find_attribute(base_file_rec_buf, attr_list_entry->type, attr_list_entry->instance);
-    CHECK_FMT(attr_off != -1);
-    process_attribute(base_file_rec_buf, attr_off);
-  }
-  else {
-    if (ext_rec_list.search(attr_list_entry->mft_reference) == -1) {
-      ext_rec_list += attr_list_entry->mft_reference;
-      mft_rec_cnt++;
+// entries are grouped by MFT record: each extension record is loaded once, attributes are processed in list order
+void FileInfo::process_attr_list(const u8* attr_list_data, unsigned attr_list_size) {
+  struct EntryCollector: public AttrListVisitor {
+    std::vector<const ATTR_LIST_ENTRY*>* entries;
+    virtual void visit(const ATTR_LIST_ENTRY* attr_list_entry) {
+      entries->push_back(attr_list_entry);
     }
+  };
+  attr_list_entries.clear();
+  EntryCollector collector;
+  collector.entries = &attr_list_entries;
+  walk_attr_list(attr_list_data, attr_list_size, collector);
+
+  ext_rec_list.clear();
+  for (unsigned i = 0; i < attr_list_entries.size(); i++) {
+    u64 rec_num = FILE_REF(attr_list_entries[i]->mft_reference);
+    if (rec_num != FILE_REF(base_file_rec_num)) ext_rec_list.push_back(rec_num);
+  }
+  sort(ext_rec_list.begin(), ext_rec_list.end());
+  ext_rec_list.erase(unique(ext_rec_list.begin(), ext_rec_list.end()), ext_rec_list.end());
+  mft_rec_cnt += static_cast<unsigned>(ext_rec_list.size());
 
-    load_mft_record(attr_list_entry->mft_reference, ext_file_rec_buf);
-    unsigned attr_off = find_attribute(ext_file_rec_buf, attr_list_entry->type, attr_list_entry->instance);
+  if (ext_file_rec_bufs.size() < ext_rec_list.size()) ext_file_rec_bufs.resize(ext_rec_list.size());
+  for (unsigned i = 0; i < ext_rec_list.size(); i++) {
+    load_mft_record(ext_rec_list[i], ext_file_rec_bufs[i]);
+  }
+
+  for (unsigned i = 0; i < attr_list_entries.size(); i++) {
+    const ATTR_LIST_ENTRY* attr_list_entry = attr_list_entries[i];
+    u64 rec_num = FILE_REF(attr_list_entry->mft_reference);
+    const MftRecord* file_rec_buf;
+    if (rec_num == FILE_REF(base_file_rec_num)) file_rec_buf = &base_file_rec_buf;
+    else file_rec_buf = &ext_file_rec_bufs[lower_bound(ext_rec_list.begin(), ext_rec_list.end(), rec_num) - ext_rec_list.begin()];
+    unsigned attr_off = find_attribute(file_rec_buf->data(), file_rec_buf->size(), attr_list_entry->type, attr_list_entry->instance);
     CHECK_FMT(attr_off != -1);
-    process_attribute(ext_file_rec_buf, attr_off);
+    process_attribute(*file_rec_buf, attr_off);
   }
 }
 
@@ -303,95 +289,155 @@ void FileInfo::process_base_file_rec() {
   attr_list.clear();
   file_name_list.clear();
   // is attr. list present?
-  unsigned attr_list_off = find_attribute(base_file_rec_buf, AT_ATTRIBUTE_LIST);
+  unsigned attr_list_off = find_attribute(base_file_rec_buf.data(), base_file_rec_buf.size(), AT_ATTRIBUTE_LIST);
   // init. mft record counter
   mft_rec_cnt = 1;
-  Array<u64> ext_rec_list;
   // no ATTRIBUTE_LIST - one MFT file record
   if (attr_list_off == -1) {
-    const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(base_file_rec_buf.data());
-
     // walk over list of attributes stored in a base file record
-    unsigned attr_off = mft_rec->attrs_offset;
-    while (true) {
-      const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(base_file_rec_buf.data() + attr_off);
-      CHECK_FMT(attr_off + sizeof(attr_header->type) <= base_file_rec_buf.size());
-      if (attr_header->type == AT_END) break; // end of attribute list
-      CHECK_FMT(attr_off + sizeof(ATTR_HEADER) <= base_file_rec_buf.size());
-
+    for (unsigned attr_off = first_attribute(base_file_rec_buf.data(), base_file_rec_buf.size()); attr_off != -1; attr_off = next_attribute(base_file_rec_buf.data(), base_file_rec_buf.size(), attr_off)) {
       process_attribute(base_file_rec_buf, attr_off);
-
-      CHECK_FMT(attr_header->length != 0); // prevent infinite loop
-      attr_off += attr_header->length;
     }
   }
   // ATTRIBUTE_LIST present
   else {
     process_attribute(base_file_rec_buf, attr_list_off);
     const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(base_file_rec_buf.data() + attr_list_off);
-    // non-resident ATTRIBUTE_LIST
+    // non-resident ATTRIBUTE_LIST is read from disk into volume arena
+    // arena is locked for device read only, extension records are loaded from private copy
     if (attr_header->non_resident) {
-      CHECK_FMT(attr_list_off + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT) <= base_file_rec_buf.size());
-      const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(base_file_rec_buf.data() + attr_list_off + sizeof(ATTR_HEADER));
-      CHECK_FMT(attr_info->allocated_size <= MAX_ATTR_LIST_SIZE);
-      Array<DataRun> data_runs = decode_data_runs(base_file_rec_buf, attr_list_off);
-      // calculate disk size using data runs
-      u64 attr_disk_size = 0;
-      for (unsigned i = 0; i < data_runs.size(); i++) {
-        CHECK_FMT(data_runs[i].lcn != -1); // compressed or sparse not allowed
-        attr_disk_size += data_runs[i].len * volume->cluster_size;
-      }
-      CHECK_FMT(attr_disk_size == attr_info->allocated_size);
-      CHECK_FMT(attr_info->data_size <= attr_info->allocated_size);
-
-      // load attribute list data from disk
-      u8* attr_data_buf = static_cast<u8*>(VirtualAlloc(NULL, static_cast<SIZE_T>(attr_disk_size), MEM_COMMIT, PAGE_READWRITE));
-      CHECK_SYS(attr_data_buf != NULL);
-      CLEAN(u8*, attr_data_buf, CHECK_SYS(VirtualFree(attr_data_buf, 0, MEM_RELEASE)));
-
-      unsigned buf_pos = 0;
-      for (unsigned i = 0; i < data_runs.size(); i++) {
-        LARGE_INTEGER pos;
-        pos.QuadPart = data_runs[i].lcn * volume->cluster_size;
-        CHECK_SYS(SetFilePointerEx(volume->handle, pos, NULL, FILE_BEGIN));
-
-        unsigned size = static_cast<unsigned>(data_runs[i].len * volume->cluster_size);
-        DWORD bytes_ret;
-        volume->flush();
-        CHECK_SYS(ReadFile(volume->handle, attr_data_buf + buf_pos, size, &bytes_ret, NULL));
-        CHECK_FMT(size == bytes_ret);
-        buf_pos += size;
+      volume->flush();
+      unsigned buf_size = static_cast<unsigned>(min<u64>(get_attribute_buffer_size(base_file_rec_buf.data(), base_file_rec_buf.size(), attr_list_off), MAX_ATTR_LIST_SIZE));
+      {
+        CriticalSectionLock lock(volume->arena_cs);
+        u8* arena = volume->get_arena(buf_size);
+        unsigned attr_list_size = read_attribute(*volume, *volume, base_file_rec_buf.data(), base_file_rec_buf.size(), attr_list_off, arena, buf_size);
+        attr_list_buf.assign(arena, arena + attr_list_size);
       }
+      process_attr_list(attr_list_buf.data(), static_cast<unsigned>(attr_list_buf.size()));
+    }
+    else {
+      std::vector<u8> attr_list_data;
+      read_attribute(*volume, *volume, base_file_rec_buf.data(), base_file_rec_buf.size(), attr_list_off, MAX_ATTR_LIST_SIZE, attr_list_data);
+      process_attr_list(attr_list_data.data(), static_cast<unsigned>(attr_list_data.size()));
+    }
+  }
+}
 
-      // process attribute list entries
-      unsigned idx = 0;
-      while (idx != attr_info->data_size) {
-        CHECK_FMT(idx + sizeof(ATTR_LIST_ENTRY) <= attr_info->data_size);
-        const ATTR_LIST_ENTRY* attr_list_entry = reinterpret_cast<const ATTR_LIST_ENTRY*>(attr_data_buf + idx);
+void FileInfo::process_file(u64 file_ref_num, bool cached) {
+  if (cached && g_file_info_cache.find(*volume, file_ref_num, *this)) return;
+  load_base_file_rec(file_ref_num);
+  process_base_file_rec();
+  g_file_info_cache.store(*volume, file_ref_num, *this);
+}
 
-        process_attr_list_entry(attr_list_entry, ext_rec_list);
+const unsigned c_file_info_cache_size = 16384; // entries per volume
 
-        CHECK_FMT(attr_list_entry->length != 0);
-        idx += attr_list_entry->length;
-      }
-    }
-    // resident ATTRIBUTE_LIST
-    else {
-      CHECK_FMT(attr_list_off + sizeof(ATTR_HEADER) + sizeof(ATTR_RESIDENT) <= base_file_rec_buf.size());
-      const ATTR_RESIDENT* attr_info = reinterpret_cast<const ATTR_RESIDENT*>(base_file_rec_buf.data() + attr_list_off + sizeof(ATTR_HEADER));
-      unsigned idx = attr_info->value_offset;
+FileInfoCache g_file_info_cache;
 
-      // process attribute list entries
-      while (idx != attr_info->value_offset + attr_info->value_length) {
-        CHECK_FMT(idx < attr_info->value_offset + attr_info->value_length);
-        CHECK_FMT(attr_list_off + idx + sizeof(ATTR_LIST_ENTRY) <= base_file_rec_buf.size());
-        const ATTR_LIST_ENTRY* attr_list_entry = reinterpret_cast<const ATTR_LIST_ENTRY*>(base_file_rec_buf.data() + attr_list_off + idx);
+// cache is shared by flat scan workers and col strings are reference counted without interlocked operations:
+// entries never share string buffers with callers
+template<class T> static void copy_unshared(ObjectArray<T>& dst, const ObjectArray<T>& src) {
+  dst.clear();
+  dst.extend(src.size());
+  for (unsigned i = 0; i < src.size(); i++) {
+    dst += src[i];
+    T& item = dst.last_item();
+    item.name = UnicodeString(src[i].name.data(), src[i].name.size());
+  }
+}
 
-        process_attr_list_entry(attr_list_entry, ext_rec_list);
+void FileInfoCache::VolumeCache::remove(u64 rec_num) {
+  std::map<u64, EntryList::iterator>::iterator idx = index.find(rec_num);
+  if (idx != index.end()) {
+    entries.erase(idx->second);
+    index.erase(idx);
+  }
+}
 
-        CHECK_FMT(attr_list_entry->length != 0);
-        idx += attr_list_entry->length;
+void FileInfoCache::sync(NtfsVolume& volume) {
+  USN_JOURNAL_DATA journal_data;
+  DWORD bytes_ret;
+  bool journal = DeviceIoControl(volume.handle, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal_data, sizeof(journal_data), &bytes_ret, NULL) != 0;
+  DWORDLONG usn_journal_id;
+  USN next_usn;
+  {
+    CriticalSectionLock lock(cs);
+    VolumeCache& cache = volumes[volume.serial];
+    // journal is missing, was recreated or already discarded records after previous sync: start over
+    if (!journal || !cache.active || (cache.usn_journal_id != journal_data.UsnJournalID) || (cache.next_usn < journal_data.FirstUsn)) {
+      cache.clear();
+      cache.active = journal;
+      if (journal) {
+        cache.usn_journal_id = journal_data.UsnJournalID;
+        cache.next_usn = journal_data.NextUsn;
       }
+      return;
     }
+    usn_journal_id = cache.usn_journal_id;
+    next_usn = cache.next_usn;
+  }
+
+  std::vector<u64> file_refs;
+  bool error = false;
+  try {
+    // cached attribute list includes $EA, $OBJECT_ID and $SECURITY_DESCRIPTOR, so every reason counts
+    volume.read_usn_journal(usn_journal_id, next_usn, false, 0xFFFFFFFF, file_refs);
+  }
+  catch (Error&) {
+    error = true;
+  }
+
+  CriticalSectionLock lock(cs);
+  VolumeCache& cache = volumes[volume.serial];
+  if (!cache.active || (cache.usn_journal_id != usn_journal_id)) return;
+  if (error) {
+    cache.clear();
+    cache.active = false;
+    return;
+  }
+  for (unsigned i = 0; i < file_refs.size(); i++) {
+    cache.remove(file_refs[i]);
+  }
+  if (next_usn > cache.next_usn) cache.next_usn = next_usn;
+}
+
+bool FileInfoCache::find(const NtfsVolume& volume, u64 file_ref_num, FileInfo& file_info) {
+  CriticalSectionLock lock(cs);
+  std::map<DWORD, VolumeCache>::iterator vol = volumes.find(volume.serial);
+  if ((vol == volumes.end()) || !vol->second.active) return false;
+  VolumeCache& cache = vol->second;
+  std::map<u64, EntryList::iterator>::const_iterator idx = cache.index.find(FILE_REF(file_ref_num));
+  if ((idx == cache.index.end()) || (idx->second->file_ref_num != file_ref_num)) return false;
+  cache.entries.splice(cache.entries.begin(), cache.entries, idx->second);
+  const Entry& entry = *idx->second;
+  file_info.base_file_rec_num = FILE_REF(file_ref_num);
+  file_info.mft_rec_cnt = entry.mft_rec_cnt;
+  file_info.std_info = entry.std_info;
+  copy_unshared(file_info.attr_list, entry.attr_list);
+  copy_unshared(file_info.file_name_list, entry.file_name_list);
+  return true;
+}
+
+void FileInfoCache::store(const NtfsVolume& volume, u64 file_ref_num, const FileInfo& file_info) {
+  // directory index size changes are journaled for children only
+  if (file_info.base_mft_rec()->flags & MFT_RECORD_IS_DIRECTORY) return;
+  CriticalSectionLock lock(cs);
+  std::map<DWORD, VolumeCache>::iterator vol = volumes.find(volume.serial);
+  if ((vol == volumes.end()) || !vol->second.active) return;
+  VolumeCache& cache = vol->second;
+  u64 rec_num = FILE_REF(file_ref_num);
+  cache.remove(rec_num);
+  cache.entries.push_front(Entry());
+  Entry& entry = cache.entries.front();
+  entry.file_ref_num = file_ref_num;
+  entry.mft_rec_cnt = file_info.mft_rec_cnt;
+  entry.std_info = file_info.std_info;
+  copy_unshared(entry.attr_list, file_info.attr_list);
+  copy_unshared(entry.file_name_list, file_info.file_name_list);
+  cache.index[rec_num] = cache.entries.begin();
+  if (cache.entries.size() > c_file_info_cache_size) {
+    cache.index.erase(FILE_REF(cache.entries.back().file_ref_num));
+    cache.entries.pop_back();
   }
 }
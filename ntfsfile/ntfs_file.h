@@ -34,27 +34,61 @@ struct StdInfo {
   u32 file_attributes;
 };
 
+// MFT record being processed: view of reusable scratch buffer or of record owned by caller
+// record data is needed only while file is processed, so copies are empty
+class MftRecord {
+private:
+  std::vector<u8> scratch;
+  const u8* rec;
+  unsigned rec_size;
+public:
+  MftRecord(): rec(NULL), rec_size(0) {
+  }
+  MftRecord(const MftRecord&): rec(NULL), rec_size(0) {
+  }
+  MftRecord& operator=(const MftRecord&) {
+    rec = NULL;
+    rec_size = 0;
+    return *this;
+  }
+  u8* buf(unsigned size) {
+    if (scratch.size() < size) scratch.resize(size);
+    return scratch.data();
+  }
+  void set(const u8* data, unsigned size) {
+    rec = data;
+    rec_size = size;
+  }
+  const u8* data() const {
+    return rec;
+  }
+  unsigned size() const {
+    return rec_size;
+  }
+};
+
 class FileInfo {
+  friend class FileInfoCache;
 private:
   u64 base_file_rec_num;
-  struct DataRun {
-    u64 lcn;
-    u64 len;
-    DataRun(u64 lcn, u64 len): lcn(lcn), len(len) {
-    }
-  };
   u64 prev_lcn;
   u64 prev_len;
-  Array<u8> base_file_rec_buf;
-  Array<u8> ext_file_rec_buf;
-  u64 load_mft_record(u64 mft_rec_num, Array<u8>& ntfs_file_rec_buf);
-  unsigned find_attribute(const Array<u8>& ntfs_file_rec_buf, u32 type, u16 instance = 0);
-  Array<DataRun> decode_data_runs(const Array<u8>& ntfs_file_rec_buf, unsigned attr_off);
-  void process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned attr_off);
-  void process_attr_list_entry(const ATTR_LIST_ENTRY* attr_list_entry, Array<u64>& ext_rec_list);
+  MftRecord base_file_rec_buf;
+  std::vector<MftRecord> ext_file_rec_bufs;
+  std::vector<const ATTR_LIST_ENTRY*> attr_list_entries;
+  std::vector<u64> ext_rec_list;
+  std::vector<u8> attr_list_buf; // private copy of non-resident attribute list
+  // MFT chunk already read by caller
+  const u8* mft_chunk;
+  u64 mft_chunk_first_rec;
+  unsigned mft_chunk_rec_cnt;
+  u64 load_mft_record(u64 mft_rec_num, MftRecord& ntfs_file_rec_buf);
+  void process_attribute(const MftRecord& ntfs_file_rec_buf, unsigned attr_off);
+  void process_attr_list(const u8* attr_list_data, unsigned attr_list_size);
 public:
   // filled by external code
   NtfsVolume* volume;
+  MftReader* mft_reader; // optional: read MFT records directly from disk instead of FSCTL_GET_NTFS_FILE_RECORD
   UnicodeString file_name;
   unsigned hard_link_cnt;
   bool directory;
@@ -65,6 +99,8 @@ public:
   ObjectArray<AttrInfo> attr_list;
   ObjectArray<FileNameAttr> file_name_list;
 public:
+  FileInfo(): mft_chunk(NULL), mft_chunk_first_rec(0), mft_chunk_rec_cnt(0), volume(NULL), mft_reader(NULL) {
+  }
   bool operator==(const FileInfo& file_info) const {
     return base_file_rec_num == file_info.base_file_rec_num;
   }
@@ -75,6 +111,17 @@ public:
   u64 load_base_file_rec(u64 file_ref_num) {
     return base_file_rec_num = load_mft_record(file_ref_num, base_file_rec_buf);
   }
+  // use MFT record already read from disk (fixups applied); file_rec must stay valid until file is processed
+  void set_base_file_rec(u64 file_ref_num, const u8* file_rec) {
+    base_file_rec_num = file_ref_num;
+    base_file_rec_buf.set(file_rec, volume->file_rec_size);
+  }
+  // extension records found in this chunk (fixups applied) are not read again; chunk must stay valid until it is reset
+  void set_mft_chunk(u64 first_rec, unsigned rec_cnt, const u8* chunk) {
+    mft_chunk = chunk;
+    mft_chunk_first_rec = first_rec;
+    mft_chunk_rec_cnt = rec_cnt;
+  }
   u64 file_ref_num() const {
     return base_file_rec_num;
   }
@@ -82,9 +129,44 @@ public:
     return reinterpret_cast<const MFT_RECORD*>(base_file_rec_buf.data());
   }
   void process_base_file_rec();
-  void process_file(u64 file_ref_num) {
-    load_base_file_rec(file_ref_num);
-    process_base_file_rec();
-  }
+  // cached = false: record is read even if file is in cache
+  void process_file(u64 file_ref_num, bool cached = true);
   void find_full_paths();
 };
+
+// recently processed files (LRU), separate list for each volume
+// entry is found only if file reference including sequence number matches
+// cache is used only while volume has USN journal: sync() drops files changed since previous sync
+class FileInfoCache: private NonCopyable {
+private:
+  struct Entry {
+    u64 file_ref_num;
+    unsigned mft_rec_cnt;
+    StdInfo std_info;
+    ObjectArray<AttrInfo> attr_list;
+    ObjectArray<FileNameAttr> file_name_list;
+  };
+  typedef std::list<Entry> EntryList;
+  struct VolumeCache {
+    bool active;
+    DWORDLONG usn_journal_id;
+    USN next_usn;
+    EntryList entries; // most recently used first
+    std::map<u64, EntryList::iterator> index; // by MFT record number
+    VolumeCache(): active(false), usn_journal_id(0), next_usn(0) {
+    }
+    void clear() {
+      entries.clear();
+      index.clear();
+    }
+    void remove(u64 rec_num);
+  };
+  CriticalSection cs;
+  std::map<DWORD, VolumeCache> volumes; // by volume serial number
+public:
+  void sync(NtfsVolume& volume);
+  bool find(const NtfsVolume& volume, u64 file_ref_num, FileInfo& file_info);
+  void store(const NtfsVolume& volume, u64 file_ref_num, const FileInfo& file_info);
+};
+
+extern FileInfoCache g_file_info_cache;
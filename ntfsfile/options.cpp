@@ -8,6 +8,11 @@
 extern struct PluginStartupInfo g_far;
 
 bool g_use_standard_inf_units;
+unsigned g_mft_scan_threads;
+unsigned g_content_io_block_size; // MB
+unsigned g_content_io_queue_depth; // outstanding reads
+bool g_usn_ignore_data_overwrite;
+bool g_mft_cache_compression;
 ContentOptions g_content_options;
 
 class Options {
@@ -170,6 +175,8 @@ FilePanelMode::FilePanelMode():
   use_cache(false),
   default_mft_mode(true),
   backward_mft_scan(true),
+  bulk_mft_read(true),
+  usn_watcher(false),
   flat_mode_auto_off(true),
   cache_dir(L"%TEMP%") {
 }
@@ -186,6 +193,11 @@ void load_plugin_options() {
   if (!options.create())
     return;
   g_use_standard_inf_units = options.get_bool(L"StandardInformationUnits", false);
+  g_mft_scan_threads = options.get_int(L"MftScanThreads", 0);
+  g_content_io_block_size = options.get_int(L"ContentIoBlockSize", 1);
+  g_content_io_queue_depth = options.get_int(L"ContentIoQueueDepth", 4);
+  g_usn_ignore_data_overwrite = options.get_bool(L"UsnIgnoreDataOverwrite", true);
+  g_mft_cache_compression = options.get_bool(L"MftCacheCompression", false);
   ContentOptions def_content_options;
   g_content_options.compression = options.get_bool(L"ContentOptionsCompression", def_content_options.compression);
   g_content_options.crc32 = options.get_bool(L"ContentOptionsCRC32", def_content_options.crc32);
@@ -215,6 +227,8 @@ void load_plugin_options() {
   g_file_panel_mode.use_cache = options.get_bool(L"FilePanelUseCache", def_file_panel_mode.use_cache);
   g_file_panel_mode.default_mft_mode = options.get_bool(L"FilePanelDefaultMftMode", def_file_panel_mode.default_mft_mode);
   g_file_panel_mode.backward_mft_scan = options.get_bool(L"FilePanelBackwardMftScan", def_file_panel_mode.backward_mft_scan);
+  g_file_panel_mode.bulk_mft_read = options.get_bool(L"FilePanelBulkMftRead", def_file_panel_mode.bulk_mft_read);
+  g_file_panel_mode.usn_watcher = options.get_bool(L"FilePanelUsnWatcher", def_file_panel_mode.usn_watcher);
   g_file_panel_mode.cache_dir = options.get_str(L"FilePanelCacheDir", def_file_panel_mode.cache_dir);
   g_file_panel_mode.flat_mode_auto_off = options.get_bool(L"FilePanelFlatModeAutoOff", def_file_panel_mode.flat_mode_auto_off);
   CompressFilesParams def_compress_files_params;
@@ -257,6 +271,8 @@ void store_plugin_options() {
   options.set_bool(L"FilePanelUseCache", g_file_panel_mode.use_cache, def_file_panel_mode.use_cache);
   options.set_bool(L"FilePanelDefaultMftMode", g_file_panel_mode.default_mft_mode, def_file_panel_mode.default_mft_mode);
   options.set_bool(L"FilePanelBackwardMftScan", g_file_panel_mode.backward_mft_scan, def_file_panel_mode.backward_mft_scan);
+  options.set_bool(L"FilePanelBulkMftRead", g_file_panel_mode.bulk_mft_read, def_file_panel_mode.bulk_mft_read);
+  options.set_bool(L"FilePanelUsnWatcher", g_file_panel_mode.usn_watcher, def_file_panel_mode.usn_watcher);
   options.set_str(L"FilePanelCacheDir", g_file_panel_mode.cache_dir, def_file_panel_mode.cache_dir);
   options.set_bool(L"FilePanelFlatModeAutoOff", g_file_panel_mode.flat_mode_auto_off, def_file_panel_mode.flat_mode_auto_off);
   CompressFilesParams def_compress_files_params;
@@ -33,6 +33,8 @@ struct FilePanelMode {
   bool use_cache;
   bool default_mft_mode;
   bool backward_mft_scan;
+  bool bulk_mft_read;
+  bool usn_watcher;
   bool flat_mode_auto_off;
   UnicodeString cache_dir;
   FilePanelMode();
@@ -48,6 +50,11 @@ struct CompressFilesParams {
 
 /* plugin options */
 extern bool g_use_standard_inf_units;
+extern unsigned g_mft_scan_threads;
+extern unsigned g_content_io_block_size;
+extern unsigned g_content_io_queue_depth;
+extern bool g_usn_ignore_data_overwrite; // skip data overwrites of files that are neither sparse nor compressed
+extern bool g_mft_cache_compression;
 extern ContentOptions g_content_options;
 extern FilePanelMode g_file_panel_mode;
 extern CompressFilesParams g_compress_files_params;
@@ -629,6 +629,74 @@ Semaphore::~Semaphore() {
   CloseHandle(h_sem);
 }
 
+unsigned get_cpu_count() {
+  SYSTEM_INFO sys_info;
+  GetSystemInfo(&sys_info);
+  return sys_info.dwNumberOfProcessors;
+}
+
+struct ParallelState {
+  ParallelTask* task;
+  unsigned task_cnt;
+  volatile LONG next_idx;
+  volatile LONG failed;
+  UnicodeString error; // set by first failed thread only
+};
+
+unsigned __stdcall parallel_proc(void* param) {
+  ParallelState* st = static_cast<ParallelState*>(param);
+  try {
+    while (!st->failed) {
+      unsigned idx = InterlockedIncrement(&st->next_idx) - 1;
+      if (idx >= st->task_cnt) break;
+      st->task->run(idx);
+    }
+  }
+  catch (Error& e) {
+    if (InterlockedExchange(&st->failed, 1) == 0) st->error = e.message();
+  }
+  catch (std::exception& e) {
+    if (InterlockedExchange(&st->failed, 1) == 0) st->error = oem_to_unicode(e.what());
+  }
+  catch (...) {
+    if (InterlockedExchange(&st->failed, 1) == 0) st->error = L"Unexpected error";
+  }
+  return 0;
+}
+
+void run_parallel(ParallelTask& task, unsigned task_cnt) {
+  unsigned num_th = min(min(get_cpu_count(), task_cnt), MAXIMUM_WAIT_OBJECTS);
+  if (num_th <= 1) {
+    for (unsigned i = 0; i < task_cnt; i++) task.run(i);
+    return;
+  }
+  ParallelState st;
+  st.task = &task;
+  st.task_cnt = task_cnt;
+  st.next_idx = 0;
+  st.failed = 0;
+  // calling thread is one of workers
+  Array<HANDLE> h_threads;
+  try {
+    for (unsigned i = 0; i + 1 < num_th; i++) {
+      unsigned th_id;
+      HANDLE h = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, parallel_proc, &st, 0, &th_id));
+      CHECK_SYS(h != NULL);
+      h_threads += h;
+    }
+  }
+  catch (...) {
+    InterlockedExchange(&st.failed, 1);
+    VERIFY(WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE) != WAIT_FAILED);
+    for (unsigned i = 0; i < h_threads.size(); i++) CloseHandle(h_threads[i]);
+    throw;
+  }
+  parallel_proc(&st);
+  VERIFY(WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE) != WAIT_FAILED);
+  for (unsigned i = 0; i < h_threads.size(); i++) CloseHandle(h_threads[i]);
+  if (st.failed) FAIL(MsgError(st.error));
+}
+
 File::File(const UnicodeString& file_path, DWORD dwDesiredAccess, DWORD dwShareMode, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes) {
   h_file = CreateFileW(long_path(file_path).data(), dwDesiredAccess, dwShareMode, NULL, dwCreationDisposition, dwFlagsAndAttributes, NULL);
   CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
@@ -658,6 +726,33 @@ unsigned File::read(void* data, unsigned size) {
   return size_read;
 }
 
+FileMapping::FileMapping(const UnicodeString& file_path): h_file(INVALID_HANDLE_VALUE), h_mapping(NULL), view(nullptr), view_size(0) {
+  try {
+    h_file = CreateFileW(long_path(file_path).data(), FILE_READ_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
+    LARGE_INTEGER file_size;
+    CHECK_SYS(GetFileSizeEx(h_file, &file_size));
+    CHECK(static_cast<unsigned __int64>(file_size.QuadPart) <= static_cast<size_t>(-1));
+    if (file_size.QuadPart == 0) return;
+    h_mapping = CreateFileMappingW(h_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CHECK_SYS(h_mapping);
+    view = static_cast<const unsigned char*>(MapViewOfFile(h_mapping, FILE_MAP_READ, 0, 0, 0));
+    CHECK_SYS(view);
+    view_size = static_cast<size_t>(file_size.QuadPart);
+  }
+  catch (...) {
+    if (h_mapping) CloseHandle(h_mapping);
+    if (h_file != INVALID_HANDLE_VALUE) CloseHandle(h_file);
+    throw;
+  }
+}
+
+FileMapping::~FileMapping() {
+  if (view) UnmapViewOfFile(view);
+  if (h_mapping) CloseHandle(h_mapping);
+  if (h_file != INVALID_HANDLE_VALUE) CloseHandle(h_file);
+}
+
 FileEnum::FileEnum(const UnicodeString& dir_path): dir_path(dir_path), h_find(INVALID_HANDLE_VALUE) {
 }
 
@@ -179,6 +179,16 @@ public:
   }
 };
 
+// work item for run_parallel()
+class ParallelTask {
+public:
+  virtual void run(unsigned idx) = 0;
+};
+
+unsigned get_cpu_count();
+// run task for indices 0 .. task_cnt - 1 on all CPUs; first error is rethrown in calling thread
+void run_parallel(ParallelTask& task, unsigned task_cnt);
+
 class File: private NonCopyable {
 protected:
   HANDLE h_file;
@@ -195,6 +205,27 @@ public:
   void write(const void* data, unsigned size);
 };
 
+// whole file mapped read-only
+class FileMapping: private NonCopyable {
+protected:
+  HANDLE h_file;
+  HANDLE h_mapping;
+  const unsigned char* view;
+  size_t view_size;
+public:
+  FileMapping(const UnicodeString& file_path);
+  ~FileMapping();
+  const unsigned char* data() const {
+    return view;
+  }
+  size_t size() const {
+    return view_size;
+  }
+  HANDLE handle() const {
+    return h_file;
+  }
+};
+
 struct FindData: public WIN32_FIND_DATAW {
   bool is_dir() const {
     return (dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
@@ -2,7 +2,7 @@
 #include "error.h"
 
 #include "utils.h"
-#include "ntfs.h"
+#include "ntfs_core/ntfs_core.h"
 #include "options.h"
 #include "volume.h"
 
@@ -85,6 +85,8 @@ void NtfsVolume::open(const UnicodeString& volume_name) {
     file_rec_size = ntfs_vol_data.BytesPerFileRecordSegment;
     cluster_size = ntfs_vol_data.BytesPerCluster;
     mft_size = ntfs_vol_data.MftValidDataLength.QuadPart;
+    sector_size = ntfs_vol_data.BytesPerSector;
+    mft_start_lcn = ntfs_vol_data.MftStartLcn.QuadPart;
   }
   catch (...) {
     close();
@@ -92,6 +94,86 @@ void NtfsVolume::open(const UnicodeString& volume_name) {
   }
 }
 
+void read_handle(HANDLE handle, unsigned __int64 pos, void* buf, unsigned size) {
+  OVERLAPPED ov;
+  memzero(ov);
+  ov.Offset = static_cast<DWORD>(pos);
+  ov.OffsetHigh = static_cast<DWORD>(pos >> 32);
+  DWORD bytes_ret;
+  CHECK_SYS(ReadFile(handle, buf, size, &bytes_ret, &ov));
+  CHECK_MSG(bytes_ret == size, L"Unexpected end of volume data");
+}
+
+// positional read from volume handle; unaligned requests go through bounce buffer
+void NtfsVolume::read(unsigned __int64 pos, void* buf, unsigned size) {
+  unsigned __int64 aligned_pos = pos / sector_size * sector_size;
+  unsigned head_size = static_cast<unsigned>(pos - aligned_pos);
+  unsigned aligned_size = (head_size + size + sector_size - 1) / sector_size * sector_size;
+  if ((head_size == 0) && (aligned_size == size) && (reinterpret_cast<size_t>(buf) % sector_size == 0)) {
+    read_handle(handle, pos, buf, size);
+  }
+  else {
+    u8* read_buf = static_cast<u8*>(VirtualAlloc(NULL, aligned_size, MEM_COMMIT, PAGE_READWRITE));
+    CHECK_SYS(read_buf != NULL);
+    CLEAN(u8*, read_buf, CHECK_SYS(VirtualFree(read_buf, 0, MEM_RELEASE)));
+    read_handle(handle, aligned_pos, read_buf, aligned_size);
+    memcpy(buf, read_buf + head_size, size);
+  }
+}
+
+const unsigned c_arena_granularity = 0x10000;
+
+u8* NtfsVolume::get_arena(unsigned size) {
+  if (size > arena_size) {
+    if (arena) {
+      CHECK_SYS(VirtualFree(arena, 0, MEM_RELEASE));
+      arena = NULL;
+      arena_size = 0;
+    }
+    unsigned alloc_size = (size + c_arena_granularity - 1) / c_arena_granularity * c_arena_granularity;
+    arena = static_cast<u8*>(VirtualAlloc(NULL, alloc_size, MEM_COMMIT, PAGE_READWRITE));
+    CHECK_SYS(arena != NULL);
+    arena_size = alloc_size;
+  }
+  return arena;
+}
+
+const unsigned c_usn_watch_bytes = 0x1000;
+
+// read journal records starting from next_usn; in wait mode first read blocks until new records arrive or timeout expires
+// file_refs receives sorted unique references of files changed for any of reason_mask reasons
+// data overwrite of sparse or compressed file can change allocated size, so those records are kept regardless of reason_mask
+void NtfsVolume::read_usn_journal(DWORDLONG usn_journal_id, USN& next_usn, bool wait, DWORD reason_mask, std::vector<u64>& file_refs) {
+  READ_USN_JOURNAL_DATA read_usn_data;
+  read_usn_data.StartUsn = next_usn;
+  read_usn_data.ReasonMask = reason_mask | USN_REASON_DATA_OVERWRITE;
+  read_usn_data.ReturnOnlyOnClose = FALSE;
+  read_usn_data.Timeout = wait ? c_usn_watch_timeout / 1000 : 0; // seconds
+  read_usn_data.BytesToWaitFor = wait ? c_usn_watch_bytes : 0;
+  read_usn_data.UsnJournalID = usn_journal_id;
+
+  Array<unsigned char> usn_buffer;
+  const unsigned c_min_usn_buffer_size = 0x10000;
+  const unsigned c_max_usn_buffer_size = 0x400000;
+  unsigned usn_buffer_size = c_min_usn_buffer_size;
+  while(true) {
+    DWORD bytes_ret;
+    CHECK_SYS(DeviceIoControl(handle, FSCTL_READ_USN_JOURNAL, &read_usn_data, sizeof(read_usn_data), usn_buffer.buf(usn_buffer_size), usn_buffer_size, &bytes_ret, NULL));
+    usn_buffer.set_size(bytes_ret);
+    read_usn_data.Timeout = 0;
+    read_usn_data.BytesToWaitFor = 0;
+    if (usn_buffer.size() < sizeof(USN)) break;
+    read_usn_data.StartUsn = *reinterpret_cast<const USN*>(usn_buffer.data());
+    if (usn_buffer.size() == sizeof(USN)) break;
+    parse_usn_records(usn_buffer.data() + sizeof(USN), usn_buffer.size() - sizeof(USN), reason_mask, USN_REASON_DATA_OVERWRITE, file_refs);
+    // journal has more data than fits: grow buffer to reduce number of calls
+    if ((bytes_ret > usn_buffer_size / 2) && (usn_buffer_size < c_max_usn_buffer_size)) usn_buffer_size *= 2;
+  }
+  std::sort(file_refs.begin(), file_refs.end());
+  file_refs.erase(std::unique(file_refs.begin(), file_refs.end()), file_refs.end());
+  next_usn = read_usn_data.StartUsn;
+}
+
 void NtfsVolume::flush() {
   if (!synced) {
     HANDLE handle = CreateFileW(get_volume_path(name).data(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
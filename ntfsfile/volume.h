@@ -6,18 +6,28 @@ struct VolumeInfo {
   VolumeInfo(const UnicodeString& file_name);
 };
 
-struct NtfsVolume {
+const unsigned c_usn_watch_timeout = 1000; // ms
+
+// USN reasons that do not change anything stored in MFT index
+const DWORD c_usn_ignored_reasons = USN_REASON_CLOSE | USN_REASON_SECURITY_CHANGE | USN_REASON_OBJECT_ID_CHANGE | USN_REASON_EA_CHANGE;
+
+struct NtfsVolume: public BlockDevice, public NtfsGeometry {
+private:
+  u8* arena;
+  unsigned arena_size;
+public:
   UnicodeString name;
   DWORD serial;
-  unsigned file_rec_size;
-  unsigned cluster_size;
   unsigned __int64 mft_size;
   HANDLE handle;
   bool synced;
-  NtfsVolume(): handle(INVALID_HANDLE_VALUE), serial(0) {
+  // page aligned scratch buffer for raw attribute reads (no bounce buffer needed), hold arena_cs while using it
+  CriticalSection arena_cs;
+  NtfsVolume(): arena(NULL), arena_size(0), handle(INVALID_HANDLE_VALUE), serial(0) {
   }
   ~NtfsVolume() {
     close();
+    if (arena) VirtualFree(arena, 0, MEM_RELEASE);
   }
   void close() {
     if (handle != INVALID_HANDLE_VALUE) {
@@ -29,6 +39,9 @@ struct NtfsVolume {
   }
   void open(const UnicodeString& volume_name);
   void flush();
+  u8* get_arena(unsigned size);
+  virtual void read(unsigned __int64 pos, void* buf, unsigned size);
+  void read_usn_journal(DWORDLONG usn_journal_id, USN& next_usn, bool wait, DWORD reason_mask, std::vector<u64>& file_refs);
 };
 
 UnicodeString get_real_path(const UnicodeString& fp);
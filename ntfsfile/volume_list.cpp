@@ -3,7 +3,7 @@
 
 #include "options.h"
 #include "utils.h"
-#include "ntfs.h"
+#include "ntfs_core/ntfs_core.h"
 #include "volume.h"
 #include "ntfs_file.h"
 #include "file_panel.h"